@@ -1,8 +1,37 @@
+#ifdef __linux__
+#define _GNU_SOURCE		// syscall() for perf_event_open, -std=c17 hides it otherwise
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
 #include <time.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#else
+#include <process.h>
+#endif
 
 #include "SDL.h"
 
@@ -11,8 +40,24 @@ typedef struct {
 	SDL_Renderer *renderer;
 	SDL_AudioSpec want, have;
 	SDL_AudioDeviceID dev;
+	SDL_Texture *mega_texture;	// MegaChip frames are uploaded here instead of drawn pixel by pixel
 } sdl_t;
 
+// XO-CHIP pattern sound, copied from the machine by update_timers() under the audio device lock
+typedef struct audio_pattern {
+	bool enabled;			// Play the pattern instead of the square wave
+	uint8_t bits[16];		// 128 1 bit samples, MSB first
+	uint8_t pitch;			// FX3A pitch the step was computed from
+	uint32_t step;			// Pattern bits per output sample, 16.16 fixed point
+	uint32_t position;		// Current bit, 16.16 fixed point
+} audio_pattern_t;
+
+// Audio underrun tracking shared by the audio callback and the main thread
+typedef struct audio_stats {
+	SDL_atomic_t underruns;		// Callbacks late enough for the device to have run dry
+	SDL_atomic_t last_callback;	// SDL_GetTicks() of the last callback, 0 once unpaused
+} audio_stats_t;
+
 // CHIP8 Instruction format
 typedef struct {
 	uint16_t opcode;
@@ -23,17 +68,76 @@ typedef struct {
 	uint8_t Y;			// 4 bit register identifier
 } instruction_t;
 
+// Behaviours ROMs disagree on, each bit switches one away from this emulator's default
+#define QUIRK_SHIFT_VY 0x01		// 8XY6/8XYE shift VY into VX instead of shifting VX in place
+#define QUIRK_LOAD_STORE_I 0x02	// FX55/FX65 leave I incremented past the last register
+#define QUIRK_JUMP_VX 0x04		// BXNN jumps to XNN + VX instead of NNN + V0
+#define QUIRK_VF_RESET 0x08		// 8XY1/8XY2/8XY3 reset VF to 0
+#define QUIRK_WRAP 0x10			// DXYN wraps sprites around the screen edges instead of clipping
+
+// Common profiles, each gets its own specialised interpreter (see emulate_instruction())
+#define QUIRKS_DEFAULT 0
+#define QUIRKS_COSMAC (QUIRK_SHIFT_VY | QUIRK_LOAD_STORE_I | QUIRK_VF_RESET)
+#define QUIRKS_SCHIP QUIRK_JUMP_VX
+#define QUIRKS_XOCHIP (QUIRK_SHIFT_VY | QUIRK_LOAD_STORE_I | QUIRK_WRAP)
+#define QUIRKS_AUTO UINT32_MAX	// Pick the profile from the ROM hash database
+
+static const struct {
+	const char *name;
+	uint32_t quirks;
+} quirk_profiles[] = {
+	{"default", QUIRKS_DEFAULT},
+	{"cosmac", QUIRKS_COSMAC},
+	{"schip", QUIRKS_SCHIP},
+	{"xochip", QUIRKS_XOCHIP},
+};
+
 typedef struct {
 	uint32_t window_width;		// SDL window width
 	uint32_t window_height;		// SDL window height
-	uint32_t fg_color;			// foreground color RGBA8888
-	uint32_t bg_color;			// background color RGBA8888
+	uint32_t palette[4];		// RGBA8888 color per pixel value, plane 0 bit | plane 1 bit << 1
 	uint32_t scale_factor;		// amount to scale a CHIP8 pixel by
 	bool pixel_outlines;		// Draw pixel outlines yes/no
 	uint32_t insts_per_second;	// CHIP8 CPU "clock rate" or hx
 	uint32_t square_wave_freq; 	// Freq of square wave sound
 	uint32_t audio_sample_rate; //	
 	int16_t volume;				// Volume of sound 
+	uint32_t run_ahead_frames;	// Frames to emulate ahead of input, 0 = off
+	const char *record_file;	// Movie file to record input to, NULL = off
+	const char *play_file;		// Movie file to play input back from, NULL = off
+	uint64_t seek_inst;			// Instruction count to seek to before playback starts
+	uint32_t keyframe_interval;	// Frames between state keyframes while recording
+	bool headless;				// Run without a window or audio, as fast as possible
+	bool fuzz;					// Coverage guided input fuzzing instead of playing
+	uint32_t fuzz_jobs;			// Fuzzing threads, 0 = 1 per CPU
+	uint32_t fuzz_frames;		// Frames of input per fuzz case
+	uint32_t fuzz_seconds;		// Fuzzing time limit, 0 = forever
+	const char *fuzz_dir;		// Directory for kept inputs and crash movies, NULL = don't save
+	const char *trace_file;		// Binary instruction trace written on exit, NULL = off
+	uint32_t trace_size;		// Trace ring buffer records, rounded up to a power of 2
+	const char *decode_file;	// Binary trace to print as text instead of running a ROM
+	const char *corpus_path;	// Packed corpus file or directory of ROMs mapped once, the ROM is looked up in it
+	const char *pack_corpus;	// Write the corpus out as a packed corpus file instead of running
+	uint32_t batch_frames;		// Run every corpus ROM this many frames instead of playing, 0 = off
+	uint32_t quirks;			// QUIRK_* flags forced for every ROM, QUIRKS_AUTO = by ROM hash
+	const char *frame_trace_file;	// Chrome trace JSON of frame phases, NULL = off
+	bool print_stats;			// Print frame time percentiles on exit
+	bool show_stats;			// Show frame time percentiles in the window title, toggled with F1
+	const char *profile_file;	// Folded guest call stacks written on exit, NULL = off
+	const char *coverage_file;	// Per address coverage written on exit, NULL = off
+	const char *listing_file;	// Coverage annotated ROM listing written on exit, NULL = off
+	const char *cfg_file;		// Static control flow graph JSON written instead of running, NULL = off
+	const char *disasm_path;	// Listing written instead of running, a directory for a whole corpus, NULL = off
+	const char *cache_dir;		// Directory of ROM translations kept between runs, NULL = translate every run
+	struct debugger *debugger;	// Breakpoints and watchpoints, NULL = none set
+	const char *gdb_address;	// GDB remote TCP port or Unix socket path, NULL = off
+	const char *metrics_address;	// Prometheus metrics TCP port or Unix socket path, NULL = off
+	void *audio_stats;			// audio_stats_t the audio callback counts underruns in, NULL = off. Only
+								//	set and read through SDL_AtomicSetPtr/GetPtr as the callback can be running
+	struct audio_pattern *audio_pattern;	// XO-CHIP sound the audio callback plays, NULL = square wave only
+	bool perf_counters;			// Report host hardware counters per emulated instruction on exit
+	uint32_t profile_interval;	// Instructions between profiler samples
+	const char *rom_name;		// First argument that is not an option
 } config_t;
 	
 typedef enum {
@@ -42,23 +146,407 @@ typedef enum {
 	PAUSED,
 } emulator_state_t;
 
+// Guest anomalies, the instruction that raises one is skipped so host memory stays safe
+typedef enum {
+	FAULT_NONE,
+	FAULT_STACK_OVERFLOW,	// 2NNN with all 12 stack entries in use
+	FAULT_STACK_UNDERFLOW,	// 00EE with an empty stack
+	FAULT_BAD_ADDRESS,		// I or PC range outside of ram
+	FAULT_BAD_KEY,			// EX9E/EXA1 key in VX > 0xF
+	FAULT_BAD_OPCODE,		// Unimplemented or invalid opcode
+	FAULT_NO_MEMORY,		// The host could not allocate state the guest switched on (MegaChip)
+} fault_t;
+
+#define EDGE_MAP_SIZE (1 << 14)	// Fuzzing edge coverage map entries, power of 2
+
+// Binary trace record, 1 per emulated instruction
+typedef struct {
+	uint16_t PC;			// Address of the instruction
+	uint16_t opcode;
+	uint32_t I;				// I before the instruction, 24 bit in MegaChip mode
+	uint16_t operand;		// Word after the opcode, the address of F000 NNNN and 01NN NNNN
+	uint8_t VX;				// VX and VY before the instruction
+	uint8_t VY;
+	uint8_t input;			// Other value the instruction reads: keypad[VX] for EX9E/EXA1,
+							//	the delay timer for FX07, V0 for BNNN
+	uint8_t reg;			// Register the instruction changed, TRACE_NO_REG if none
+	uint8_t value;			// New value of that register
+	uint8_t reg2;			// A second changed register, e.g. VF after 8XY4-8XYE
+	uint8_t value2;
+} trace_record_t;
+
+#define TRACE_NO_REG 0xFF
+
+// Ring buffer of the most recent trace records
+typedef struct tracer {
+	trace_record_t *records;
+	uint32_t mask;			// Capacity - 1, capacity is a power of 2
+	uint64_t count;			// Records written in total, oldest is overwritten when full
+} tracer_t;
+
+// Trace file header, followed by min(count, capacity) records oldest first
+typedef struct {
+	char magic[4];			// "C8TR"
+	uint32_t version;
+	uint64_t count;			// Records in the file
+	uint64_t first_inst;	// Instruction number of the first record
+} trace_header_t;
+
+#define TRACE_VERSION 3
+
+#define PROFILER_MAX_DEPTH 32		// Shadow call stack depth, deeper calls share the deepest frame
+#define PROFILER_STACKS 4096		// Distinct sampled stacks kept, power of 2
+
+// Number of samples taken with one exact shadow call stack
+typedef struct {
+	uint64_t count;
+	uint64_t hash;			// 0 = empty slot
+	uint8_t depth;
+	uint16_t frames[PROFILER_MAX_DEPTH + 1];	// Subroutine entries outermost first, then the sampled PC
+} profile_stack_t;
+
+// Guest profiler: a shadow call stack of subroutine entry addresses kept by 2NNN/00EE
+//	alongside the real stack, sampled every interval instructions into folded stacks
+typedef struct profiler {
+	uint16_t shadow[PROFILER_MAX_DEPTH];
+	uint32_t depth;			// Calls currently active, may exceed PROFILER_MAX_DEPTH
+	uint16_t root;			// PC profiling started at, the root frame of every stack
+	uint32_t interval;		// Instructions between samples
+	uint32_t countdown;		// Instructions until the next sample
+	uint64_t samples;
+	uint64_t dropped;		// Samples lost because the stack table was full
+	profile_stack_t *stacks;
+} profiler_t;
+
+// Host hardware counters read around parts of the main loop (Linux perf_event_open)
+typedef enum {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_BRANCH_MISSES,
+	PERF_L1D_MISSES,
+	PERF_COUNTERS,
+} perf_counter_t;
+
+static const char *const perf_counter_names[PERF_COUNTERS] = {
+	[PERF_CYCLES] = "cycles",
+	[PERF_INSTRUCTIONS] = "instructions",
+	[PERF_BRANCH_MISSES] = "branch-misses",
+	[PERF_L1D_MISSES] = "L1d-read-misses",
+};
+
+typedef struct {
+	uint64_t values[PERF_COUNTERS];
+} perf_values_t;
+
+typedef struct {
+	int group;					// Group leader fd, -1 = counters unavailable
+	int slot[PERF_COUNTERS];	// Position in a group read, -1 = counter could not be opened
+	uint32_t opened;			// Counters in the group
+	perf_values_t emulate;		// Totals over instruction batches
+	perf_values_t render;		// Totals over update_screen()
+	uint64_t guest_insts;		// CHIP8 instructions emulated while counting
+	uint64_t frames;
+} perf_counters_t;
+
+// Timed phase of an emulated frame, becomes 1 Chrome trace "complete" event
+typedef struct {
+	const char *name;		// Static string, never freed
+	uint64_t start;			// Performance counter ticks
+	uint64_t end;
+	uint64_t frame;
+} span_t;
+
+#define SPAN_BUFFER_SIZE 4096
+
+// Log-linear histogram of microsecond values: exact below 16us, then 16 sub-buckets per
+//	power of 2, so any recorded value is within ~6% like a 2 digit HDR histogram
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+typedef struct {
+	uint64_t counts[HISTOGRAM_BUCKETS];
+	uint64_t total;
+	uint64_t max;
+} histogram_t;
+
+// Frame timing telemetry of the main loop
+typedef struct {
+	histogram_t emulate;	// Instruction batch
+	histogram_t render;		// update_screen()
+	histogram_t overshoot;	// SDL_Delay() sleeping past what was asked for
+	histogram_t frame;		// Start of one frame to the start of the next
+	uint64_t frames;
+	uint64_t missed;		// Frames longer than the 60hz period plus SDL_Delay's 1ms granularity
+} frame_stats_t;
+
+// Chrome trace-event JSON writer. The main loop fills one preallocated buffer while
+//	a background thread writes out the other, so recording never allocates or blocks on I/O
+typedef struct {
+	span_t buffers[2][SPAN_BUFFER_SIZE];
+	uint32_t fill;			// Buffer the main loop is filling
+	uint32_t used;			// Spans in it
+	uint32_t pending;		// Buffer handed to the writer
+	uint32_t pending_used;	// Spans in it
+	uint64_t frame;			// Current frame number
+	uint64_t origin;		// Counter value at time 0 in the trace
+	bool stop;				// Set with the last hand off
+	SDL_sem *ready;			// Posted when a buffer is handed to the writer
+	SDL_sem *done;			// Posted when the writer is finished with a buffer
+	SDL_Thread *writer;
+	FILE *file;
+} frame_tracer_t;
+
+#define RAM_SIZE 65536		// XO-CHIP address space, CHIP8 and SUPER-CHIP only use the first 4K
+#define RAM_PAGE_SIZE 64		// Granularity of ram write tracking
+#define RAM_PAGES (RAM_SIZE / RAM_PAGE_SIZE)
+#define RAM_DIRTY_WORDS ((RAM_PAGES + 63) / 64)
+#define DISPLAY_WIDTH 128		// SUPER-CHIP hi-res, low res uses the top left 64x32
+#define DISPLAY_ROWS 64
+#define DISPLAY_PLANES 2		// XO-CHIP bitplanes, CHIP8 and SUPER-CHIP only draw to plane 0
+#define DISPLAY_ROW_WORDS (DISPLAY_WIDTH / 64)
+#define DISPLAY_ROW_SIZE (DISPLAY_PLANES * DISPLAY_ROW_WORDS * 8)	// Bytes per display row, all planes
+#define BIG_FONT_ADDR 0x50		// SUPER-CHIP 8x10 font for FX30, after the 4x5 font at 0
+#define MEGA_WIDTH 256			// MegaChip display
+#define MEGA_HEIGHT 192
+#define MEGA_ADDRESS_SPACE (1 << 24)	// Reach of MegaChip's 24 bit I, past ram it reads the ROM image
+#define MEGA_DIRTY_PALETTE MEGA_HEIGHT	// Dirty bit after the index rows, set when the palette changes
+#define MEGA_DIRTY_WORDS ((MEGA_HEIGHT + 1 + 63) / 64)
+
+// Coverage bitmaps, 1 bit per ram address for each kind of access
+#define COVER_EXEC 0			// Any byte of a fetched instruction
+#define COVER_READ 1			// Read as data by DXYN, FX29, FX30 or FX65
+#define COVER_WRITE 2			// Written by FX33 or FX55
+#define COVER_START 3			// First byte of a fetched instruction
+#define COVER_KINDS 4
+
+typedef struct coverage {
+	uint64_t bits[COVER_KINDS][RAM_SIZE / 64];
+} coverage_t;
+
+// Debugger flags, 1 byte per ram address
+#define DEBUG_BREAK 0x1			// Pause before executing the instruction here
+#define DEBUG_WATCH_READ 0x2	// Pause after an instruction reads data from here
+#define DEBUG_WATCH_WRITE 0x4	// Pause after an instruction writes here
+
+// Breakpoints and watchpoints, only consulted by the instrumented interpreter
+typedef struct debugger {
+	uint8_t flags[RAM_SIZE];
+	bool resume;			// Run the next instruction even if it has a breakpoint
+	bool step;				// Pause before the next instruction, after the resumed one
+	bool quiet;				// Don't print a dump on a hit, a remote debugger reports it
+	uint8_t hit;			// DEBUG_* flag that paused last, 0 for a single step
+	uint16_t hit_addr;		// Address that flag is set on
+} debugger_t;
+
+// MegaChip sprite blending, set by 080N
+typedef enum {
+	BLEND_NORMAL,
+	BLEND_25,				// 25% sprite, 75% screen
+	BLEND_50,
+	BLEND_75,
+	BLEND_ADD,				// Saturating add
+	BLEND_MULTIPLY,
+	BLEND_MODES,
+} blend_mode_t;
+
+// MegaChip video state, allocated by the first 0011. Sprites are composed into the back
+//	buffer and 00E0 presents it, the renderer uploads the front buffer as a texture
+typedef struct megachip {
+	bool enabled;			// 0011 on, 0010 off
+	uint32_t palette[256];	// ARGB8888 per palette index, index 0 is transparent
+	uint8_t index[MEGA_HEIGHT][MEGA_WIDTH];	// Palette index last drawn per pixel, for collisions
+	uint32_t frames[2][MEGA_HEIGHT][MEGA_WIDTH];	// ARGB8888 back and front buffer
+	uint8_t back;			// frames[back] is drawn into, frames[!back] is shown
+	uint32_t sprite_width;	// 03NN, 1-256 pixels
+	uint32_t sprite_height;	// 04NN, 1-256 pixels
+	uint8_t blend;			// blend_mode_t
+	uint8_t collision_index;	// Drawing over a pixel of this index sets VF
+	uint8_t alpha;			// 05NN screen alpha
+} megachip_t;
+
+// Superinstructions, runs of common instructions executed as one step. Found by the peephole
+//	pass in translate_rom() and keyed by the address of their first instruction
+typedef enum {
+	SUPER_NONE = 0,
+	SUPER_ADD_SKIP_JUMP,	// 7XNN; 3XNN/4XNN; 1NNN: counted loop
+	SUPER_LOAD_I_ADD,		// ANNN; FX1E: table lookup
+	SUPER_LOAD_I_DRAW,		// ANNN; DXYN
+	SUPER_LOAD_LOAD_DRAW,	// 6XNN; 6YNN; DXYN
+	SUPER_WAIT_DELAY,		// FX07; 3XNN/4XNN; 1NNN back to the FX07: waiting on the delay timer
+} superinstruction_t;
+
+#define TRANSLATION_VERSION 4	// Bump whenever the layout or the analysis and fusion behind it change
+
+// Everything worked out about a ROM before it runs, for one quirk profile. Built by translate_rom()
+//	or mapped from the translation cache, so it holds no pointers
+typedef struct translation {
+	char magic[4];			// "C8TC"
+	uint32_t version;		// TRANSLATION_VERSION
+	uint64_t rom_hash;
+	uint32_t rom_size;
+	uint32_t quirks;
+	uint8_t mega;			// 1 when the analysis found MegaChip code, a byte so mapped files can be checked
+	uint8_t flags[RAM_SIZE];	// ANALYSIS_* flags per ram address
+	uint8_t fused[RAM_SIZE];	// superinstruction_t starting at each ram address
+} translation_t;
+
 // Chip8 machine object
 typedef struct {
 	emulator_state_t state;
-	uint8_t ram[4096];
-	bool display[64*32];	// Emulate original CHIP8 resolution
+	uint8_t ram[RAM_SIZE];
+	uint64_t display[DISPLAY_ROWS][DISPLAY_PLANES][DISPLAY_ROW_WORDS];	// 1 bit per pixel per plane, leftmost
+																	//	in the top bit of word 0
+	bool hires;				// SUPER-CHIP 128x64 mode, 64x32 otherwise
+	uint8_t planes;			// XO-CHIP FN01 bitplanes that are drawn to, cleared and scrolled
+	uint64_t ram_dirty[RAM_DIRTY_WORDS];	// 1 bit per ram page written since the last clear_dirty()
+	uint64_t display_dirty;	// 1 bit per display row changed since the last clear_dirty()
+	uint64_t mega_dirty[MEGA_DIRTY_WORDS];	// 1 bit per MegaChip index row, then the palette, the same way
 	uint16_t stack[12];		// Subroutine stack
 	uint16_t *stack_pointer;
 	uint8_t V[16];			// Data Registers V0-VF
-	uint16_t I;				// Index Register
+	uint32_t I;				// Index Register, 24 bit in MegaChip mode and 16 bit otherwise
 	uint16_t PC;			// Program counter
 	uint8_t delay_timer;	// Decrements at 60hz when > 0
 	uint8_t sound_timer;	// Decrements at 60hz and plays tone when > 0
 	bool keypad[16];		// Hexadeciaml keypad 0x0-0xF
+	uint8_t rpl[16];		// HP48 RPL user flags, saved and loaded by FX75/FX85
+	uint8_t audio_pattern[16];	// XO-CHIP F002 sound pattern
+	uint8_t pitch;			// XO-CHIP FX3A pattern playback pitch
+	bool pattern_audio;		// A pattern was loaded, the sound timer plays it instead of the square wave
+	uint32_t rng_state;		// xorshift32 state for CXNN, part of machine state
+	uint64_t inst_count;	// Instructions emulated since boot
+	uint64_t rom_hash;		// FNV-1a hash of the loaded ROM image
+	uint32_t rom_size;		// Bytes in the ROM image, only the first RAM_SIZE - 0x200 are loaded at 0x200
+	const uint8_t *rom_ext;	// Whole ROM image when it doesn't fit in ram, for MegaChip's 24 bit I.
+							//	Owned by the machine init_chip8_image() loaded, clones share it
+	const struct translation *translation;	// Static analysis of the ROM for its quirks, NULL = none.
+											//	Owned by the machine it was attached to, clones share it
+	bool translation_mapped;	// translation is mapped from the cache rather than allocated
+	struct megachip *mega;	// MegaChip mode, NULL until the ROM enables it. Not part of snapshots:
+							//	loading one keeps the current MegaChip frames, clones start without them
+	uint32_t quirks;		// QUIRK_* flags the ROM expects
+	fault_t fault;			// First anomaly raised since last cleared
+	uint16_t fault_PC;		// Address of the instruction that raised it
+	uint8_t *edge_map;		// Fuzzing: EDGE_MAP_SIZE branch edge hit counts, NULL = off
+	struct tracer *tracer;	// Instruction trace ring buffer, NULL = off
+	struct profiler *profiler;	// Sampling profiler, NULL = off
+	struct debugger *debugger;	// Breakpoints and watchpoints, NULL = off
+	coverage_t *coverage;	// COVER_* bitmaps ORed in per access, NULL = off
+	bool instrumented;		// Any of the above attached, set by update_instrumentation()
 	const char *rom_name;	// Currently running ROM
 	instruction_t inst;		// currently executing instruction
 } chip8_t;
 
+// Everything in a snapshot except ram and display
+typedef struct {
+	uint16_t stack[12];
+	uint8_t stack_depth;	// Number of entries in use, replaces stack_pointer
+	uint8_t V[16];
+	uint32_t I;
+	uint16_t PC;
+	uint8_t delay_timer;
+	uint8_t sound_timer;
+	bool keypad[16];
+	uint8_t rpl[16];
+	bool hires;
+	uint8_t planes;
+	uint8_t audio_pattern[16];
+	uint8_t pitch;
+	bool pattern_audio;
+	uint32_t rng_state;
+	uint64_t inst_count;
+	bool mega;				// MegaChip state allocated, the mega_* fields below are only valid then
+	bool mega_enabled;
+	uint8_t mega_back;
+	uint8_t mega_blend;
+	uint8_t mega_collision_index;
+	uint8_t mega_alpha;
+	uint32_t mega_sprite_width;
+	uint32_t mega_sprite_height;
+} registers_t;
+
+// Saved CHIP8 machine state; holds no pointers so it can be restored into any instance.
+//	The MegaChip frame buffers are only output and are not saved, a restored machine keeps
+//	showing its own until the ROM draws again; the collision indices behind them are saved
+typedef struct {
+	uint8_t ram[RAM_SIZE];
+	uint64_t display[DISPLAY_ROWS][DISPLAY_PLANES][DISPLAY_ROW_WORDS];
+	registers_t regs;
+	uint32_t mega_palette[256];
+	uint8_t mega_index[MEGA_HEIGHT][MEGA_WIDTH];
+} snapshot_t;
+
+// Incremental snapshot header, followed by RAM_PAGE_SIZE bytes for every set bit in ram_pages,
+//	DISPLAY_ROW_SIZE bytes for every set bit in display_rows, then MEGA_WIDTH bytes per MegaChip
+//	index row and the palette for the bits in mega_rows, all in bit order
+typedef struct {
+	registers_t regs;
+	uint64_t ram_pages[RAM_DIRTY_WORDS];
+	uint64_t display_rows;
+	uint64_t mega_rows[MEGA_DIRTY_WORDS];
+} snapshot_delta_t;
+
+// Worst case incremental snapshot size, every page and row dirty
+#define SNAPSHOT_DELTA_MAX (sizeof(snapshot_delta_t) + RAM_PAGES * RAM_PAGE_SIZE + DISPLAY_ROWS * DISPLAY_ROW_SIZE + \
+							MEGA_HEIGHT * MEGA_WIDTH + sizeof ((megachip_t *)0)->palette)
+
+// Pre-allocated machines that all start from one parent state, e.g. a mid-game
+//	fuzzing start point. Resetting a clone only copies back what it dirtied
+typedef struct {
+	snapshot_t parent;		// State every clone starts from
+	chip8_t *clones;
+	uint32_t num_clones;
+} chip8_pool_t;
+
+typedef enum {
+	MOVIE_OFF,
+	MOVIE_RECORD,
+	MOVIE_PLAYBACK,
+} movie_mode_t;
+
+// Keypad change, applied at the frame boundary where inst_count was reached
+typedef struct {
+	uint64_t inst_count;
+	uint8_t key;
+	bool down;
+} movie_event_t;
+
+// Recorded input session: the RNG seed plus every keypad change, with periodic keyframes for seeking
+typedef struct {
+	movie_mode_t mode;
+	FILE *file;					// Open while recording
+	uint32_t seed;				// RNG seed used at boot
+	uint32_t insts_per_second;	// Clock rate the movie was recorded at
+	uint64_t rom_hash;			// ROM the movie was recorded against
+	uint32_t quirks;			// Quirk profile it was recorded with
+	uint64_t frame;				// Frames since boot
+	bool keypad[16];			// Last recorded or played back keypad state
+	movie_event_t *events;		// Playback: all keypad changes in order
+	size_t num_events;
+	size_t next_event;
+	snapshot_t *keyframes;		// Playback: keyframes in instruction count order
+	size_t num_keyframes;
+	bool has_end;				// Playback: movie was closed cleanly
+	uint64_t end_inst_count;	// Instruction count when recording stopped
+	uint64_t end_hash;			// Machine state hash when recording stopped
+} movie_t;
+
+// Movie file header, followed by tagged records (see MOVIE_TAG_*)
+typedef struct {
+	char magic[4];				// "C8MV"
+	uint32_t version;
+	uint32_t seed;
+	uint32_t insts_per_second;
+	uint64_t rom_hash;
+	uint32_t quirks;			// Quirk profile the movie was recorded with
+	uint32_t reserved;			// 0, keeps the header free of padding
+} movie_header_t;
+
+#define MOVIE_VERSION 7
+#define MOVIE_TAG_EVENT 'K'		// u64 inst_count, u8 key, u8 down
+#define MOVIE_TAG_KEYFRAME 'S'	// snapshot_t
+#define MOVIE_TAG_END 'E'		// u64 inst_count, u64 state hash
+
 // ADL audio callback
 void audio_callback(void *userdata, uint8_t *stream, int len) {
 	config_t *config = (config_t *)userdata;
@@ -69,11 +557,30 @@ void audio_callback(void *userdata, uint8_t *stream, int len) {
 	const int32_t half_square_wave_period = square_wave_period / 2;
 
 	// Filling out 2 bytes at a time (int16_t), len is in bytes so divide by 2
-	for(int i = 0; i < len / 2; i++) {
-		audio_data[i] = ((running_sample_index++ / half_square_wave_period) % 2) ?
-						config->volume : -config->volume;
+	audio_pattern_t *pattern = config->audio_pattern;
+	if(pattern && pattern->enabled) {
+		// XO-CHIP: step through the 128 bit pattern at the pitch's rate, looping
+		for(int i = 0; i < len / 2; i++) {
+			const uint32_t bit = (pattern->position >> 16) & 127;
+			audio_data[i] = (pattern->bits[bit / 8] >> (7 - bit % 8)) & 1 ? config->volume : -config->volume;
+			pattern->position = (pattern->position + pattern->step) & ((128 << 16) - 1);
+		}
+	} else {
+		for(int i = 0; i < len / 2; i++) {
+			audio_data[i] = ((running_sample_index++ / half_square_wave_period) % 2) ?
+							config->volume : -config->volume;
+		}
 	}
 
+	// The device asks for the next buffer before the current one has played out, a longer
+	//	gap means it ran dry. update_timers() resets the clock when unpausing between beeps
+	audio_stats_t *stats = SDL_AtomicGetPtr(&config->audio_stats);
+	if(stats) {
+		const int now = (int)SDL_GetTicks();
+		const int last = SDL_AtomicSet(&stats->last_callback, now);
+		const int buffer_ms = (len / 2) * 1000 / (int)config->audio_sample_rate;
+		if(last && now - last > buffer_ms * 2) SDL_AtomicAdd(&stats->underruns, 1);
+	}
 }
 
 // Initialize SDL2
@@ -100,6 +607,14 @@ bool init_sdl( sdl_t *sdl, config_t *config){
 		return false;
 	}
 
+	sdl->mega_texture = SDL_CreateTexture(sdl->renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING,
+										  MEGA_WIDTH, MEGA_HEIGHT);
+	if(!sdl->mega_texture) {
+		SDL_Log("Could not create SDL texture %s.\n", SDL_GetError());
+		return false;
+	}
+	SDL_SetTextureBlendMode(sdl->mega_texture, SDL_BLENDMODE_BLEND);
+
 	sdl->want = (SDL_AudioSpec) {
 		.freq= 44100,				// "CD" Quality
 		.format = AUDIO_S16LSB,		// Signed 16 bit little endian
@@ -124,34 +639,300 @@ bool init_sdl( sdl_t *sdl, config_t *config){
 	return true;
 }
 
+// Set debugger flags on addr[:len] from a --break or --watch option
+bool debugger_add(config_t *config, const char *arg, const uint8_t flags) {
+	char *end;
+	const unsigned long addr = strtoul(arg, &end, 0);
+	unsigned long len = 1;
+	if(end != arg && *end == ':') len = strtoul(end + 1, &end, 0);
+
+	if(end == arg || *end || addr >= RAM_SIZE || len == 0 || len > RAM_SIZE - addr) {
+		SDL_Log("Invalid address %s, expected addr[:len] within 0x000-0x%03X\n", arg, RAM_SIZE - 1);
+		return false;
+	}
+
+	if(!config->debugger && !(config->debugger = calloc(1, sizeof *config->debugger))) {
+		SDL_Log("Could not allocate debugger\n");
+		return false;
+	}
+
+	for(unsigned long i = 0; i < len; i++) config->debugger->flags[addr + i] |= flags;
+	return true;
+}
+
 // Setup initial emulatr config
 bool set_config_from_args(config_t *config, const int argc, char **argv) {
 	// Set defaults
 	*config = (config_t) {
 		.window_width = 64,
 		.window_height = 32,
-		.fg_color = 0xFFFFFFFF,		// white
-		.bg_color = 0x000000FF,		// yellow
+		.palette = {
+			0x000000FF,				// black background
+			0xFFFFFFFF,				// white foreground
+			0xAAAAAAFF,				// XO-CHIP plane 1 only
+			0x555555FF,				// XO-CHIP both planes
+		},
 		.scale_factor = 20,			// default res  will be 1280x640
 		.pixel_outlines = true,		// draw pixel outlines by default
 		.insts_per_second = 700,	// Number of instructions to emlate per second
 		.square_wave_freq = 440,	// 440hz for middle A
 		.audio_sample_rate = 44100,	// CD quality, 44100hz
 		.volume = 3000,				// 3000 out of 32000 max, INT16_MAX = max volume
+		.keyframe_interval = 600,	// Keyframe every 10 seconds of emulated time
+		.fuzz_frames = 600,			// 10 seconds of input per fuzz case
+		.trace_size = 1 << 20,		// 1M instructions of trace history
+		.profile_interval = 31,		// Prime, so samples don't lock onto loops of even length
+		.quirks = QUIRKS_AUTO,		// Per ROM from the hash database
 	};
 
 	// Override defaults
 	for(int i = 1; i < argc; ++i) {
-		(void)argv[i]; // prevents compile error
+		if(strcmp(argv[i], "--run-ahead") == 0 && i + 1 < argc) {
+			// Number of frames to speculatively emulate ahead of the displayed frame
+			config->run_ahead_frames = (uint32_t)strtoul(argv[++i], NULL, 10);
+		} else if(strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+			config->record_file = argv[++i];
+		} else if(strcmp(argv[i], "--play") == 0 && i + 1 < argc) {
+			config->play_file = argv[++i];
+		} else if(strcmp(argv[i], "--seek") == 0 && i + 1 < argc) {
+			config->seek_inst = strtoull(argv[++i], NULL, 10);
+		} else if(strcmp(argv[i], "--keyframe-interval") == 0 && i + 1 < argc) {
+			config->keyframe_interval = (uint32_t)strtoul(argv[++i], NULL, 10);
+		} else if(strcmp(argv[i], "--ips") == 0 && i + 1 < argc) {
+			// XO-CHIP ROMs typically want a lot more than the default
+			config->insts_per_second = (uint32_t)strtoul(argv[++i], NULL, 10);
+		} else if(strcmp(argv[i], "--palette") == 0 && i + 1 < argc) {
+			// Up to 4 comma separated RRGGBBAA colors, background first
+			char *arg = argv[++i];
+			for(uint32_t c = 0; c < 4 && *arg; c++) {
+				config->palette[c] = (uint32_t)strtoul(arg, &arg, 16);
+				if(*arg == ',') arg++;
+			}
+		} else if(strcmp(argv[i], "--headless") == 0) {
+			config->headless = true;
+		} else if(strcmp(argv[i], "--fuzz") == 0) {
+			config->fuzz = true;
+			config->headless = true;
+		} else if(strcmp(argv[i], "--fuzz-jobs") == 0 && i + 1 < argc) {
+			config->fuzz_jobs = (uint32_t)strtoul(argv[++i], NULL, 10);
+		} else if(strcmp(argv[i], "--fuzz-frames") == 0 && i + 1 < argc) {
+			config->fuzz_frames = (uint32_t)strtoul(argv[++i], NULL, 10);
+		} else if(strcmp(argv[i], "--fuzz-time") == 0 && i + 1 < argc) {
+			config->fuzz_seconds = (uint32_t)strtoul(argv[++i], NULL, 10);
+		} else if(strcmp(argv[i], "--fuzz-dir") == 0 && i + 1 < argc) {
+			config->fuzz_dir = argv[++i];
+		} else if(strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+			config->trace_file = argv[++i];
+		} else if(strcmp(argv[i], "--trace-size") == 0 && i + 1 < argc) {
+			config->trace_size = (uint32_t)strtoul(argv[++i], NULL, 10);
+		} else if(strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+			config->profile_file = argv[++i];
+		} else if(strcmp(argv[i], "--profile-interval") == 0 && i + 1 < argc) {
+			config->profile_interval = (uint32_t)strtoul(argv[++i], NULL, 10);
+		} else if(strcmp(argv[i], "--coverage") == 0 && i + 1 < argc) {
+			config->coverage_file = argv[++i];
+		} else if(strcmp(argv[i], "--coverage-listing") == 0 && i + 1 < argc) {
+			config->listing_file = argv[++i];
+		} else if(strcmp(argv[i], "--perf") == 0) {
+			config->perf_counters = true;
+		} else if(strcmp(argv[i], "--stats") == 0) {
+			config->print_stats = true;
+		} else if(strcmp(argv[i], "--trace-frames") == 0 && i + 1 < argc) {
+			config->frame_trace_file = argv[++i];
+		} else if(strcmp(argv[i], "--break") == 0 && i + 1 < argc) {
+			if(!debugger_add(config, argv[++i], DEBUG_BREAK)) return false;
+		} else if(strcmp(argv[i], "--watch") == 0 && i + 1 < argc) {
+			if(!debugger_add(config, argv[++i], DEBUG_WATCH_READ | DEBUG_WATCH_WRITE)) return false;
+		} else if(strcmp(argv[i], "--watch-read") == 0 && i + 1 < argc) {
+			if(!debugger_add(config, argv[++i], DEBUG_WATCH_READ)) return false;
+		} else if(strcmp(argv[i], "--watch-write") == 0 && i + 1 < argc) {
+			if(!debugger_add(config, argv[++i], DEBUG_WATCH_WRITE)) return false;
+		} else if(strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+			config->metrics_address = argv[++i];
+		} else if(strcmp(argv[i], "--gdb") == 0 && i + 1 < argc) {
+			config->gdb_address = argv[++i];
+		} else if(strcmp(argv[i], "--corpus") == 0 && i + 1 < argc) {
+			config->corpus_path = argv[++i];
+		} else if(strcmp(argv[i], "--quirks") == 0 && i + 1 < argc) {
+			// Profile name or QUIRK_* flags as a number
+			const char *arg = argv[++i];
+			char *end = NULL;
+			config->quirks = (uint32_t)strtoul(arg, &end, 0);
+			if(!*arg || *end) {
+				config->quirks = QUIRKS_AUTO;
+				for(size_t j = 0; j < sizeof quirk_profiles / sizeof quirk_profiles[0]; j++) {
+					if(strcmp(arg, quirk_profiles[j].name) == 0) config->quirks = quirk_profiles[j].quirks;
+				}
+				if(config->quirks == QUIRKS_AUTO) {
+					SDL_Log("Unknown quirk profile %s, expected default, cosmac, schip, xochip or flags\n", arg);
+					return false;
+				}
+			}
+		} else if(strcmp(argv[i], "--pack-corpus") == 0 && i + 1 < argc) {
+			config->pack_corpus = argv[++i];
+		} else if(strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+			config->batch_frames = (uint32_t)strtoul(argv[++i], NULL, 10);
+		} else if(strcmp(argv[i], "--cfg") == 0 && i + 1 < argc) {
+			config->cfg_file = argv[++i];
+		} else if(strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+			config->cache_dir = argv[++i];
+		} else if(strcmp(argv[i], "--disassemble") == 0 && i + 1 < argc) {
+			config->disasm_path = argv[++i];
+		} else if(strcmp(argv[i], "--decode-trace") == 0 && i + 1 < argc) {
+			config->decode_file = argv[++i];
+		} else if(strncmp(argv[i], "--", 2) != 0 && !config->rom_name) {
+			config->rom_name = argv[i];
+		} else {
+			SDL_Log("Ignoring unknown argument %s\n", argv[i]);
+		}
+	}
+
+	if(!config->rom_name && !config->decode_file && !config->batch_frames && !config->pack_corpus && !config->disasm_path) {
+		SDL_Log("No ROM given\n");
+		return false;
+	}
+
+	if(config->seek_inst && !config->play_file) {
+		SDL_Log("--seek only applies to movie playback (--play)\n");
+		return false;
+	}
+
+	if((config->batch_frames || config->pack_corpus || (config->disasm_path && !config->rom_name)) && !config->corpus_path) {
+		SDL_Log("Batch runs, packing and disassembling without a ROM need a ROM corpus (--corpus)\n");
+		return false;
+	}
+
+	if(config->profile_file && config->profile_interval == 0) {
+		SDL_Log("Profiler interval must be at least 1 instruction\n");
+		return false;
+	}
+
+	if(config->insts_per_second < 60) {
+		SDL_Log("Need at least 60 instructions per second, 1 per frame\n");
+		return false;
+	}
+
+	if(config->trace_file && (config->trace_size == 0 || config->trace_size > 1u << 30)) {
+		SDL_Log("Trace size must be between 1 and %u records\n", 1u << 30);
+		return false;
+	}
+
+	if(config->fuzz && config->fuzz_frames == 0) {
+		SDL_Log("Fuzz cases need at least 1 frame of input\n");
+		return false;
+	}
+
+	if(config->record_file && config->play_file) {
+		SDL_Log("Can not record and play back a movie at the same time\n");
+		return false;
+	}
+
+	if(config->gdb_address && config->headless) {
+		SDL_Log("GDB remote debugging needs a window, not --headless or --fuzz\n");
+		return false;
+	}
+
+	if(config->metrics_address && config->headless) {
+		SDL_Log("The metrics endpoint needs a window, not --headless or --fuzz\n");
+		return false;
+	}
+
+	if(config->headless && !config->play_file && !config->fuzz) {
+		SDL_Log("Headless mode needs a movie to play back (--play) or --fuzz\n");
+		return false;
 	}
 
 	return true;
 }
 
-// Init CHIP8 machine
-bool init_chip8(chip8_t *chip8, const char rom_name[]) {
+// FNV-1a 64 bit hash, continue a running hash by passing it back in as seed
+uint64_t fnv1a64(const void *data, size_t len, uint64_t seed) {
+	const uint8_t *bytes = data;
+	uint64_t hash = seed;
+
+	for(size_t i = 0; i < len; i++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001B3ULL;
+	}
+
+	return hash;
+}
+
+#define FNV1A64_INIT 0xCBF29CE484222325ULL
+
+// Quirk profile of known ROMs by FNV-1a hash, sorted by hash. Anything not listed runs
+//	with the default quirks
+static const struct {
+	uint64_t hash;
+	uint32_t quirks;
+} quirk_db[] = {
+	{0x04EB2109DC29B1ABULL, QUIRKS_SCHIP},		// Tetris [Fran Dachille, 1991], CHIP-48
+	{0x64E45391BA0238A1ULL, QUIRKS_COSMAC},		// IBM Logo
+	{0xC86E8FF63FCE668CULL, QUIRKS_SCHIP},		// Brix [Andreas Gustafsson, 1990], CHIP-48
+};
+
+uint32_t quirks_for_hash(const uint64_t hash) {
+	size_t lo = 0, hi = sizeof quirk_db / sizeof quirk_db[0];
+	while(lo < hi) {
+		const size_t mid = (lo + hi) / 2;
+		if(quirk_db[mid].hash == hash) return quirk_db[mid].quirks;
+		if(quirk_db[mid].hash < hash) lo = mid + 1;
+		else hi = mid;
+	}
+	return QUIRKS_DEFAULT;
+}
+
+#ifndef _WIN32
+// Map a whole file read only, NULL if it can't be opened or is empty. Mapped pages are
+//	shared with every other process mapping the same file
+const uint8_t *map_file(const char *path, size_t *size) {
+	const int fd = open(path, O_RDONLY);
+	if(fd < 0) return NULL;
+
+	struct stat st;
+	void *data = MAP_FAILED;
+	if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+
+	if(data == MAP_FAILED) return NULL;
+	*size = st.st_size;
+	return data;
+}
+
+void unmap_file(const uint8_t *data, const size_t size) {
+	munmap((void *)data, size);
+}
+#else
+// No mmap, read the whole file instead
+const uint8_t *map_file(const char *path, size_t *size) {
+	FILE *file = fopen(path, "rb");
+	if(!file) return NULL;
+
+	uint8_t *data = NULL;
+	long len = -1;
+	if(fseek(file, 0, SEEK_END) == 0) len = ftell(file);
+	if(len > 0 && fseek(file, 0, SEEK_SET) == 0 && (data = malloc(len)) && fread(data, len, 1, file) != 1) {
+		free(data);
+		data = NULL;
+	}
+	fclose(file);
+
+	if(data) *size = len;
+	return data;
+}
+
+void unmap_file(const uint8_t *data, const size_t size) {
+	(void)size;
+	free((void *)data);
+}
+#endif
+
+// Init CHIP8 machine from a ROM image already in memory, no file access
+bool init_chip8_image(chip8_t *chip8, const uint8_t *rom, const size_t rom_size, const char rom_name[]) {
 	const uint32_t entry_point = 0x200;
-	const uint8_t font[] = {
+	static const uint8_t font[] = {
 		0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
 		0x20, 0x60, 0x20, 0x20, 0x70, // 1
 		0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
@@ -169,197 +950,926 @@ bool init_chip8(chip8_t *chip8, const char rom_name[]) {
 		0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
 		0xF0, 0x80, 0xF0, 0x80, 0x80  // F
 	};
+	static const uint8_t big_font[] = {
+		0xFF, 0xFF, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, // 0
+		0x18, 0x78, 0x78, 0x18, 0x18, 0x18, 0x18, 0x18, 0xFF, 0xFF, // 1
+		0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // 2
+		0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 3
+		0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0x03, 0x03, // 4
+		0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 5
+		0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, // 6
+		0xFF, 0xFF, 0x03, 0x03, 0x06, 0x0C, 0x18, 0x18, 0x18, 0x18, // 7
+		0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, // 8
+		0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 9
+		0x7E, 0xFF, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, // A
+		0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, // B
+		0x3C, 0xFF, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0xFF, 0x3C, // C
+		0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC, // D
+		0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // E
+		0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xC0, 0xC0  // F
+	};
 
-	// Load font
+	// Load fonts
 	memcpy(&chip8->ram[0], font, sizeof(font));
+	memcpy(&chip8->ram[BIG_FONT_ADDR], big_font, sizeof(big_font));
 
-	// Open ROM file
-	FILE *rom = fopen(rom_name, "rb");
-	if(!rom) {
-		SDL_Log("Rom file %s is invalid or does not exist\n", rom_name);
+	// Check ROM size, MegaChip ROMs can be bigger than ram
+	const size_t max_size = MEGA_ADDRESS_SPACE - entry_point;
+	if(rom_size == 0) {
+		SDL_Log("Rom file %s is empty\n", rom_name);
 		return false;
 	}
 
-	// Get and check ROM size
-	fseek(rom, 0, SEEK_END);
-	const size_t rom_size = ftell(rom);
-	const size_t max_size = sizeof(chip8->ram) - entry_point;
-	rewind(rom);
-
 	if(rom_size > max_size) {
 		SDL_Log("Rom file %s is too big! Rom size: %zu, Max size allowed: %zu\n", rom_name, rom_size, max_size);
 		return false;
 	}
 
-	if(!fread(&chip8->ram[entry_point], rom_size, 1, rom)) {
-		SDL_Log("Could not read Rom file %s into CHIP8 memory\n", rom_name);
-		return false;
+	// Whatever doesn't fit in ram is only reachable through MegaChip's 24 bit I, keep a copy of the
+	//	whole image for it
+	const size_t ram_size = rom_size < sizeof chip8->ram - entry_point ? rom_size : sizeof chip8->ram - entry_point;
+	memcpy(&chip8->ram[entry_point], rom, ram_size);
+	if(rom_size > ram_size) {
+		uint8_t *rom_ext = malloc(rom_size);
+		if(!rom_ext) {
+			SDL_Log("Could not allocate %zu bytes for rom file %s\n", rom_size, rom_name);
+			return false;
+		}
+		memcpy(rom_ext, rom, rom_size);
+		chip8->rom_ext = rom_ext;
 	}
-	fclose(rom);
+	chip8->rom_hash = fnv1a64(rom, rom_size, FNV1A64_INIT);
+	chip8->rom_size = rom_size;
+	chip8->quirks = quirks_for_hash(chip8->rom_hash);
 
 	// Set CHIP8 defaults
 	chip8->state = RUNNING;
 	chip8->PC = entry_point;
 	chip8->rom_name = rom_name;
 	chip8->stack_pointer = &chip8->stack[0];
+	chip8->planes = 0x1;
+	chip8->pitch = 64;	// 4000 pattern bits per second
 
 	return true;
 }
 
-// Final cleanup
-void final_cleanup(const sdl_t sdl) {
-	SDL_DestroyRenderer(sdl.renderer);
-	SDL_DestroyWindow(sdl.window);
-	SDL_CloseAudioDevice(sdl.dev);
-	SDL_Quit();	// shutdown SDL subsystems
+// Init CHIP8 machine from a ROM file
+bool init_chip8(chip8_t *chip8, const char rom_name[]) {
+	size_t rom_size = 0;
+	const uint8_t *rom = map_file(rom_name, &rom_size);
+	if(!rom) {
+		SDL_Log("Rom file %s is empty, invalid or does not exist\n", rom_name);
+		return false;
+	}
+
+	const bool ok = init_chip8_image(chip8, rom, rom_size, rom_name);
+	unmap_file(rom, rom_size);
+	return ok;
 }
 
-// Clear screen / SDL window to backgorund color
-void clear_screen(const sdl_t sdl, const config_t config) {
-	const uint8_t r = (config.bg_color >> 24) & 0xFF;
-	const uint8_t g = (config.bg_color >> 16) & 0xFF;
-	const uint8_t b = (config.bg_color >> 8) & 0xFF;
-	const uint8_t a = (config.bg_color >> 0) & 0xFF;
+// Drop chip8's translation, e.g. before attaching one for other quirks
+void detach_translation(chip8_t *chip8) {
+	if(chip8->translation_mapped) unmap_file((const uint8_t *)chip8->translation, sizeof *chip8->translation);
+	else free((void *)chip8->translation);
+	chip8->translation = NULL;
+	chip8->translation_mapped = false;
+}
 
-	SDL_SetRenderDrawColor(sdl.renderer, r, g, b, a);
-	SDL_RenderClear(sdl.renderer);
+// Free what init_chip8_image(), attach_translation() and MegaChip mode allocated
+void free_chip8(chip8_t *chip8) {
+	detach_translation(chip8);
+	free((void *)chip8->rom_ext);
+	free(chip8->mega);
+	chip8->rom_ext = NULL;
+	chip8->mega = NULL;
 }
 
-// update window with changes
-void update_screen(const sdl_t sdl, const config_t config, const chip8_t chip8) {
-	SDL_Rect rect = {.x = 0, .y = 0, .w = config.scale_factor, .h = config.scale_factor};
-	// Grab color values to draw
-	const uint8_t fg_r = (config.fg_color >> 24) & 0xFF;
-	const uint8_t fg_g = (config.fg_color >> 16) & 0xFF;
-	const uint8_t fg_b = (config.fg_color >> 8) & 0xFF;
-	const uint8_t fg_a = (config.fg_color >> 0) & 0xFF;
-
-	const uint8_t bg_r = (config.bg_color >> 24) & 0xFF;
-	const uint8_t bg_g = (config.bg_color >> 16) & 0xFF;
-	const uint8_t bg_b = (config.bg_color >> 8) & 0xFF;
-	const uint8_t bg_a = (config.bg_color >> 0) & 0xFF;
+// A ROM image in memory, e.g. mapped from a corpus
+typedef struct {
+	const char *name;
+	const uint8_t *data;
+	uint32_t size;
+	uint64_t hash;			// FNV-1a hash of the image, same as chip8_t.rom_hash
+	uint32_t quirks;		// Quirk profile, 0 = default
+} rom_image_t;
+
+// Packed corpus file: header, index entries, the two lookup tables, NUL terminated names, then
+//	the ROM images back to back. Everything is addressed by file offset so the file is used
+//	straight from a shared read only mapping
+typedef struct {
+	char magic[4];			// "C8PK"
+	uint32_t byte_order;	// CORPUS_BYTE_ORDER in the byte order of the host that packed it
+	uint32_t version;
+	uint32_t num_roms;
+	uint32_t num_slots;		// Size of each lookup table, a power of two
+	uint32_t reserved;
+	uint64_t entries_offset;	// corpus_entry_t[num_roms], sorted by name
+	uint64_t name_slots_offset;	// uint32_t[num_slots], entry index + 1 by name hash, 0 = empty
+	uint64_t hash_slots_offset;	// uint32_t[num_slots], entry index + 1 by ROM hash, 0 = empty
+} corpus_header_t;
 
-	// Loop through display, draw a rectangle per pixel to the SDL window
-	for(uint32_t i = 0; i < sizeof chip8.display; i++) {
-		// Translate 1D index i value to 2D X/Y coordinates
-		rect.x = (i % config.window_width) * config.scale_factor;
-		rect.y = (i / config.window_width) * config.scale_factor;
+typedef struct {
+	uint64_t hash;			// FNV-1a hash of the image
+	uint64_t name_offset;
+	uint64_t offset;		// ROM image
+	uint32_t size;
+	uint32_t quirks;		// Quirk profile, 0 = default
+} corpus_entry_t;
 
-		if(chip8.display[i]) {
-			// Pixel is on, draw forground color
-			SDL_SetRenderDrawColor(sdl.renderer, fg_r, fg_g, fg_b, fg_a);
-			SDL_RenderFillRect(sdl.renderer, &rect);
+#define CORPUS_VERSION 2
+#define CORPUS_BYTE_ORDER 0x01020304	// Packed files are in host byte order, this tells the other order apart
 
-			// If user requests drawing pixel outlines
-			if(config.pixel_outlines) {
-				SDL_SetRenderDrawColor(sdl.renderer, bg_r, bg_g, bg_b, bg_a);
-				SDL_RenderDrawRect(sdl.renderer, &rect);
-			}
+// ROMs mapped once up front so machines can be initialised from them without file access
+typedef struct {
+	rom_image_t *roms;
+	uint32_t num_roms;
+	const uint8_t *packed;		// Whole packed corpus mapping, NULL for a directory
+	size_t packed_size;
+	const uint32_t *name_slots;	// Packed only, open addressed lookup tables (see corpus_header_t)
+	const uint32_t *hash_slots;
+	uint32_t num_slots;
+} rom_corpus_t;
+
+int compare_rom_names(const void *a, const void *b) {
+	return strcmp(((const rom_image_t *)a)->name, ((const rom_image_t *)b)->name);
+}
 
-		} else {
-			// Pixel is off, draw background color
-			SDL_SetRenderDrawColor(sdl.renderer, bg_r, bg_g, bg_b, bg_a);
-			SDL_RenderFillRect(sdl.renderer, &rect);
+void corpus_free(rom_corpus_t *corpus) {
+	if(corpus->packed) {
+		unmap_file(corpus->packed, corpus->packed_size);
+	} else {
+		for(uint32_t i = 0; i < corpus->num_roms; i++) {
+			unmap_file(corpus->roms[i].data, corpus->roms[i].size);
+			free((void *)corpus->roms[i].name);
 		}
 	}
-
-	SDL_RenderPresent(sdl.renderer);
-
+	free(corpus->roms);
+	*corpus = (rom_corpus_t){0};
 }
 
-void handle_input(chip8_t *chip8) {
-	SDL_Event event;
+// Map a packed corpus file and check every offset in its index before trusting it
+bool corpus_load_packed(rom_corpus_t *corpus, const char *path) {
+	size_t size = 0;
+	const uint8_t *data = map_file(path, &size);
+	if(!data) {
+		SDL_Log("Could not map ROM corpus %s\n", path);
+		return false;
+	}
+	corpus->packed = data;
+	corpus->packed_size = size;
 
-	while(SDL_PollEvent(&event)) {
-		switch(event.type) {
-			case SDL_QUIT:
-				// exit window
-				chip8->state = QUIT;
-				return;
+	const corpus_header_t *header = (const corpus_header_t *)data;
+	if(size >= sizeof *header && memcmp(header->magic, "C8PK", 4) == 0 && header->byte_order == SDL_Swap32(CORPUS_BYTE_ORDER)) {
+		SDL_Log("ROM corpus %s was packed on a host of another byte order, pack it again here\n", path);
+		return false;
+	}
+	if(size < sizeof *header || memcmp(header->magic, "C8PK", 4) != 0 || header->version != CORPUS_VERSION ||
+		header->num_slots == 0 || (header->num_slots & (header->num_slots - 1)) ||
+		header->num_slots < header->num_roms ||
+		header->entries_offset > size || (size - header->entries_offset) / sizeof(corpus_entry_t) < header->num_roms ||
+		header->name_slots_offset > size || (size - header->name_slots_offset) / 4 < header->num_slots ||
+		header->hash_slots_offset > size || (size - header->hash_slots_offset) / 4 < header->num_slots ||
+		header->entries_offset % 8 || header->name_slots_offset % 4 || header->hash_slots_offset % 4) {
+		SDL_Log("%s is not a version %d packed ROM corpus\n", path, CORPUS_VERSION);
+		return false;
+	}
 
-			case SDL_KEYDOWN:
-				switch(event.key.keysym.sym){
-					case SDLK_ESCAPE:
-						chip8->state = QUIT;
-						return;
-					case SDLK_SPACE:
-						// Space bar
-						if(chip8->state == RUNNING)
-							chip8->state = PAUSED;	// pause
-						else {
-							chip8->state = RUNNING;	// resume
-							puts("==== PAUSED ====");
-						}
-						return;
+	const corpus_entry_t *entries = (const corpus_entry_t *)(data + header->entries_offset);
+	corpus->roms = calloc(header->num_roms ? header->num_roms : 1, sizeof *corpus->roms);
+	if(!corpus->roms) {
+		SDL_Log("Could not allocate the index of ROM corpus %s\n", path);
+		return false;
+	}
+	for(uint32_t i = 0; i < header->num_roms; i++) {
+		const corpus_entry_t *entry = &entries[i];
+		if(entry->name_offset >= size || !memchr(data + entry->name_offset, '\0', size - entry->name_offset) ||
+			entry->offset > size || size - entry->offset < entry->size) {
+			SDL_Log("ROM corpus %s has a corrupt entry %u\n", path, i);
+			return false;
+		}
+		corpus->roms[i] = (rom_image_t){
+			.name = (const char *)data + entry->name_offset,
+			.data = data + entry->offset,
+			.size = entry->size,
+			.hash = entry->hash,
+			.quirks = entry->quirks,
+		};
+	}
+	corpus->num_roms = header->num_roms;
+
+	corpus->name_slots = (const uint32_t *)(data + header->name_slots_offset);
+	corpus->hash_slots = (const uint32_t *)(data + header->hash_slots_offset);
+	corpus->num_slots = header->num_slots;
+	for(uint32_t i = 0; i < corpus->num_slots; i++) {
+		if(corpus->name_slots[i] > corpus->num_roms || corpus->hash_slots[i] > corpus->num_roms) {
+			SDL_Log("ROM corpus %s has a corrupt lookup table\n", path);
+			return false;
+		}
+	}
+	return true;
+}
 
-					// Map qwerty keys to chip8 keypad
-					case SDLK_1: chip8->keypad[0x1] = true; break;
-					case SDLK_2: chip8->keypad[0x2] = true; break;
-					case SDLK_3: chip8->keypad[0x3] = true; break;
-					case SDLK_4: chip8->keypad[0xC] = true; break;
+// Load a ROM corpus: a packed corpus file, or every .ch8 file in a directory mapped one by one.
+//	Either way ROMs are sorted by name so batch output is in a stable order
+bool corpus_load(rom_corpus_t *corpus, const char *path) {
+	*corpus = (rom_corpus_t){0};
 
-					case SDLK_q: chip8->keypad[0x4] = true; break;
-					case SDLK_w: chip8->keypad[0x5] = true; break;
-					case SDLK_e: chip8->keypad[0x6] = true; break;
-					case SDLK_r: chip8->keypad[0xD] = true; break;
-					
-					case SDLK_a: chip8->keypad[0x7] = true; break;
-					case SDLK_s: chip8->keypad[0x8] = true; break;
-					case SDLK_d: chip8->keypad[0x9] = true; break;
-					case SDLK_f: chip8->keypad[0xE] = true; break;
-					
-					case SDLK_z: chip8->keypad[0xA] = true; break;
-					case SDLK_x: chip8->keypad[0x0] = true; break;
-					case SDLK_c: chip8->keypad[0xB] = true; break;
-					case SDLK_v: chip8->keypad[0xF] = true; break;
+#ifndef _WIN32
+	struct stat st;
+	if(stat(path, &st) == 0 && S_ISREG(st.st_mode)) return corpus_load_packed(corpus, path);
 
-					default: break;
-				}
-				break;
+	DIR *dir = opendir(path);
+	if(!dir) {
+		SDL_Log("Could not open ROM corpus %s: %s\n", path, strerror(errno));
+		return false;
+	}
 
-			case SDL_KEYUP:
-				switch(event.key.keysym.sym){
-					case SDLK_1: chip8->keypad[0x1] = false; break;
-					case SDLK_2: chip8->keypad[0x2] = false; break;
-					case SDLK_3: chip8->keypad[0x3] = false; break;
-					case SDLK_4: chip8->keypad[0xC] = false; break;
-					
-					case SDLK_q: chip8->keypad[0x4] = false; break;
-					case SDLK_w: chip8->keypad[0x5] = false; break;
-					case SDLK_e: chip8->keypad[0x6] = false; break;
-					case SDLK_r: chip8->keypad[0xD] = false; break;
+	uint32_t roms_cap = 0;
+	const struct dirent *entry;
+	while((entry = readdir(dir))) {
+		const size_t name_len = strlen(entry->d_name);
+		if(name_len < 4 || strcmp(entry->d_name + name_len - 4, ".ch8") != 0) continue;
+
+		char file[4096];
+		snprintf(file, sizeof file, "%s/%s", path, entry->d_name);
+		size_t size = 0;
+		const uint8_t *data = map_file(file, &size);
+		if(!data) {
+			SDL_Log("Skipping ROM %s, it is empty or could not be mapped\n", file);
+			continue;
+		}
 
-					case SDLK_a: chip8->keypad[0x7] = false; break;
-					case SDLK_s: chip8->keypad[0x8] = false; break;
-					case SDLK_d: chip8->keypad[0x9] = false; break;
-					case SDLK_f: chip8->keypad[0xE] = false; break;
+		const char *name = strdup(entry->d_name);
+		if(corpus->num_roms == roms_cap) {
+			rom_image_t *roms = realloc(corpus->roms, (roms_cap ? roms_cap * 2 : 256) * sizeof *roms);
+			if(roms) {
+				corpus->roms = roms;
+				roms_cap = roms_cap ? roms_cap * 2 : 256;
+			}
+		}
+		if(corpus->num_roms == roms_cap || !name) {
+			SDL_Log("Could not allocate memory for ROM corpus %s\n", path);
+			free((void *)name);
+			unmap_file(data, size);
+			closedir(dir);
+			corpus_free(corpus);
+			return false;
+		}
+		corpus->roms[corpus->num_roms++] = (rom_image_t){
+			.name = name,
+			.data = data,
+			.size = size,
+			.hash = fnv1a64(data, size, FNV1A64_INIT),
+		};
+		corpus->roms[corpus->num_roms - 1].quirks = quirks_for_hash(corpus->roms[corpus->num_roms - 1].hash);
+	}
+	closedir(dir);
+#else
+	// No directory listing here, so only packed corpus files
+	return corpus_load_packed(corpus, path);
+#endif
 
-					case SDLK_z: chip8->keypad[0xA] = false; break;
-					case SDLK_x: chip8->keypad[0x0] = false; break;
-					case SDLK_c: chip8->keypad[0xB] = false; break;
-					case SDLK_v: chip8->keypad[0xF] = false; break;
+	qsort(corpus->roms, corpus->num_roms, sizeof *corpus->roms, compare_rom_names);
+	return true;
+}
 
-					default: break;
-				}
-			default:
-				break;
+// Look up a ROM by file name, or by its hash written as hex. Packed corpora probe their
+//	lookup tables, directories are small enough to scan
+const rom_image_t *corpus_find(const rom_corpus_t *corpus, const char *name) {
+	// Hashes are written as exactly 16 hex digits, longer numbers would saturate to another hash
+	char *end = NULL;
+	errno = 0;
+	const uint64_t hash = strtoull(name, &end, 16);
+	const bool is_hash = strlen(name) == 16 && !*end && errno != ERANGE;
+
+	if(corpus->packed) {
+		const uint32_t mask = corpus->num_slots - 1;
+		const uint64_t name_hash = fnv1a64(name, strlen(name), FNV1A64_INIT);
+		for(uint32_t i = 0; i < corpus->num_slots; i++) {
+			const uint32_t slot = corpus->name_slots[(name_hash + i) & mask];
+			if(!slot) break;
+			if(strcmp(corpus->roms[slot - 1].name, name) == 0) return &corpus->roms[slot - 1];
+		}
+		if(!is_hash) return NULL;
+		for(uint32_t i = 0; i < corpus->num_slots; i++) {
+			const uint32_t slot = corpus->hash_slots[(hash + i) & mask];
+			if(!slot) break;
+			if(corpus->roms[slot - 1].hash == hash) return &corpus->roms[slot - 1];
 		}
+		return NULL;
+	}
+
+	for(uint32_t i = 0; i < corpus->num_roms; i++) {
+		if(strcmp(corpus->roms[i].name, name) == 0) return &corpus->roms[i];
 	}
+	for(uint32_t i = 0; is_hash && i < corpus->num_roms; i++) {
+		if(corpus->roms[i].hash == hash) return &corpus->roms[i];
+	}
+	return NULL;
 }
 
-#ifdef DEBUG
-void print_debug_info(chip8_t *chip8) {
-	printf("Address: 0x%04X, Opcode: 0x%04X Desc: ", chip8->PC-2, chip8->inst.opcode);
-	// Emulate opcode
-	switch((chip8->inst.opcode >> 12) & 0x0F) {
-		case 0x00:
-			if(chip8->inst.NNN == 0xE0) {
+// Insert entry index + 1 into an open addressed table, linear probing
+void corpus_slot_insert(uint32_t *slots, const uint32_t num_slots, const uint64_t hash, const uint32_t index) {
+	uint32_t slot = hash & (num_slots - 1);
+	while(slots[slot]) slot = (slot + 1) & (num_slots - 1);
+	slots[slot] = index + 1;
+}
+
+// Write a loaded corpus out as a single packed corpus file
+bool corpus_write(const rom_corpus_t *corpus, const char *path) {
+	uint32_t num_slots = 2;
+	while(num_slots < corpus->num_roms * 2) num_slots *= 2;	// Keep load factor at most 1/2
+
+	corpus_header_t header = {
+		.magic = {'C', '8', 'P', 'K'},
+		.byte_order = CORPUS_BYTE_ORDER,
+		.version = CORPUS_VERSION,
+		.num_roms = corpus->num_roms,
+		.num_slots = num_slots,
+		.entries_offset = sizeof header,
+	};
+	header.name_slots_offset = header.entries_offset + (uint64_t)corpus->num_roms * sizeof(corpus_entry_t);
+	header.hash_slots_offset = header.name_slots_offset + (uint64_t)num_slots * 4;
+
+	corpus_entry_t *entries = calloc(corpus->num_roms ? corpus->num_roms : 1, sizeof *entries);
+	uint32_t *name_slots = calloc(num_slots, 4);
+	uint32_t *hash_slots = calloc(num_slots, 4);
+	if(!entries || !name_slots || !hash_slots) {
+		SDL_Log("Could not allocate the index of ROM corpus %s\n", path);
+		free(entries);
+		free(name_slots);
+		free(hash_slots);
+		return false;
+	}
+
+	uint64_t offset = header.hash_slots_offset + (uint64_t)num_slots * 4;
+	for(uint32_t i = 0; i < corpus->num_roms; i++) {
+		entries[i].name_offset = offset;
+		offset += strlen(corpus->roms[i].name) + 1;
+	}
+	for(uint32_t i = 0; i < corpus->num_roms; i++) {
+		const rom_image_t *rom = &corpus->roms[i];
+		entries[i].hash = rom->hash;
+		entries[i].offset = offset;
+		entries[i].size = rom->size;
+		entries[i].quirks = rom->quirks;
+		offset += rom->size;
+
+		corpus_slot_insert(name_slots, num_slots, fnv1a64(rom->name, strlen(rom->name), FNV1A64_INIT), i);
+		corpus_slot_insert(hash_slots, num_slots, rom->hash, i);
+	}
+
+	FILE *file = fopen(path, "wb");
+	bool ok = file && fwrite(&header, sizeof header, 1, file) &&
+			  fwrite(entries, sizeof *entries, corpus->num_roms, file) == corpus->num_roms &&
+			  fwrite(name_slots, 4, num_slots, file) == num_slots &&
+			  fwrite(hash_slots, 4, num_slots, file) == num_slots;
+	for(uint32_t i = 0; ok && i < corpus->num_roms; i++) {
+		ok = fwrite(corpus->roms[i].name, strlen(corpus->roms[i].name) + 1, 1, file);
+	}
+	for(uint32_t i = 0; ok && i < corpus->num_roms; i++) {
+		ok = fwrite(corpus->roms[i].data, corpus->roms[i].size, 1, file);
+	}
+	if(file && fclose(file) != 0) ok = false;
+	if(!ok) SDL_Log("Could not write ROM corpus %s\n", path);
+	else SDL_Log("Packed %u ROMs into %s (%llu bytes)\n", corpus->num_roms, path, (unsigned long long)offset);
+
+	free(entries);
+	free(name_slots);
+	free(hash_slots);
+	return ok;
+}
+
+// Allocate MegaChip state in its power on state. Everything in it is marked dirty so
+//	incremental snapshots pick it up
+static bool mega_alloc(chip8_t *chip8) {
+	chip8->mega = calloc(1, sizeof *chip8->mega);
+	if(!chip8->mega) {
+		SDL_Log("Could not allocate MegaChip state\n");
+		return false;
+	}
+
+	chip8->mega->sprite_width = 1;
+	chip8->mega->sprite_height = 1;
+	chip8->mega->alpha = 0xFF;
+	memset(chip8->mega_dirty, 0xFF, sizeof chip8->mega_dirty);
+	return true;
+}
+
+// Record a MegaChip index write of rows rows from row first for incremental snapshots
+static inline void mark_mega_dirty(chip8_t *chip8, const uint32_t first, const uint32_t rows) {
+	for(uint32_t row = first; row < first + rows && row < MEGA_HEIGHT; row++) {
+		chip8->mega_dirty[row / 64] |= 1ULL << (row % 64);
+	}
+}
+
+// Copy CPU state out of a running CHIP8 instance
+void save_registers(const chip8_t *chip8, registers_t *regs) {
+	memcpy(regs->stack, chip8->stack, sizeof regs->stack);
+	regs->stack_depth = chip8->stack_pointer - &chip8->stack[0];
+	memcpy(regs->V, chip8->V, sizeof regs->V);
+	regs->I = chip8->I;
+	regs->PC = chip8->PC;
+	regs->delay_timer = chip8->delay_timer;
+	regs->sound_timer = chip8->sound_timer;
+	memcpy(regs->keypad, chip8->keypad, sizeof regs->keypad);
+	memcpy(regs->rpl, chip8->rpl, sizeof regs->rpl);
+	regs->hires = chip8->hires;
+	regs->planes = chip8->planes;
+	memcpy(regs->audio_pattern, chip8->audio_pattern, sizeof regs->audio_pattern);
+	regs->pitch = chip8->pitch;
+	regs->pattern_audio = chip8->pattern_audio;
+	regs->rng_state = chip8->rng_state;
+	regs->inst_count = chip8->inst_count;
+
+	const megachip_t *mega = chip8->mega;
+	regs->mega = mega != NULL;
+	if(mega) {
+		regs->mega_enabled = mega->enabled;
+		regs->mega_back = mega->back;
+		regs->mega_blend = mega->blend;
+		regs->mega_collision_index = mega->collision_index;
+		regs->mega_alpha = mega->alpha;
+		regs->mega_sprite_width = mega->sprite_width;
+		regs->mega_sprite_height = mega->sprite_height;
+	}
+}
+
+// Restore CPU state into a CHIP8 instance
+void load_registers(chip8_t *chip8, const registers_t *regs) {
+	memcpy(chip8->stack, regs->stack, sizeof chip8->stack);
+	chip8->stack_pointer = &chip8->stack[regs->stack_depth];
+	memcpy(chip8->V, regs->V, sizeof chip8->V);
+	chip8->I = regs->I;
+	chip8->PC = regs->PC;
+	chip8->delay_timer = regs->delay_timer;
+	chip8->sound_timer = regs->sound_timer;
+	memcpy(chip8->keypad, regs->keypad, sizeof chip8->keypad);
+	memcpy(chip8->rpl, regs->rpl, sizeof chip8->rpl);
+	chip8->hires = regs->hires;
+	chip8->planes = regs->planes;
+	memcpy(chip8->audio_pattern, regs->audio_pattern, sizeof chip8->audio_pattern);
+	chip8->pitch = regs->pitch;
+	chip8->pattern_audio = regs->pattern_audio;
+	chip8->rng_state = regs->rng_state;
+	chip8->inst_count = regs->inst_count;
+
+	// MegaChip state comes and goes with the registers, a failed allocation leaves it off
+	if(!regs->mega) {
+		free(chip8->mega);
+		chip8->mega = NULL;
+	} else if(chip8->mega || mega_alloc(chip8)) {
+		megachip_t *mega = chip8->mega;
+		mega->enabled = regs->mega_enabled;
+		mega->back = regs->mega_back;
+		mega->blend = regs->mega_blend;
+		mega->collision_index = regs->mega_collision_index;
+		mega->alpha = regs->mega_alpha;
+		mega->sprite_width = regs->mega_sprite_width;
+		mega->sprite_height = regs->mega_sprite_height;
+	}
+}
+
+// Copy machine state out of a running CHIP8 instance
+void save_snapshot(const chip8_t *chip8, snapshot_t *snapshot) {
+	memcpy(snapshot->ram, chip8->ram, sizeof snapshot->ram);
+	memcpy(snapshot->display, chip8->display, sizeof snapshot->display);
+	save_registers(chip8, &snapshot->regs);
+	if(chip8->mega) {
+		memcpy(snapshot->mega_palette, chip8->mega->palette, sizeof snapshot->mega_palette);
+		memcpy(snapshot->mega_index, chip8->mega->index, sizeof snapshot->mega_index);
+	} else {
+		memset(snapshot->mega_palette, 0, sizeof snapshot->mega_palette);
+		memset(snapshot->mega_index, 0, sizeof snapshot->mega_index);
+	}
+}
+
+// Restore machine state into a CHIP8 instance, emulator state and ROM name are left alone
+void load_snapshot(chip8_t *chip8, const snapshot_t *snapshot) {
+	memcpy(chip8->ram, snapshot->ram, sizeof chip8->ram);
+	memcpy(chip8->display, snapshot->display, sizeof chip8->display);
+	load_registers(chip8, &snapshot->regs);
+	if(chip8->mega) {
+		memcpy(chip8->mega->palette, snapshot->mega_palette, sizeof chip8->mega->palette);
+		memcpy(chip8->mega->index, snapshot->mega_index, sizeof chip8->mega->index);
+	}
+}
+
+// Record a ram write of len bytes at addr for incremental snapshots
+static inline void mark_ram_dirty(chip8_t *chip8, const uint32_t addr, const uint32_t len) {
+	const uint32_t last = addr + len - 1;
+
+	for(uint32_t page = addr / RAM_PAGE_SIZE; page <= last / RAM_PAGE_SIZE && page < RAM_PAGES; page++) {
+		chip8->ram_dirty[page / 64] |= 1ULL << (page % 64);
+	}
+}
+
+// Start a new incremental snapshot chain, the current state is the base
+void clear_dirty(chip8_t *chip8) {
+	memset(chip8->ram_dirty, 0, sizeof chip8->ram_dirty);
+	chip8->display_dirty = 0;
+	memset(chip8->mega_dirty, 0, sizeof chip8->mega_dirty);
+}
+
+// Write an incremental snapshot of everything changed since the last snapshot or
+//	clear_dirty() into buf (at least SNAPSHOT_DELTA_MAX bytes), returns bytes written
+size_t save_snapshot_delta(chip8_t *chip8, uint8_t *buf) {
+	snapshot_delta_t header = {0};	// Zeroed so struct padding is deterministic
+	uint8_t *out = buf + sizeof header;
+
+	save_registers(chip8, &header.regs);
+	memcpy(header.ram_pages, chip8->ram_dirty, sizeof header.ram_pages);
+	header.display_rows = chip8->display_dirty;
+
+	for(uint32_t page = 0; page < RAM_PAGES; page++) {
+		if(!(header.ram_pages[page / 64] & (1ULL << (page % 64)))) continue;
+		memcpy(out, &chip8->ram[page * RAM_PAGE_SIZE], RAM_PAGE_SIZE);
+		out += RAM_PAGE_SIZE;
+	}
+
+	for(uint32_t row = 0; row < DISPLAY_ROWS; row++) {
+		if(!(header.display_rows & (1ULL << row))) continue;
+		memcpy(out, chip8->display[row], DISPLAY_ROW_SIZE);
+		out += DISPLAY_ROW_SIZE;
+	}
+
+	// Without MegaChip state there is nothing to write, loading the registers frees it
+	if(chip8->mega) {
+		memcpy(header.mega_rows, chip8->mega_dirty, sizeof header.mega_rows);
+		for(uint32_t row = 0; row < MEGA_HEIGHT; row++) {
+			if(!(header.mega_rows[row / 64] & (1ULL << (row % 64)))) continue;
+			memcpy(out, chip8->mega->index[row], MEGA_WIDTH);
+			out += MEGA_WIDTH;
+		}
+		if(header.mega_rows[MEGA_DIRTY_PALETTE / 64] & (1ULL << (MEGA_DIRTY_PALETTE % 64))) {
+			memcpy(out, chip8->mega->palette, sizeof chip8->mega->palette);
+			out += sizeof chip8->mega->palette;
+		}
+	}
+
+	memcpy(buf, &header, sizeof header);
+	clear_dirty(chip8);
+
+	return out - buf;
+}
+
+// Apply an incremental snapshot on top of the state it was taken relative to
+void load_snapshot_delta(chip8_t *chip8, const uint8_t *buf) {
+	snapshot_delta_t header;
+	const uint8_t *in = buf + sizeof header;
+
+	memcpy(&header, buf, sizeof header);
+	load_registers(chip8, &header.regs);
+
+	for(uint32_t page = 0; page < RAM_PAGES; page++) {
+		if(!(header.ram_pages[page / 64] & (1ULL << (page % 64)))) continue;
+		memcpy(&chip8->ram[page * RAM_PAGE_SIZE], in, RAM_PAGE_SIZE);
+		in += RAM_PAGE_SIZE;
+	}
+
+	for(uint32_t row = 0; row < DISPLAY_ROWS; row++) {
+		if(!(header.display_rows & (1ULL << row))) continue;
+		memcpy(chip8->display[row], in, DISPLAY_ROW_SIZE);
+		in += DISPLAY_ROW_SIZE;
+	}
+
+	// A delta only has MegaChip data when its registers say the state exists
+	if(chip8->mega) {
+		for(uint32_t row = 0; row < MEGA_HEIGHT; row++) {
+			if(!(header.mega_rows[row / 64] & (1ULL << (row % 64)))) continue;
+			memcpy(chip8->mega->index[row], in, MEGA_WIDTH);
+			in += MEGA_WIDTH;
+		}
+		if(header.mega_rows[MEGA_DIRTY_PALETTE / 64] & (1ULL << (MEGA_DIRTY_PALETTE % 64))) {
+			memcpy(chip8->mega->palette, in, sizeof chip8->mega->palette);
+			in += sizeof chip8->mega->palette;
+		}
+	}
+}
+
+// Hash of all machine state that affects future execution, used to verify movie playback
+uint64_t state_hash(const chip8_t *chip8) {
+	uint64_t hash = FNV1A64_INIT;
+	const uint8_t stack_depth = chip8->stack_pointer - &chip8->stack[0];
+
+	hash = fnv1a64(chip8->ram, sizeof chip8->ram, hash);
+	hash = fnv1a64(chip8->display, sizeof chip8->display, hash);
+	hash = fnv1a64(&chip8->hires, sizeof chip8->hires, hash);
+	hash = fnv1a64(chip8->rpl, sizeof chip8->rpl, hash);
+	hash = fnv1a64(&chip8->planes, sizeof chip8->planes, hash);
+	hash = fnv1a64(chip8->audio_pattern, sizeof chip8->audio_pattern, hash);
+	hash = fnv1a64(&chip8->pitch, sizeof chip8->pitch, hash);
+	hash = fnv1a64(&chip8->pattern_audio, sizeof chip8->pattern_audio, hash);
+	hash = fnv1a64(chip8->stack, sizeof chip8->stack, hash);
+	hash = fnv1a64(&stack_depth, sizeof stack_depth, hash);
+	hash = fnv1a64(chip8->V, sizeof chip8->V, hash);
+	hash = fnv1a64(&chip8->I, sizeof chip8->I, hash);
+	hash = fnv1a64(&chip8->PC, sizeof chip8->PC, hash);
+	hash = fnv1a64(&chip8->delay_timer, sizeof chip8->delay_timer, hash);
+	hash = fnv1a64(&chip8->sound_timer, sizeof chip8->sound_timer, hash);
+	hash = fnv1a64(&chip8->rng_state, sizeof chip8->rng_state, hash);
+	hash = fnv1a64(&chip8->inst_count, sizeof chip8->inst_count, hash);
+
+	// MegaChip state only counts once a ROM has switched it on, other hashes are unchanged.
+	//	The frame buffers are output only, the collision indices are what execution sees
+	const megachip_t *mega = chip8->mega;
+	if(mega) {
+		hash = fnv1a64(&mega->enabled, sizeof mega->enabled, hash);
+		hash = fnv1a64(&mega->back, sizeof mega->back, hash);
+		hash = fnv1a64(&mega->blend, sizeof mega->blend, hash);
+		hash = fnv1a64(&mega->collision_index, sizeof mega->collision_index, hash);
+		hash = fnv1a64(&mega->alpha, sizeof mega->alpha, hash);
+		hash = fnv1a64(&mega->sprite_width, sizeof mega->sprite_width, hash);
+		hash = fnv1a64(&mega->sprite_height, sizeof mega->sprite_height, hash);
+		hash = fnv1a64(mega->palette, sizeof mega->palette, hash);
+		hash = fnv1a64(mega->index, sizeof mega->index, hash);
+	}
+
+	return hash;
+}
+
+// Allocate num_clones machines and fully copy parent into each of them once
+bool pool_init(chip8_pool_t *pool, const chip8_t *parent, const uint32_t num_clones) {
+	pool->clones = calloc(num_clones, sizeof *pool->clones);
+	if(!pool->clones) {
+		SDL_Log("Could not allocate %u clones\n", num_clones);
+		return false;
+	}
+
+	pool->num_clones = num_clones;
+	save_snapshot(parent, &pool->parent);
+
+	for(uint32_t i = 0; i < num_clones; i++) {
+		chip8_t *clone = &pool->clones[i];
+		load_snapshot(clone, &pool->parent);
+		clear_dirty(clone);
+		clone->state = RUNNING;
+		clone->rom_name = parent->rom_name;
+		clone->rom_hash = parent->rom_hash;
+		clone->rom_size = parent->rom_size;
+		clone->rom_ext = parent->rom_ext;
+		clone->translation = parent->translation;
+		clone->quirks = parent->quirks;
+	}
+
+	return true;
+}
+
+// Put a clone back into the parent state, copying only the ram pages, display rows and
+//	MegaChip collision rows it has written since its last reset plus the registers
+void pool_reset(const chip8_pool_t *pool, chip8_t *clone) {
+	for(uint32_t word = 0; word < RAM_DIRTY_WORDS; word++) {
+		for(uint64_t bits = clone->ram_dirty[word]; bits; bits &= bits - 1) {
+			const uint32_t offset = (word * 64 + __builtin_ctzll(bits)) * RAM_PAGE_SIZE;
+			memcpy(&clone->ram[offset], &pool->parent.ram[offset], RAM_PAGE_SIZE);
+		}
+	}
+
+	for(uint64_t bits = clone->display_dirty; bits; bits &= bits - 1) {
+		const uint32_t row = __builtin_ctzll(bits);
+		memcpy(clone->display[row], pool->parent.display[row], DISPLAY_ROW_SIZE);
+	}
+
+	// After the registers, which allocate or free the clone's MegaChip state to match the parent
+	load_registers(clone, &pool->parent.regs);
+	if(clone->mega) {
+		for(uint32_t row = 0; row < MEGA_HEIGHT; row++) {
+			if(!(clone->mega_dirty[row / 64] & (1ULL << (row % 64)))) continue;
+			memcpy(clone->mega->index[row], pool->parent.mega_index[row], MEGA_WIDTH);
+		}
+		if(clone->mega_dirty[MEGA_DIRTY_PALETTE / 64] & (1ULL << (MEGA_DIRTY_PALETTE % 64)))
+			memcpy(clone->mega->palette, pool->parent.mega_palette, sizeof clone->mega->palette);
+	}
+	clear_dirty(clone);
+	clone->state = RUNNING;
+}
+
+void pool_free(chip8_pool_t *pool) {
+	for(uint32_t i = 0; i < pool->num_clones; i++) free(pool->clones[i].mega);
+	free(pool->clones);
+	*pool = (chip8_pool_t){0};
+}
+
+// Final cleanup
+void final_cleanup(const sdl_t sdl) {
+	SDL_DestroyTexture(sdl.mega_texture);
+	SDL_DestroyRenderer(sdl.renderer);
+	SDL_DestroyWindow(sdl.window);
+	SDL_CloseAudioDevice(sdl.dev);
+	SDL_Quit();	// shutdown SDL subsystems
+}
+
+// Clear screen / SDL window to backgorund color
+void clear_screen(const sdl_t sdl, const config_t config) {
+	const uint8_t r = (config.palette[0] >> 24) & 0xFF;
+	const uint8_t g = (config.palette[0] >> 16) & 0xFF;
+	const uint8_t b = (config.palette[0] >> 8) & 0xFF;
+	const uint8_t a = (config.palette[0] >> 0) & 0xFF;
+
+	SDL_SetRenderDrawColor(sdl.renderer, r, g, b, a);
+	SDL_RenderClear(sdl.renderer);
+}
+
+// Show the MegaChip front buffer as one texture upload, scaled to fit the window at 4:3
+void update_screen_mega(const sdl_t sdl, const config_t config, const megachip_t *mega) {
+	const int window_width = config.window_width * config.scale_factor;
+	const int window_height = config.window_height * config.scale_factor;
+	int w = window_width;
+	int h = window_width * MEGA_HEIGHT / MEGA_WIDTH;
+	if(h > window_height) {
+		h = window_height;
+		w = window_height * MEGA_WIDTH / MEGA_HEIGHT;
+	}
+	const SDL_Rect rect = {.x = (window_width - w) / 2, .y = (window_height - h) / 2, .w = w, .h = h};
+
+	SDL_UpdateTexture(sdl.mega_texture, NULL, mega->frames[!mega->back], sizeof mega->frames[0][0]);
+	SDL_SetTextureAlphaMod(sdl.mega_texture, mega->alpha);
+	clear_screen(sdl, config);
+	SDL_RenderCopy(sdl.renderer, sdl.mega_texture, NULL, &rect);
+	SDL_RenderPresent(sdl.renderer);
+}
+
+// update window with changes
+void update_screen(const sdl_t sdl, const config_t config, const chip8_t *chip8) {
+	if(chip8->mega && chip8->mega->enabled) {
+		update_screen_mega(sdl, config, chip8->mega);
+		return;
+	}
+
+	// Hi-res pixels are drawn at half size so the window doesn't change
+	const uint32_t width = chip8->hires ? 128 : 64;
+	const uint32_t height = chip8->hires ? 64 : 32;
+	const int pixel_size = config.window_width * config.scale_factor / width;
+	SDL_Rect rect = {.x = 0, .y = 0, .w = pixel_size, .h = pixel_size};
+
+	// Loop through display, draw a rectangle per pixel to the SDL window
+	for(uint32_t i = 0; i < width * height; i++) {
+		// Translate 1D index i value to 2D X/Y coordinates
+		const uint32_t x = i % width;
+		const uint32_t y = i / width;
+		rect.x = x * pixel_size;
+		rect.y = y * pixel_size;
+
+		// Palette index from the pixel's bit in each plane
+		const uint32_t shift = 63 - x % 64;
+		const uint32_t color = config.palette[((chip8->display[y][0][x / 64] >> shift) & 1) |
+											  (((chip8->display[y][1][x / 64] >> shift) & 1) << 1)];
+
+		SDL_SetRenderDrawColor(sdl.renderer, (color >> 24) & 0xFF, (color >> 16) & 0xFF,
+							   (color >> 8) & 0xFF, (color >> 0) & 0xFF);
+		SDL_RenderFillRect(sdl.renderer, &rect);
+
+		// If user requests drawing pixel outlines around lit pixels
+		if(config.pixel_outlines && color != config.palette[0]) {
+			SDL_SetRenderDrawColor(sdl.renderer, (config.palette[0] >> 24) & 0xFF, (config.palette[0] >> 16) & 0xFF,
+								   (config.palette[0] >> 8) & 0xFF, (config.palette[0] >> 0) & 0xFF);
+			SDL_RenderDrawRect(sdl.renderer, &rect);
+		}
+	}
+
+	SDL_RenderPresent(sdl.renderer);
+
+}
+
+void handle_input(chip8_t *chip8, config_t *config) {
+	SDL_Event event;
+
+	while(SDL_PollEvent(&event)) {
+		switch(event.type) {
+			case SDL_QUIT:
+				// exit window
+				chip8->state = QUIT;
+				return;
+
+			case SDL_KEYDOWN:
+				switch(event.key.keysym.sym){
+					case SDLK_ESCAPE:
+						chip8->state = QUIT;
+						return;
+					case SDLK_SPACE:
+						// Space bar
+						if(chip8->state == RUNNING)
+							chip8->state = PAUSED;	// pause
+						else {
+							chip8->state = RUNNING;	// resume
+							puts("==== PAUSED ====");
+						}
+						return;
+
+					case SDLK_F1:
+						// Toggle frame time stats in the window title
+						config->show_stats = !config->show_stats;
+						break;
+
+					// Map qwerty keys to chip8 keypad
+					case SDLK_1: chip8->keypad[0x1] = true; break;
+					case SDLK_2: chip8->keypad[0x2] = true; break;
+					case SDLK_3: chip8->keypad[0x3] = true; break;
+					case SDLK_4: chip8->keypad[0xC] = true; break;
+
+					case SDLK_q: chip8->keypad[0x4] = true; break;
+					case SDLK_w: chip8->keypad[0x5] = true; break;
+					case SDLK_e: chip8->keypad[0x6] = true; break;
+					case SDLK_r: chip8->keypad[0xD] = true; break;
+					
+					case SDLK_a: chip8->keypad[0x7] = true; break;
+					case SDLK_s: chip8->keypad[0x8] = true; break;
+					case SDLK_d: chip8->keypad[0x9] = true; break;
+					case SDLK_f: chip8->keypad[0xE] = true; break;
+					
+					case SDLK_z: chip8->keypad[0xA] = true; break;
+					case SDLK_x: chip8->keypad[0x0] = true; break;
+					case SDLK_c: chip8->keypad[0xB] = true; break;
+					case SDLK_v: chip8->keypad[0xF] = true; break;
+
+					default: break;
+				}
+				break;
+
+			case SDL_KEYUP:
+				switch(event.key.keysym.sym){
+					case SDLK_1: chip8->keypad[0x1] = false; break;
+					case SDLK_2: chip8->keypad[0x2] = false; break;
+					case SDLK_3: chip8->keypad[0x3] = false; break;
+					case SDLK_4: chip8->keypad[0xC] = false; break;
+					
+					case SDLK_q: chip8->keypad[0x4] = false; break;
+					case SDLK_w: chip8->keypad[0x5] = false; break;
+					case SDLK_e: chip8->keypad[0x6] = false; break;
+					case SDLK_r: chip8->keypad[0xD] = false; break;
+
+					case SDLK_a: chip8->keypad[0x7] = false; break;
+					case SDLK_s: chip8->keypad[0x8] = false; break;
+					case SDLK_d: chip8->keypad[0x9] = false; break;
+					case SDLK_f: chip8->keypad[0xE] = false; break;
+
+					case SDLK_z: chip8->keypad[0xA] = false; break;
+					case SDLK_x: chip8->keypad[0x0] = false; break;
+					case SDLK_c: chip8->keypad[0xB] = false; break;
+					case SDLK_v: chip8->keypad[0xF] = false; break;
+
+					default: break;
+				}
+			default:
+				break;
+		}
+	}
+}
+
+// Describe the decoded instruction in chip8->inst, with PC already past it
+void print_debug_info(chip8_t *chip8) {
+	printf("Address: 0x%04X, Opcode: 0x%04X Desc: ", chip8->PC-2, chip8->inst.opcode);
+	// Emulate opcode
+	switch((chip8->inst.opcode >> 12) & 0x0F) {
+		case 0x00:
+			if(chip8->inst.NNN == 0xE0) {
 				// 0x00E0: Clear the screen
 				printf("Clear screen\n");
+			} else if((chip8->inst.NNN & 0xFF0) == 0xC0 || (chip8->inst.NNN & 0xFF0) == 0xD0) {
+				// 0x00CN/0x00DN: Scroll down/up N rows
+				printf("Scroll display %s %u rows\n", (chip8->inst.NNN & 0xFF0) == 0xC0 ? "down" : "up", chip8->inst.N);
+			} else if(chip8->inst.NNN == 0xFB || chip8->inst.NNN == 0xFC) {
+				// 0x00FB/0x00FC: Scroll right/left 4 pixels
+				printf("Scroll display %s 4 pixels\n", chip8->inst.NNN == 0xFB ? "right" : "left");
+			} else if(chip8->inst.NNN == 0xFD) {
+				// 0x00FD: Exit interpreter
+				printf("Exit interpreter\n");
+			} else if(chip8->inst.NNN == 0xFE || chip8->inst.NNN == 0xFF) {
+				// 0x00FE/0x00FF: Low res/hi res
+				printf("Switch to %s and clear screen\n", chip8->inst.NNN == 0xFF ? "128x64 hi res" : "64x32 low res");
 			} else if(chip8->inst.NNN == 0xEE) {
 				// 0x00EE: Return from subroutine
 				printf("Return from subroutine to address0x%04X\n", 
 						*(chip8->stack_pointer - 1));
+			} else if(chip8->inst.NNN == 0x10 || chip8->inst.NNN == 0x11) {
+				// 0x0010/0x0011: MegaChip mode off/on
+				printf("%s MegaChip mode\n", chip8->inst.NNN == 0x11 ? "Enter" : "Leave");
+			} else if((chip8->inst.NNN & 0xFF0) == 0xB0) {
+				// 0x00BN: MegaChip scroll up N rows
+				printf("Scroll MegaChip frame up %u rows\n", chip8->inst.N);
+			} else if(chip8->inst.X == 0x1) {
+				// 0x01NN NNNN: MegaChip 24 bit I
+				printf("Set I to 0x%06X\n", chip8->inst.NN << 16 | chip8->ram[chip8->PC & 0xFFFF] << 8 |
+					   chip8->ram[(chip8->PC + 1) & 0xFFFF]);
+			} else if(chip8->inst.X == 0x2) {
+				// 0x02NN: MegaChip palette load
+				printf("Load %u palette colours from I (0x%06X)\n", chip8->inst.NN, chip8->I);
+			} else if(chip8->inst.X == 0x3 || chip8->inst.X == 0x4) {
+				// 0x03NN/0x04NN: MegaChip sprite size
+				printf("Set sprite %s to %u\n", chip8->inst.X == 0x3 ? "width" : "height",
+					   chip8->inst.NN ? chip8->inst.NN : 256);
+			} else if(chip8->inst.X == 0x5) {
+				// 0x05NN: MegaChip screen alpha
+				printf("Set screen alpha to 0x%02X\n", chip8->inst.NN);
+			} else if(chip8->inst.X == 0x6 || chip8->inst.X == 0x7) {
+				// 0x060N/0x0700: MegaChip digitised sound
+				printf("%s digitised sound (ignored)\n", chip8->inst.X == 0x6 ? "Play" : "Stop");
+			} else if(chip8->inst.X == 0x8) {
+				// 0x080N: MegaChip blend mode
+				printf("Set blend mode to %u\n", chip8->inst.NN);
+			} else if(chip8->inst.X == 0x9) {
+				// 0x09NN: MegaChip collision colour
+				printf("Set collision colour index to 0x%02X\n", chip8->inst.NN);
 			} else {
 				printf("Uninplemented Opcode.\n");
 			}
@@ -388,6 +1898,12 @@ void print_debug_info(chip8_t *chip8) {
 			break;
 
 		case 0x05:
+			if(chip8->inst.N == 2 || chip8->inst.N == 3) {
+				// 0x5XY2/0x5XY3: Save/load VX-VY at I
+				printf("%s V%X-V%X %s memory from I (0x%04X).\n", chip8->inst.N == 2 ? "Save" : "Load",
+						chip8->inst.X, chip8->inst.Y, chip8->inst.N == 2 ? "to" : "from", chip8->I);
+				break;
+			}
 			// 0x5XY0: Skip next instruction if VX == VY
 			printf("Check if V%X (0x%02X) == V%X (0x%02X), skip next instruction if true\n",
 					chip8->inst.X, chip8->V[chip8->inst.X],
@@ -515,6 +2031,7 @@ void print_debug_info(chip8_t *chip8) {
 			break;
 
 		case 0x0D:
+			// 0xDXYN: N = 0 is a 16x16 sprite
 			printf("Draw N (%u) height sprite at coords V%X (0x%02X), V%X (0x%02X) from memory location I (0x%04X). Set VF = 1 if any pixels are turned off.\n",
 				chip8->inst.N, chip8->inst.X, 
 				chip8->V[chip8->inst.X], chip8->inst.Y,
@@ -536,6 +2053,26 @@ void print_debug_info(chip8_t *chip8) {
 
 		case 0x0F:
 			switch(chip8->inst.NN) {
+				case 0x00:
+					// 0xF000 NNNN: Set I to 16 bit address
+					printf("Set I to NNNN (0x%02X%02X)\n", chip8->ram[chip8->PC], chip8->ram[(uint16_t)(chip8->PC + 1)]);
+					break;
+
+				case 0x01:
+					// 0xFN01: Select bitplanes
+					printf("Select bitplanes 0x%X\n", chip8->inst.X);
+					break;
+
+				case 0x02:
+					// 0xF002: Load audio pattern
+					printf("Load audio pattern from I (0x%04X).\n", chip8->I);
+					break;
+
+				case 0x3A:
+					// 0xFX3A: Set pitch
+					printf("Set audio pitch = V%X (0x%02X).\n", chip8->inst.X, chip8->V[chip8->inst.X]);
+					break;
+
 				case 0x0A:
 					// 0xFX0A: VX = get_key(); Wait for a key press and store in VX
 					printf("Await until a key is pressed; Store key in V%X\n.",
@@ -573,6 +2110,22 @@ void print_debug_info(chip8_t *chip8) {
 							chip8->inst.X, chip8->V[chip8->inst.X] * 5);
 					break;
 
+				case 0x30:
+					// 0xFX30: Set I to big font character in VX
+					printf("Set I to big font sprite location for digit in V%X (0x%02X).\n",
+							chip8->inst.X, chip8->V[chip8->inst.X]);
+					break;
+
+				case 0x75:
+					// 0xFX75: Save V0-VX to RPL user flags
+					printf("Save V0-V%X to RPL user flags.\n", chip8->inst.X);
+					break;
+
+				case 0x85:
+					// 0xFX85: Load V0-VX from RPL user flags
+					printf("Load V0-V%X from RPL user flags.\n", chip8->inst.X);
+					break;
+
 				case 0x33:
 					// 0xFX33: Stores binary-coded decimal representaion of VX in register I (with various offsets)
 					// 	I = hundreds place, I+1 = tens place, I+2 = ones place
@@ -602,75 +2155,685 @@ void print_debug_info(chip8_t *chip8) {
 			break;	// Unimplmented or invalid opcode
 	}
 }
-#endif
 
-// Emulate 1 CHIP8 instruction
-void emulate_instruction(chip8_t *chip8, const config_t config) {
-	// Get next opcode from ram
-	chip8->inst.opcode = (chip8->ram[chip8->PC] << 8) | chip8->ram[chip8->PC+1];
-	chip8->PC += 2;	// Pre-inc program counter for next opcode
+// Advance a xorshift32 generator, state must be non zero
+static inline uint32_t xorshift32(uint32_t *state) {
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
 
-	// Fill out current instruction format
-	chip8->inst.NNN = chip8->inst.opcode & 0x0FFF;
-	chip8->inst.NN = chip8->inst.opcode & 0x0FF;
-	chip8->inst.N = chip8->inst.opcode & 0x0F;
-	chip8->inst.X = (chip8->inst.opcode >> 8) & 0x0F;
-	chip8->inst.Y = (chip8->inst.opcode >> 4) & 0x0F;
+// Next random byte from the machine's own xorshift32 generator, so that
+//	snapshots and speculative frames never disturb the real RNG sequence
+uint8_t random_byte(chip8_t *chip8) {
+	return xorshift32(&chip8->rng_state) >> 24;
+}
 
-#ifdef DEBUG
-	print_debug_info(chip8);
-#endif
+// Split an opcode into its instruction format fields
+static inline void decode_instruction(instruction_t *inst) {
+	inst->NNN = inst->opcode & 0x0FFF;
+	inst->NN = inst->opcode & 0x0FF;
+	inst->N = inst->opcode & 0x0F;
+	inst->X = (inst->opcode >> 8) & 0x0F;
+	inst->Y = (inst->opcode >> 4) & 0x0F;
+}
 
-	// Emulate opcode
-	switch((chip8->inst.opcode >> 12) & 0x0F) {
-		case 0x00:
-			if(chip8->inst.NNN == 0xE0) {
-				// 0x00E0: Clear the screen
-				memset(&chip8->display[0], false, sizeof(chip8->display));
-			} else if(chip8->inst.NN == 0xEE) {
-				// 0x00EE: Return from subroutine
-				chip8->PC = *--chip8->stack_pointer;
-			} else {
-				// Uninplemented Opcode
-			}
-			break;
+// Store the register an instruction changed in its trace record, preferring VX over VF
+//	for arithmetic that sets both
+static inline void trace_finish(trace_record_t *trace, const chip8_t *chip8, const uint8_t *V_before) {
+	const uint8_t X = chip8->inst.X;
 
-		case 0x01:
-			// 0x1NNN: Jump to address NNN
-			chip8->PC = chip8->inst.NNN;
-			break;
+	// VX first, then the lowest other changed registers
+	if(chip8->V[X] != V_before[X]) {
+		trace->reg = X;
+		trace->value = chip8->V[X];
+	}
 
-		case 0x02:
-			// 0x2NNN: Call subroutine at NNN
-			*chip8->stack_pointer++ = chip8->PC;
-			chip8->PC = chip8->inst.NNN;
+	for(uint8_t i = 0; i < 16 && trace->reg2 == TRACE_NO_REG; i++) {
+		if(i == X || chip8->V[i] == V_before[i]) continue;
+		if(trace->reg == TRACE_NO_REG) {
+			trace->reg = i;
+			trace->value = chip8->V[i];
+		} else {
+			trace->reg2 = i;
+			trace->value2 = chip8->V[i];
+		}
+	}
+}
+
+// Take one profiler sample: the shadow call stack plus PC, aggregated by exact stack
+void profiler_sample(profiler_t *profiler, const uint16_t PC) {
+	const uint8_t depth = profiler->depth < PROFILER_MAX_DEPTH ? profiler->depth : PROFILER_MAX_DEPTH;
+	uint16_t frames[PROFILER_MAX_DEPTH + 1];
+
+	memcpy(frames, profiler->shadow, depth * sizeof frames[0]);
+	frames[depth] = PC;
+
+	const uint64_t hash = fnv1a64(frames, (depth + 1) * sizeof frames[0], FNV1A64_INIT) | 1;
+	profiler->countdown = profiler->interval;
+	profiler->samples++;
+
+	// Open addressing, linear probing
+	for(uint32_t probe = 0; probe < PROFILER_STACKS; probe++) {
+		profile_stack_t *stack = &profiler->stacks[(hash + probe) & (PROFILER_STACKS - 1)];
+
+		if(stack->hash == hash && stack->depth == depth &&
+		   memcmp(stack->frames, frames, (depth + 1) * sizeof frames[0]) == 0) {
+			stack->count++;
+			return;
+		}
+
+		if(stack->hash == 0) {
+			stack->hash = hash;
+			stack->depth = depth;
+			memcpy(stack->frames, frames, (depth + 1) * sizeof frames[0]);
+			stack->count = 1;
+			return;
+		}
+	}
+
+	profiler->dropped++;
+}
+
+// Shadow stack push on 2NNN, the frame is the subroutine entry address
+static inline void profiler_call(profiler_t *profiler, const uint16_t entry) {
+	if(profiler->depth < PROFILER_MAX_DEPTH) profiler->shadow[profiler->depth] = entry;
+	profiler->depth++;
+}
+
+// Shadow stack pop on 00EE
+static inline void profiler_return(profiler_t *profiler) {
+	if(profiler->depth) profiler->depth--;
+}
+
+// Rebuild the shadow stack from chip8's real one after its state was restored, each return
+//	address follows the 2NNN that made the call. A call the ROM has since overwritten is
+//	shown by its return address
+void profiler_sync(profiler_t *profiler, const chip8_t *chip8) {
+	profiler->depth = 0;
+	for(const uint16_t *entry = chip8->stack; entry < chip8->stack_pointer; entry++) {
+		const uint16_t call = *entry - 2;
+		const uint16_t opcode = chip8->ram[call] << 8 | chip8->ram[(uint16_t)(call + 1)];
+		profiler_call(profiler, opcode >> 12 == 0x2 ? opcode & 0x0FFF : *entry);
+	}
+}
+
+// Note a guest anomaly, only the first one is kept until the caller clears it
+static inline void raise_fault(chip8_t *chip8, const fault_t fault, const uint16_t PC) {
+	if(chip8->fault != FAULT_NONE) return;
+	chip8->fault = fault;
+	chip8->fault_PC = PC;
+}
+
+// Count a taken branch edge (from, to) for coverage guided fuzzing
+static inline void record_edge(chip8_t *chip8, const uint16_t from) {
+	if(chip8->edge_map) {
+		chip8->edge_map[((from * 0x9E37u) ^ chip8->PC) & (EDGE_MAP_SIZE - 1)]++;
+	}
+}
+
+// Pick the instrumented interpreter when any hook is attached, call after attaching or detaching one
+void update_instrumentation(chip8_t *chip8) {
+	chip8->instrumented = chip8->edge_map || chip8->tracer || chip8->profiler || chip8->debugger || chip8->coverage;
+}
+
+// Print machine state when a breakpoint or watchpoint pauses emulation
+void debugger_dump(const chip8_t *chip8, const char *reason, const uint16_t addr) {
+	printf("==== %s 0x%03X ====\n", reason, addr);
+	printf("PC: 0x%03X I: 0x%03X DT: %u ST: %u Instructions: %llu\n",
+		   chip8->PC, chip8->I, chip8->delay_timer, chip8->sound_timer, (unsigned long long)chip8->inst_count);
+
+	for(uint8_t i = 0; i < 16; i++) printf("V%X: 0x%02X%s", i, chip8->V[i], i % 8 == 7 ? "\n" : " ");
+
+	printf("Stack:");
+	for(const uint16_t *entry = chip8->stack; entry < chip8->stack_pointer; entry++) printf(" 0x%03X", *entry);
+	printf("\n");
+
+	// Decode the next instruction on a copy, print_debug_info expects PC already past it
+	chip8_t next = *chip8;
+	const uint16_t ram_mask = sizeof chip8->ram - 1;
+	next.inst.opcode = (chip8->ram[chip8->PC & ram_mask] << 8) | chip8->ram[(chip8->PC + 1) & ram_mask];
+	decode_instruction(&next.inst);
+	next.PC += 2;
+	printf("Next: ");
+	print_debug_info(&next);
+}
+
+// Pause before the instruction at PC if it has a breakpoint or a single step is done.
+//	The instruction a pause stopped at always runs on resume
+static inline bool debugger_break(chip8_t *chip8, const uint16_t PC) {
+	debugger_t *debugger = chip8->debugger;
+	if(debugger->resume) {
+		debugger->resume = false;
+		return false;
+	}
+
+	const bool breakpoint = debugger->flags[PC & (RAM_SIZE - 1)] & DEBUG_BREAK;
+	if(!breakpoint && !debugger->step) return false;
+
+	debugger->step = false;
+	debugger->resume = true;
+	debugger->hit = breakpoint ? DEBUG_BREAK : 0;
+	debugger->hit_addr = PC;
+	chip8->state = PAUSED;
+	if(!debugger->quiet) debugger_dump(chip8, breakpoint ? "BREAKPOINT" : "STEP", PC);
+	return true;
+}
+
+// Pause after an instruction read or wrote len bytes at addr if any of them are watched
+static inline void debugger_watch(chip8_t *chip8, const uint8_t flag, const uint16_t addr, const uint16_t len) {
+	if(!chip8->debugger) return;
+
+	for(uint16_t i = 0; i < len; i++) {
+		if(chip8->debugger->flags[addr + i] & flag) {
+			chip8->debugger->hit = flag;
+			chip8->debugger->hit_addr = addr + i;
+			chip8->state = PAUSED;
+			if(!chip8->debugger->quiet)
+				debugger_dump(chip8, flag == DEBUG_WATCH_READ ? "WATCH READ" : "WATCH WRITE", addr + i);
+			return;
+		}
+	}
+}
+
+// Mark len bytes at addr as accessed for coverage, ORing a mask into each bitmap word spanned
+static inline void record_coverage(chip8_t *chip8, const uint32_t kind, const uint32_t addr, uint32_t len) {
+	uint64_t *bits = chip8->coverage->bits[kind];
+	for(uint32_t bit = addr & (RAM_SIZE - 1); len; ) {
+		const uint32_t shift = bit % 64;
+		const uint32_t count = len < 64 - shift ? len : 64 - shift;
+		bits[bit / 64] |= (~0ULL >> (64 - count)) << shift;
+		bit = (bit + count) & (RAM_SIZE - 1);
+		len -= count;
+	}
+}
+
+static inline bool coverage_test(const coverage_t *coverage, const uint32_t kind, const uint32_t addr) {
+	const uint32_t bit = addr & (RAM_SIZE - 1);
+	return coverage->bits[kind][bit / 64] >> (bit % 64) & 1;
+}
+
+// COVER_EXEC, READ and WRITE of addr as a 3 bit mask
+static inline uint32_t coverage_flags(const coverage_t *coverage, const uint32_t addr) {
+	return coverage_test(coverage, COVER_EXEC, addr) | coverage_test(coverage, COVER_READ, addr) << 1 |
+		   coverage_test(coverage, COVER_WRITE, addr) << 2;
+}
+
+// A display row as one 128 bit value, leftmost pixel in the top bit, so sprites and
+//	scrolls are a couple of word shifts
+static inline unsigned __int128 display_row_get(const uint64_t *row) {
+	return (unsigned __int128)row[0] << 64 | row[1];
+}
+
+static inline void display_row_set(uint64_t *row, const unsigned __int128 bits) {
+	row[0] = bits >> 64;
+	row[1] = (uint64_t)bits;
+}
+
+// Scroll the selected planes dy rows down (up if negative) or dx pixels right (left if negative).
+//	With every plane selected whole rows move in one memmove
+static inline void scroll_display(chip8_t *chip8, const int32_t dx, const int32_t dy) {
+	const uint32_t height = chip8->hires ? 64 : 32;
+	const uint32_t rows = (uint32_t)(dy < 0 ? -dy : dy);
+	const unsigned __int128 visible = ~(unsigned __int128)0 << (chip8->hires ? 0 : 64);
+
+	chip8->display_dirty |= ~0ULL >> (64 - height);
+	if(dy && chip8->planes == (1 << DISPLAY_PLANES) - 1) {
+		const uint32_t kept = height - rows;
+		memmove(chip8->display[dy > 0 ? rows : 0], chip8->display[dy > 0 ? 0 : rows], kept * DISPLAY_ROW_SIZE);
+		memset(chip8->display[dy > 0 ? 0 : kept], 0, rows * DISPLAY_ROW_SIZE);
+		return;
+	}
+
+	for(uint32_t p = 0; p < DISPLAY_PLANES; p++) {
+		if(!(chip8->planes & (1 << p))) continue;
+
+		for(uint32_t i = 0; i < height; i++) {
+			// Walk against the scroll direction so every source row is read before it is overwritten
+			const uint32_t y = dy > 0 ? height - 1 - i : i;
+			uint64_t *row = chip8->display[y][p];
+			if(dx) {
+				const unsigned __int128 bits = display_row_get(row);
+				display_row_set(row, (dx > 0 ? bits >> dx : bits << -dx) & visible);
+			} else if(dy > 0 ? y >= rows : y + rows < height) {
+				memcpy(row, chip8->display[dy > 0 ? y - rows : y + rows][p], sizeof chip8->display[y][p]);
+			} else {
+				memset(row, 0, sizeof chip8->display[y][p]);
+			}
+		}
+	}
+}
+
+// Conditional skips step over all of F000 NNNN (XO-CHIP) and, in MegaChip mode, 01NN NNNN,
+//	the only 4 byte instructions
+static inline uint16_t skip_size(const chip8_t *chip8) {
+	const uint8_t hi = chip8->ram[chip8->PC];
+	if(hi == 0xF0 && chip8->ram[(uint16_t)(chip8->PC + 1)] == 0x00) return 4;
+	return hi == 0x01 && chip8->mega && chip8->mega->enabled ? 4 : 2;
+}
+
+// 0x0010/0x0011: Leave/enter MegaChip mode, its state is allocated the first time it is entered
+static fault_t mega_enable(chip8_t *chip8, const bool enable) {
+	if(enable && !chip8->mega && !mega_alloc(chip8)) return FAULT_NO_MEMORY;
+
+	if(chip8->mega) chip8->mega->enabled = enable;
+	if(!enable) chip8->I &= 0xFFFF;
+	return FAULT_NONE;
+}
+
+// I wraps at 24 bits in MegaChip mode and at 16 otherwise
+static inline uint32_t address_mask(const chip8_t *chip8) {
+	return chip8->mega && chip8->mega->enabled ? MEGA_ADDRESS_SPACE - 1 : 0xFFFF;
+}
+
+// len bytes at a 24 bit MegaChip address. Past the end of ram they come from the ROM image,
+//	which starts at 0x200 like the part of it in ram. NULL if the range is out of both
+static const uint8_t *mega_data(const chip8_t *chip8, const uint32_t addr, const uint32_t len) {
+	if(addr + len <= RAM_SIZE) return &chip8->ram[addr];
+	if(chip8->rom_ext && addr >= 0x200 && addr + len <= 0x200 + chip8->rom_size) return &chip8->rom_ext[addr - 0x200];
+	return NULL;
+}
+
+typedef uint8_t u8x16_t __attribute__((vector_size(16)));	// 4 ARGB8888 pixels
+typedef uint16_t u16x16_t __attribute__((vector_size(32)));	// The same with room to blend in
+
+// Blend 4 sprite pixels onto 4 screen pixels, all channels at once. opaque is 0xFF in every
+//	byte of a sprite pixel that is drawn and 0 for transparent ones, which keep the screen pixel
+static inline u8x16_t mega_blend4(const u8x16_t sprite, const u8x16_t screen, const u8x16_t opaque, const uint8_t mode) {
+	const u16x16_t s = __builtin_convertvector(sprite, u16x16_t);
+	const u16x16_t d = __builtin_convertvector(screen, u16x16_t);
+	u16x16_t out;
+	switch(mode) {
+		case BLEND_25: out = (s * 64 + d * 192) >> 8; break;
+		case BLEND_50: out = (s + d) >> 1; break;
+		case BLEND_75: out = (s * 192 + d * 64) >> 8; break;
+		case BLEND_ADD:
+			out = s + d;
+			out |= (u16x16_t)(out > 255);	// Saturate, the narrowing below keeps the low 0xFF
+			break;
+		case BLEND_MULTIPLY: out = (s * d + 255) >> 8; break;
+		default: out = s; break;
+	}
+
+	const u8x16_t blended = __builtin_convertvector(out, u8x16_t);
+	return (blended & opaque) | (screen & ~opaque);
+}
+
+// DXYN in MegaChip mode: draw the sprite_width x sprite_height palette index sprite at I to the
+//	back buffer at VX,VY, clipped at the edges. Index 0 is transparent, VF is set if a drawn pixel
+//	covers one of the collision index
+static bool mega_draw_sprite(chip8_t *chip8) {
+	megachip_t *mega = chip8->mega;
+	const uint32_t X_coord = chip8->V[chip8->inst.X];
+	const uint32_t Y_coord = chip8->V[chip8->inst.Y];
+	const uint8_t *sprite = mega_data(chip8, chip8->I, mega->sprite_width * mega->sprite_height);
+	if(!sprite) return false;
+
+	chip8->V[0xF] = 0;
+	if(Y_coord >= MEGA_HEIGHT) return true;
+	const uint32_t cols = mega->sprite_width < MEGA_WIDTH - X_coord ? mega->sprite_width : MEGA_WIDTH - X_coord;
+	const uint32_t rows = mega->sprite_height < MEGA_HEIGHT - Y_coord ? mega->sprite_height : MEGA_HEIGHT - Y_coord;
+	const uint32_t groups = (cols + 3) / 4;
+	mark_mega_dirty(chip8, Y_coord, rows);
+
+	for(uint32_t i = 0; i < rows; i++) {
+		const uint8_t *data = &sprite[i * mega->sprite_width];
+		uint8_t *index = &mega->index[Y_coord + i][X_coord];
+		uint32_t *row = &mega->frames[mega->back][Y_coord + i][X_coord];
+
+		// Look the row up in the palette, padded to whole groups of 4 with transparent pixels
+		uint32_t colors[MEGA_WIDTH], opaque[MEGA_WIDTH], screen[MEGA_WIDTH];
+		for(uint32_t j = 0; j < cols; j++) {
+			colors[j] = mega->palette[data[j]];
+			opaque[j] = data[j] ? ~0u : 0;
+			if(!data[j]) continue;
+			if(index[j] == mega->collision_index) chip8->V[0xF] = 1;
+			index[j] = data[j];
+		}
+		for(uint32_t j = cols; j < groups * 4; j++) colors[j] = opaque[j] = screen[j] = 0;
+		memcpy(screen, row, cols * sizeof *row);
+
+		for(uint32_t g = 0; g < groups; g++) {
+			u8x16_t s, d, o;
+			memcpy(&s, &colors[g * 4], sizeof s);
+			memcpy(&d, &screen[g * 4], sizeof d);
+			memcpy(&o, &opaque[g * 4], sizeof o);
+			d = mega_blend4(s, d, o, mega->blend);
+			memcpy(&screen[g * 4], &d, sizeof d);
+		}
+		memcpy(row, screen, cols * sizeof *row);
+	}
+	return true;
+}
+
+// MegaChip 00BN and 01NN-09NN, X is the second nibble
+static fault_t mega_instruction(chip8_t *chip8) {
+	megachip_t *mega = chip8->mega;
+	const uint8_t NN = chip8->inst.NN;
+
+	switch(chip8->inst.X) {
+		case 0x0: {
+			// 0x00BN: Scroll the frame being drawn up N rows
+			const uint32_t rows = chip8->inst.N, kept = MEGA_HEIGHT - rows;
+			memmove(mega->frames[mega->back][0], mega->frames[mega->back][rows], kept * sizeof mega->frames[0][0]);
+			memset(mega->frames[mega->back][kept], 0, rows * sizeof mega->frames[0][0]);
+			memmove(mega->index[0], mega->index[rows], kept * sizeof mega->index[0]);
+			memset(mega->index[kept], 0, rows * sizeof mega->index[0]);
+			mark_mega_dirty(chip8, 0, MEGA_HEIGHT);
+			break;
+		}
+
+		case 0x1:
+			// 0x01NN NNNN: Set I to the 24 bit address NNNNNN
+			chip8->I = NN << 16 | chip8->ram[chip8->PC] << 8 | chip8->ram[(uint16_t)(chip8->PC + 1)];
+			chip8->PC += 2;
+			break;
+
+		case 0x2: {
+			// 0x02NN: Load NN ARGB colours from I into palette indices 1-NN
+			const uint8_t *data = mega_data(chip8, chip8->I, NN * 4);
+			if(!data) return FAULT_BAD_ADDRESS;
+			for(uint32_t i = 0; i < NN; i++, data += 4) {
+				mega->palette[i + 1] = (uint32_t)data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3];
+			}
+			mark_mega_dirty(chip8, MEGA_DIRTY_PALETTE, 1);
+			break;
+		}
+
+		case 0x3:
+			// 0x03NN: Set the sprite width to NN, 0 is 256
+			mega->sprite_width = NN ? NN : 256;
+			break;
+
+		case 0x4:
+			// 0x04NN: Set the sprite height to NN, 0 is 256
+			mega->sprite_height = NN ? NN : 256;
+			break;
+
+		case 0x5:
+			// 0x05NN: Set the screen alpha to NN
+			mega->alpha = NN;
+			break;
+
+		case 0x6:
+		case 0x7:
+			// 0x060N/0x0700: Play/stop digitised sound at I, not emulated
+			break;
+
+		case 0x8:
+			// 0x080N: Set the sprite blend mode
+			if(NN >= BLEND_MODES) return FAULT_BAD_OPCODE;
+			mega->blend = NN;
+			break;
+
+		case 0x9:
+			// 0x09NN: Set the collision colour index
+			mega->collision_index = NN;
+			break;
+
+		default:
+			return FAULT_BAD_OPCODE;
+	}
+	return FAULT_NONE;
+}
+
+// The superinstruction the translation found starting at addr, if max_insts has room for more
+//	than 1 instruction. Debug builds print every instruction so never fuse
+static inline superinstruction_t fused_at(const chip8_t *chip8, const uint16_t addr, const uint64_t max_insts) {
+#ifdef DEBUG
+	(void)chip8; (void)addr; (void)max_insts;
+	return SUPER_NONE;
+#else
+	if(max_insts < 2 || !chip8->translation || addr > RAM_SIZE - 6) return SUPER_NONE;
+	return chip8->translation->fused[addr];
+#endif
+}
+
+// Opcode at addr, for superinstructions checking ram still holds what they were made from
+static inline uint16_t opcode_at(const chip8_t *chip8, const uint16_t addr) {
+	return chip8->ram[addr] << 8 | chip8->ram[addr + 1];
+}
+
+// The instruction just run went back to itself and changed nothing else, e.g. a jump to
+//	itself or FX0A with no key down. Input and timers only change between calls, so the rest
+//	of max_insts would do the same: count them without running them
+static inline void repeat_idle(chip8_t *chip8, const uint64_t max_insts) {
+#ifdef DEBUG
+	(void)chip8; (void)max_insts;	// Every instruction is printed
+#else
+	chip8->inst_count += max_insts - 1;
+#endif
+}
+
+// Emulate 1 CHIP8 instruction. Hooks are only compiled into the instrumented copy
+//	so the plain interpreter pays nothing for tracing, profiling, fuzzing or debugging,
+//	and quirk checks fold away in copies made for a constant profile.
+//	The plain copies also run superinstructions of up to max_insts instructions in one go,
+//	each instruction still counted and with the same result as running them one by one.
+//	The opcodes are checked against ram every time, so code the ROM rewrote runs unfused
+static inline __attribute__((always_inline)) void emulate(chip8_t *chip8, const bool instrumented, const uint32_t quirks,
+														  uint64_t max_insts) {
+	const uint16_t ram_mask = sizeof chip8->ram - 1;
+next_instruction:;
+	const uint16_t inst_PC = chip8->PC;
+
+	if(instrumented && chip8->debugger && debugger_break(chip8, inst_PC)) return;
+
+	// Addresses are 16 bit, a runaway PC wraps around
+	if(inst_PC > ram_mask - 1) raise_fault(chip8, FAULT_BAD_ADDRESS, inst_PC);
+
+	// Get next opcode from ram
+	chip8->inst.opcode = (chip8->ram[inst_PC & ram_mask] << 8) | chip8->ram[(inst_PC + 1) & ram_mask];
+	if(instrumented && chip8->coverage) {
+		const bool wide = chip8->inst.opcode == 0xF000 ||
+						  (chip8->inst.opcode >> 8 == 0x01 && chip8->mega && chip8->mega->enabled);
+		record_coverage(chip8, COVER_START, inst_PC, 1);
+		record_coverage(chip8, COVER_EXEC, inst_PC, wide ? 4 : 2);
+	}
+	chip8->PC += 2;	// Pre-inc program counter for next opcode
+	chip8->inst_count++;
+
+	// Fill out current instruction format
+	decode_instruction(&chip8->inst);
+
+#ifdef DEBUG
+	print_debug_info(chip8);
+#endif
+
+	if(instrumented && chip8->profiler && --chip8->profiler->countdown == 0) profiler_sample(chip8->profiler, inst_PC);
+
+	// Trace record is filled in before and after, V is kept to find the changed register
+	trace_record_t *trace = NULL;
+	uint8_t V_before[16];
+	if(instrumented && chip8->tracer) {
+		tracer_t *tracer = chip8->tracer;
+		trace = &tracer->records[tracer->count++ & tracer->mask];
+		*trace = (trace_record_t) {
+			.PC = inst_PC,
+			.opcode = chip8->inst.opcode,
+			.I = chip8->I,
+			.operand = chip8->ram[chip8->PC & ram_mask] << 8 | chip8->ram[(chip8->PC + 1) & ram_mask],
+			.VX = chip8->V[chip8->inst.X],
+			.VY = chip8->V[chip8->inst.Y],
+			.reg = TRACE_NO_REG,
+			.reg2 = TRACE_NO_REG,
+		};
+		if(chip8->inst.opcode >> 12 == 0xE)
+			trace->input = chip8->V[chip8->inst.X] < 16 && chip8->keypad[chip8->V[chip8->inst.X]];
+		else if((chip8->inst.opcode & 0xF0FF) == 0xF007)
+			trace->input = chip8->delay_timer;
+		else if(chip8->inst.opcode >> 12 == 0xB)
+			trace->input = chip8->V[0];
+		memcpy(V_before, chip8->V, sizeof V_before);
+	}
+
+	// Emulate opcode
+	switch((chip8->inst.opcode >> 12) & 0x0F) {
+		case 0x00:
+			if(chip8->inst.NNN == 0xE0 && chip8->mega && chip8->mega->enabled) {
+				// 0x00E0: Present the frame drawn so far and start a clear one (MegaChip)
+				megachip_t *mega = chip8->mega;
+				mega->back ^= 1;
+				memset(mega->frames[mega->back], 0, sizeof mega->frames[mega->back]);
+				memset(mega->index, 0, sizeof mega->index);
+				mark_mega_dirty(chip8, 0, MEGA_HEIGHT);
+			} else if(chip8->inst.NNN == 0xE0) {
+				// 0x00E0: Clear the screen, only the selected planes
+				for(uint32_t y = 0; y < DISPLAY_ROWS; y++) {
+					for(uint32_t p = 0; p < DISPLAY_PLANES; p++) {
+						if(chip8->planes & (1 << p)) memset(chip8->display[y][p], 0, sizeof chip8->display[y][p]);
+					}
+				}
+				chip8->display_dirty = ~0ULL >> (64 - DISPLAY_ROWS);
+			} else if((chip8->inst.NNN & 0xFF0) == 0xC0) {
+				// 0x00CN: Scroll the display down N rows (SUPER-CHIP)
+				scroll_display(chip8, 0, chip8->inst.N);
+			} else if((chip8->inst.NNN & 0xFF0) == 0xD0) {
+				// 0x00DN: Scroll the display up N rows (XO-CHIP)
+				scroll_display(chip8, 0, -chip8->inst.N);
+			} else if(chip8->inst.NNN == 0xFB || chip8->inst.NNN == 0xFC) {
+				// 0x00FB/0x00FC: Scroll the display right/left 4 pixels (SUPER-CHIP)
+				scroll_display(chip8, chip8->inst.NNN == 0xFB ? 4 : -4, 0);
+			} else if(chip8->inst.NNN == 0xFD) {
+				// 0x00FD: Exit the interpreter (SUPER-CHIP), halts on this instruction
+				chip8->PC = inst_PC;
+			} else if(chip8->inst.NNN == 0xFE || chip8->inst.NNN == 0xFF) {
+				// 0x00FE/0x00FF: Switch to 64x32 low res/128x64 hi res (SUPER-CHIP), clears every plane
+				chip8->hires = chip8->inst.NNN == 0xFF;
+				memset(chip8->display, 0, sizeof(chip8->display));
+				chip8->display_dirty = ~0ULL >> (64 - DISPLAY_ROWS);
+			} else if(chip8->inst.NNN == 0x10 || chip8->inst.NNN == 0x11) {
+				// 0x0010/0x0011: Leave/enter MegaChip mode
+				const fault_t fault = mega_enable(chip8, chip8->inst.NNN == 0x11);
+				if(fault != FAULT_NONE) raise_fault(chip8, fault, inst_PC);
+			} else if(chip8->mega && chip8->mega->enabled && (chip8->inst.X || (chip8->inst.NN & 0xF0) == 0xB0)) {
+				// 0x00BN, 0x01NN-0x09NN: MegaChip
+				const fault_t fault = mega_instruction(chip8);
+				if(fault != FAULT_NONE) raise_fault(chip8, fault, inst_PC);
+			} else if(chip8->inst.NN == 0xEE) {
+				// 0x00EE: Return from subroutine
+				if(chip8->stack_pointer == &chip8->stack[0]) {
+					raise_fault(chip8, FAULT_STACK_UNDERFLOW, inst_PC);
+					break;
+				}
+				chip8->PC = *--chip8->stack_pointer;
+				if(instrumented) record_edge(chip8, inst_PC);
+				if(instrumented && chip8->profiler) profiler_return(chip8->profiler);
+			} else {
+				// Uninplemented Opcode
+				raise_fault(chip8, FAULT_BAD_OPCODE, inst_PC);
+			}
+			break;
+
+		case 0x01:
+			// 0x1NNN: Jump to address NNN
+			chip8->PC = chip8->inst.NNN;
+			if(instrumented) record_edge(chip8, inst_PC);
+			else if(chip8->PC == inst_PC) repeat_idle(chip8, max_insts);
+			break;
+
+		case 0x02:
+			// 0x2NNN: Call subroutine at NNN
+			if(chip8->stack_pointer == &chip8->stack[sizeof chip8->stack / sizeof chip8->stack[0]]) {
+				raise_fault(chip8, FAULT_STACK_OVERFLOW, inst_PC);
+				break;
+			}
+			*chip8->stack_pointer++ = chip8->PC;
+			chip8->PC = chip8->inst.NNN;
+			if(instrumented) record_edge(chip8, inst_PC);
+			if(instrumented && chip8->profiler) profiler_call(chip8->profiler, chip8->inst.NNN);
 			break;
 
 		case 0x03:
 			// 0x3XNN: Skip next instruction if VX == NN
 			if(chip8->V[chip8->inst.X] == chip8->inst.NN) 
-				chip8->PC += 2;
+				chip8->PC += skip_size(chip8);
+			if(instrumented) record_edge(chip8, inst_PC);
 			break;
 
 		case 0x04:
 			// 0x4XNN: Skip next instruction if VX != NN
 			if(chip8->V[chip8->inst.X] != chip8->inst.NN) 
-				chip8->PC += 2;
+				chip8->PC += skip_size(chip8);
+			if(instrumented) record_edge(chip8, inst_PC);
 			break;
 
-		case 0x05:
-			// 0x5XY0: Skip next instruction if VX == VY
-			if(chip8->V[chip8->inst.X] == chip8->V[chip8->inst.Y]) chip8->PC += 2;
+		case 0x05: {
+			// 0x5XY2/0x5XY3: Save/load VX to VY to/from memory at I, in reverse order if X > Y (XO-CHIP)
+			const uint32_t count = (chip8->inst.X > chip8->inst.Y ? chip8->inst.X - chip8->inst.Y :
+									chip8->inst.Y - chip8->inst.X) + 1;
+			const int32_t dir = chip8->inst.X > chip8->inst.Y ? -1 : 1;
+
+			if(chip8->inst.N == 0) {
+				// 0x5XY0: Skip next instruction if VX == VY
+				if(chip8->V[chip8->inst.X] == chip8->V[chip8->inst.Y]) chip8->PC += skip_size(chip8);
+				if(instrumented) record_edge(chip8, inst_PC);
+			} else if(chip8->inst.N == 2 || chip8->inst.N == 3) {
+				if(chip8->I + count > sizeof chip8->ram) {
+					raise_fault(chip8, FAULT_BAD_ADDRESS, inst_PC);
+					break;
+				}
+
+				for(uint32_t i = 0; i < count; i++) {
+					uint8_t *reg = &chip8->V[chip8->inst.X + dir * (int32_t)i];
+					if(chip8->inst.N == 2) chip8->ram[chip8->I + i] = *reg;
+					else *reg = chip8->ram[chip8->I + i];
+				}
+				if(chip8->inst.N == 2) mark_ram_dirty(chip8, chip8->I, count);
+				if(instrumented) {
+					const uint8_t watch = chip8->inst.N == 2 ? DEBUG_WATCH_WRITE : DEBUG_WATCH_READ;
+					debugger_watch(chip8, watch, chip8->I, count);
+					if(chip8->coverage) record_coverage(chip8, chip8->inst.N == 2 ? COVER_WRITE : COVER_READ, chip8->I, count);
+				}
+			} else {
+				raise_fault(chip8, FAULT_BAD_OPCODE, inst_PC);
+			}
 			break;
+			}
 
 		case 0x06:
 			// 0x6XNN: Set register VX to NN
 			chip8->V[chip8->inst.X] = chip8->inst.NN;
+
+			// 6XNN; 6YNN; DXYN: load the second register here, then straight on to the draw
+			if(!instrumented && max_insts >= 3 && fused_at(chip8, inst_PC, max_insts) == SUPER_LOAD_LOAD_DRAW) {
+				const uint16_t second = opcode_at(chip8, inst_PC + 2);
+				if(second >> 12 == 0x6 && opcode_at(chip8, inst_PC + 4) >> 12 == 0xD) {
+					chip8->V[(second >> 8) & 0x0F] = second & 0xFF;
+					chip8->PC += 2;
+					chip8->inst_count++;
+					max_insts -= 2;
+					goto next_instruction;
+				}
+			}
 			break;
 		
 		case 0x07:
 			// 0x7XNN: Set register VX += NN
 			chip8->V[chip8->inst.X] += chip8->inst.NN;
+
+			// 7XNN; 3XNN/4XNN; 1NNN: a counted loop, the skip and the jump back run here
+			if(!instrumented && max_insts >= 3 && fused_at(chip8, inst_PC, max_insts) == SUPER_ADD_SKIP_JUMP) {
+				const uint16_t skip = opcode_at(chip8, inst_PC + 2);
+				const uint16_t jump = opcode_at(chip8, inst_PC + 4);
+				if((skip >> 12 == 0x3 || skip >> 12 == 0x4) && ((skip >> 8) & 0x0F) == chip8->inst.X &&
+				   jump >> 12 == 0x1) {
+					if((chip8->V[chip8->inst.X] == (skip & 0xFF)) == (skip >> 12 == 0x3)) {
+						// Skipped over the jump
+						chip8->PC += 4;
+						chip8->inst_count++;
+						chip8->inst.opcode = skip;
+					} else {
+						chip8->PC = jump & 0x0FFF;
+						chip8->inst_count += 2;
+						chip8->inst.opcode = jump;
+					}
+					decode_instruction(&chip8->inst);
+				}
+			}
 			break;
 
 		case 0x08:
@@ -683,16 +2846,19 @@ void emulate_instruction(chip8_t *chip8, const config_t config) {
 				case 1:
 					// 0x8XY1: Set register VX |= VY
 					chip8->V[chip8->inst.X] |= chip8->V[chip8->inst.Y];
+					if(quirks & QUIRK_VF_RESET) chip8->V[0xF] = 0;
 					break;
 
 				case 2:
 					// 0x8XY2: Set register VX &= VY
 					chip8->V[chip8->inst.X] &= chip8->V[chip8->inst.Y];
+					if(quirks & QUIRK_VF_RESET) chip8->V[0xF] = 0;
 					break;
 
 				case 3:
 					// 0x8XY3: Set register VX ^= VY
 					chip8->V[chip8->inst.X] ^= chip8->V[chip8->inst.Y];
+					if(quirks & QUIRK_VF_RESET) chip8->V[0xF] = 0;
 					break;
 				
 				case 4:
@@ -713,6 +2879,12 @@ void emulate_instruction(chip8_t *chip8, const config_t config) {
 
 				case 6:
 					// 0x8XY6: Set register VX >>= 1, store LSB of VX prior to shift in VF
+					//	(VX = VY >> 1 with QUIRK_SHIFT_VY)
+					if(quirks & QUIRK_SHIFT_VY) {
+						chip8->V[0xF] = chip8->V[chip8->inst.Y] & 1;
+						chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y] >> 1;
+						break;
+					}
 					chip8->V[0xF] = chip8->V[chip8->inst.X] & 1;
 					chip8->V[chip8->inst.X] >>= 1; 
 					break;
@@ -727,11 +2899,18 @@ void emulate_instruction(chip8_t *chip8, const config_t config) {
 
 				case 0xE:
 					// 0x8XY8: Set register VX <<= 1, store LSB of VX prior to shift in VF
+					//	(VX = VY << 1 with QUIRK_SHIFT_VY)
+					if(quirks & QUIRK_SHIFT_VY) {
+						chip8->V[0xF] = (chip8->V[chip8->inst.Y] & 0x80) >> 7;
+						chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y] << 1;
+						break;
+					}
 					chip8->V[0xF] = (chip8->V[chip8->inst.X] & 0x80) >> 7;
 					chip8->V[chip8->inst.X] <<= 1; 
 					break;
 
 				default:
+					raise_fault(chip8, FAULT_BAD_OPCODE, inst_PC);
 					break;
 			}
 			break;
@@ -739,75 +2918,170 @@ void emulate_instruction(chip8_t *chip8, const config_t config) {
 		case 0x09:
 			// 0x9XY0: Skip next instruction if VX != VY
 			if(chip8->V[chip8->inst.X] != chip8->V[chip8->inst.Y])
-				chip8->PC += 2;
+				chip8->PC += skip_size(chip8);
+			if(instrumented) record_edge(chip8, inst_PC);
 			break;
 
-		case 0x0A:
+		case 0x0A: {
 			// 0xANNN: Set index register I to NNN
 			chip8->I = chip8->inst.NNN;
+
+			// ANNN; FX1E: a table lookup, the add runs here. ANNN; DXYN: straight on to the draw
+			const superinstruction_t super = instrumented ? SUPER_NONE : fused_at(chip8, inst_PC, max_insts);
+			if(super == SUPER_LOAD_I_ADD) {
+				const uint16_t add = opcode_at(chip8, inst_PC + 2);
+				if((add & 0xF0FF) == 0xF01E) {
+					// NNN + VX can't pass 0xFFFF, the address space mask is not needed
+					chip8->I += chip8->V[(add >> 8) & 0x0F];
+					chip8->PC += 2;
+					chip8->inst_count++;
+					chip8->inst.opcode = add;
+					decode_instruction(&chip8->inst);
+				}
+			} else if(super == SUPER_LOAD_I_DRAW && opcode_at(chip8, inst_PC + 2) >> 12 == 0xD) {
+				max_insts--;
+				goto next_instruction;
+			}
 			break;
+		}
 
 		case 0x0B:
-			// 0xBNNN: Set PC to (jump to) address NNN + V0
-			chip8->PC = chip8->inst.NNN + chip8->V[0x0];
+			// 0xBNNN: Set PC to (jump to) address NNN + V0 (XNN + VX with QUIRK_JUMP_VX)
+			chip8->PC = chip8->inst.NNN + chip8->V[quirks & QUIRK_JUMP_VX ? chip8->inst.X : 0x0];
+			if(instrumented) record_edge(chip8, inst_PC);
 			break;
 
 		case 0x0C:
 			// 0xCXNN: Set VX = rand(0-255) & NN
-			chip8->V[chip8->inst.X] = ((rand() % 256) & chip8->inst.NN);
+			chip8->V[chip8->inst.X] = (random_byte(chip8) & chip8->inst.NN);
 			break;
 
 		case 0x0D: {
 			// 0xDXYN: Draw N height sprite at coords X,Y; Read from memory location I;
 			//	Screen pixels are XOR'd with sprite bits,
 			//	VF (Carry flag) is set it any screen pixels are set off; This is usefull for collision detection
-			uint8_t X_coord = chip8->V[chip8->inst.X] % config.window_width;
-			uint8_t Y_coord = chip8->V[chip8->inst.Y] % config.window_height;
-			const uint8_t orig_X = X_coord; // Orig X value
+			//	DXY0 draws a 16x16 sprite, 2 bytes per row (SUPER-CHIP)
+			if(chip8->mega && chip8->mega->enabled) {
+				if(!mega_draw_sprite(chip8)) raise_fault(chip8, FAULT_BAD_ADDRESS, inst_PC);
+				break;
+			}
+
+			const uint32_t width = chip8->hires ? 128 : 64;
+			const uint32_t height = chip8->hires ? 64 : 32;
+			const uint32_t X_coord = chip8->V[chip8->inst.X] % width;
+			const uint32_t Y_coord = chip8->V[chip8->inst.Y] % height;
+			const uint32_t sprite_width = chip8->inst.N ? 8 : 16;
+			const uint32_t sprite_rows = chip8->inst.N ? chip8->inst.N : 16;
+			const uint32_t row_bytes = sprite_width / 8;
+
+			// XO-CHIP: the sprite is drawn to every selected plane, each plane's data follows the last
+			const uint32_t sprite_bytes = sprite_rows * row_bytes;
+			const uint32_t num_planes = __builtin_popcount(chip8->planes);
+			if(chip8->I + num_planes * sprite_bytes > sizeof chip8->ram) {
+				raise_fault(chip8, FAULT_BAD_ADDRESS, inst_PC);
+				break;
+			}
 
 			chip8->V[0xF] = 0;	// Init carry flag to 0
 
-			for(uint8_t i = 0; i < chip8->inst.N; i++) {
-				// Get next byte/row of sprite data
-				const uint8_t sprite_data = chip8->ram[chip8->I + i];
-				X_coord = orig_X;	// Reset X for next row to draw
+			// Rows drawn, the sprite is clipped at the bottom edge unless it wraps to the top
+			const uint32_t rows = (quirks & QUIRK_WRAP) || sprite_rows < height - Y_coord ? sprite_rows : height - Y_coord;
+			const unsigned __int128 visible = ~(unsigned __int128)0 << (128 - width);
 
-				for(int8_t j = 7; j >= 0; j--) {
-					// If sprite pizel/bit is on and display pizel is on, set the carry flag
-					bool *pixel = &chip8->display[Y_coord * config.window_width + X_coord];
-					const bool sprite_bit = (sprite_data & (1 << j));
+			for(uint32_t i = 0; i < rows; i++) {
+				const uint32_t y = (Y_coord + i) % height;
+				const uint8_t *data = &chip8->ram[chip8->I + i * row_bytes];
 
-					if(sprite_bit && *pixel) {
-						chip8->V[0xF] = 1;
-					}
+				for(uint32_t p = 0; p < DISPLAY_PLANES; p++) {
+					if(!(chip8->planes & (1 << p))) continue;
 
-					// XOR display pixel with sprite pixel/bit to set it on or off
-					*pixel ^= sprite_bit;
+					// Get next row of sprite data, left aligned then shifted over to X
+					const uint32_t sprite_data = row_bytes == 2 ? data[0] << 8 | data[1] : data[0];
+					const unsigned __int128 sprite = (unsigned __int128)sprite_data << (128 - sprite_width);
+					unsigned __int128 bits = sprite >> X_coord;
+					data += sprite_bytes;
 
-					// Stop drawing row if hit right edge of screen
-					if(++X_coord >= config.window_width) break;
+					// Pixels past the right edge are clipped, or wrap around to the left edge
+					if((quirks & QUIRK_WRAP) && X_coord + sprite_width > width) bits |= sprite << (width - X_coord);
+					bits &= visible;
+
+					const unsigned __int128 pixels = display_row_get(chip8->display[y][p]);
+
+					// If any sprite pixel/bit is on where the display pixel is on, set the carry flag
+					if(pixels & bits) chip8->V[0xF] = 1;
+
+					// XOR display pixels with sprite pixels/bits to set them on or off
+					display_row_set(chip8->display[y][p], pixels ^ bits);
 				}
-				// Stop drawing entire sprite if hit bottom edge of screen
-				if(++Y_coord >= config.window_height) break;
+				chip8->display_dirty |= 1ULL << y;
+			}
+			if(instrumented) {
+				// Reads of every plane's data are reported as one range
+				const uint32_t len = num_planes ? (num_planes - 1) * sprite_bytes + rows * row_bytes : 0;
+				debugger_watch(chip8, DEBUG_WATCH_READ, chip8->I, len);
+				if(chip8->coverage) record_coverage(chip8, COVER_READ, chip8->I, len);
 			}
 			break;
 			}	
 
 		case 0x0E:
+			if(chip8->V[chip8->inst.X] > 0xF) {
+				raise_fault(chip8, FAULT_BAD_KEY, inst_PC);
+				break;
+			}
+
 			if(chip8->inst.NN == 0x9E) {
 				// 0xEX9E: Skip next instruction if key in VX is pressed
 				if(chip8->keypad[chip8->V[chip8->inst.X]])
-					chip8->PC += 2;
+					chip8->PC += skip_size(chip8);
+				if(instrumented) record_edge(chip8, inst_PC);
 				
 			} else if(chip8->inst.NN == 0xA1) {
 				//0xEXA1: Skip next instruction if key in VX is not pressed
 				if(!chip8->keypad[chip8->V[chip8->inst.X]])
-					chip8->PC += 2;
+					chip8->PC += skip_size(chip8);
+				if(instrumented) record_edge(chip8, inst_PC);
+			} else {
+				raise_fault(chip8, FAULT_BAD_OPCODE, inst_PC);
 			}
 			break;
 
 		case 0x0F:
 			switch(chip8->inst.NN) {
+				case 0x00:
+					// 0xF000 NNNN: Set I to the 16 bit address in the next 2 bytes (XO-CHIP)
+					if(chip8->inst.X != 0) {
+						raise_fault(chip8, FAULT_BAD_OPCODE, inst_PC);
+						break;
+					}
+					chip8->I = chip8->ram[chip8->PC] << 8 | chip8->ram[(uint16_t)(chip8->PC + 1)];
+					chip8->PC += 2;
+					break;
+
+				case 0x01:
+					// 0xFN01: Select the bitplanes N that are drawn to, cleared and scrolled (XO-CHIP)
+					chip8->planes = chip8->inst.X & ((1 << DISPLAY_PLANES) - 1);
+					break;
+
+				case 0x02:
+					// 0xF002: Load the 16 byte audio pattern at I (XO-CHIP)
+					if(chip8->inst.X != 0 || chip8->I + 16u > sizeof chip8->ram) {
+						raise_fault(chip8, chip8->inst.X ? FAULT_BAD_OPCODE : FAULT_BAD_ADDRESS, inst_PC);
+						break;
+					}
+					memcpy(chip8->audio_pattern, &chip8->ram[chip8->I], sizeof chip8->audio_pattern);
+					chip8->pattern_audio = true;
+					if(instrumented) {
+						debugger_watch(chip8, DEBUG_WATCH_READ, chip8->I, 16);
+						if(chip8->coverage) record_coverage(chip8, COVER_READ, chip8->I, 16);
+					}
+					break;
+
+				case 0x3A:
+					// 0xFX3A: Set the audio pattern pitch to VX (XO-CHIP)
+					chip8->pitch = chip8->V[chip8->inst.X];
+					break;
+
 				case 0x0A:
 					// 0xFX0A: VX = get_key(); Wait for a key press and store in VX
 					bool any_key_pressed = false;
@@ -819,18 +3093,36 @@ void emulate_instruction(chip8_t *chip8, const config_t config) {
 						}
 					} 
 
-					if(!any_key_pressed) chip8->PC -= 2;	// keep getting current opcode and running instruction if no key is pressed
+					if(!any_key_pressed) {
+						chip8->PC -= 2;	// keep getting current opcode and running instruction if no key is pressed
+						if(!instrumented) repeat_idle(chip8, max_insts);
+					}
 
 					break;
 
 				case 0x1E:
-					// 0xFX1E: Add VX to I (I += VX), VF not affected
-					chip8->I += chip8->V[chip8->inst.X];
+					// 0xFX1E: Add VX to I (I += VX), VF not affected. I is 24 bit in MegaChip mode
+					chip8->I = (chip8->I + chip8->V[chip8->inst.X]) & address_mask(chip8);
 					break;
 
 				case 0x07:
 					// 0xFX07: Set VX = value of the delay timer
 					chip8->V[chip8->inst.X] = chip8->delay_timer;
+
+					// FX07; 3XNN/4XNN; 1NNN back here: the timer only changes between calls, so a
+					//	turn that stays in the loop is repeated by every whole turn left in max_insts
+					if(!instrumented && max_insts >= 3 && fused_at(chip8, inst_PC, max_insts) == SUPER_WAIT_DELAY) {
+						const uint16_t skip = opcode_at(chip8, inst_PC + 2);
+						const uint16_t jump = opcode_at(chip8, inst_PC + 4);
+						if((skip >> 12 == 0x3 || skip >> 12 == 0x4) && ((skip >> 8) & 0x0F) == chip8->inst.X &&
+						   jump == (0x1000 | inst_PC) &&
+						   (chip8->V[chip8->inst.X] == (skip & 0xFF)) != (skip >> 12 == 0x3)) {
+							chip8->inst_count += max_insts / 3 * 3 - 1;
+							chip8->PC = inst_PC;
+							chip8->inst.opcode = jump;
+							decode_instruction(&chip8->inst);
+						}
+					}
 					break;
 				
 				case 0x15:
@@ -846,34 +3138,83 @@ void emulate_instruction(chip8_t *chip8, const config_t config) {
 				case 0x29:
 					// 0xFX29: Set regist I to the location of the sprite in memory for the character [0x0-0xF] represented by a [4x5] font
 					chip8->I = chip8->V[chip8->inst.X] * 5;
+					if(instrumented && chip8->coverage) record_coverage(chip8, COVER_READ, chip8->I, 5);
+					break;
+
+				case 0x30:
+					// 0xFX30: Set I to the [8x10] big font character for the digit in VX (SUPER-CHIP)
+					chip8->I = BIG_FONT_ADDR + (chip8->V[chip8->inst.X] & 0xF) * 10;
+					if(instrumented && chip8->coverage) record_coverage(chip8, COVER_READ, chip8->I, 10);
+					break;
+
+				case 0x75:
+					// 0xFX75: Save V0-VX to the RPL user flags (SUPER-CHIP)
+					memcpy(chip8->rpl, chip8->V, chip8->inst.X + 1);
+					break;
+
+				case 0x85:
+					// 0xFX85: Load V0-VX from the RPL user flags (SUPER-CHIP)
+					memcpy(chip8->V, chip8->rpl, chip8->inst.X + 1);
 					break;
 
 				case 0x33:
 					// 0xFX33: Stores binary-coded decimal representaion of VX in register I (with various offsets)
 					// 	I = hundreds place, I+1 = tens place, I+2 = ones place
+					if(chip8->I + 3u > sizeof chip8->ram) {
+						raise_fault(chip8, FAULT_BAD_ADDRESS, inst_PC);
+						break;
+					}
+
 					uint8_t bcd = chip8->V[chip8->inst.X];
 					chip8->ram[chip8->I+2] = bcd % 10;
 					bcd /= 10;
 					chip8->ram[chip8->I+1] = bcd % 10;
 					bcd /= 10;
 					chip8->ram[chip8->I] = bcd;
+					mark_ram_dirty(chip8, chip8->I, 3);
+					if(instrumented) {
+						debugger_watch(chip8, DEBUG_WATCH_WRITE, chip8->I, 3);
+						if(chip8->coverage) record_coverage(chip8, COVER_WRITE, chip8->I, 3);
+					}
 					break;
 				
 				case 0x55:
 					// 0xFX55: Stores from V0-VX in memory starting at address I, increment by 1 for each value written
+					if(chip8->I + chip8->inst.X + 1u > sizeof chip8->ram) {
+						raise_fault(chip8, FAULT_BAD_ADDRESS, inst_PC);
+						break;
+					}
+
 					for(uint8_t i = 0; i <= chip8->inst.X; i++) {
 						chip8->ram[chip8->I + i] = chip8->V[i];
 					}
+					mark_ram_dirty(chip8, chip8->I, chip8->inst.X + 1);
+					if(instrumented) {
+						debugger_watch(chip8, DEBUG_WATCH_WRITE, chip8->I, chip8->inst.X + 1);
+						if(chip8->coverage) record_coverage(chip8, COVER_WRITE, chip8->I, chip8->inst.X + 1);
+					}
+					if(quirks & QUIRK_LOAD_STORE_I) chip8->I = (chip8->I + chip8->inst.X + 1) & address_mask(chip8);
 					break;
 
 				case 0x65:
 					// 0x65: Loads from V0-VX from memory starting at address I
+					if(chip8->I + chip8->inst.X + 1u > sizeof chip8->ram) {
+						raise_fault(chip8, FAULT_BAD_ADDRESS, inst_PC);
+						break;
+					}
+
 					for(uint8_t i = 0; i <= chip8->inst.X; i++) {
 						chip8->V[i] = chip8->ram[chip8->I + i];
 					}
+					if(instrumented) {
+						debugger_watch(chip8, DEBUG_WATCH_READ, chip8->I, chip8->inst.X + 1);
+						if(chip8->coverage) record_coverage(chip8, COVER_READ, chip8->I, chip8->inst.X + 1);
+					}
+					if(quirks & QUIRK_LOAD_STORE_I) chip8->I = (chip8->I + chip8->inst.X + 1) & address_mask(chip8);
 					break;
 
 				default:
+					raise_fault(chip8, FAULT_BAD_OPCODE, inst_PC);
 					break;
 			}
 			break;
@@ -881,75 +3222,3418 @@ void emulate_instruction(chip8_t *chip8, const config_t config) {
 		default:
 			break;	// Unimplmented or invalid opcode
 	}
+
+	if(instrumented && trace) trace_finish(trace, chip8, V_before);
 }
 
-// Update CHIP8 delay and sound timers every 60hz
-void update_timers(const sdl_t sdl, chip8_t *chip8) {
-	if(chip8->delay_timer > 0)
-		chip8->delay_timer--;
+// Common quirk profiles run a copy specialised for them, anything else checks chip8->quirks
+//	Up to max_insts instructions run when the ROM's translation fused some together
+void emulate_instructions(chip8_t *chip8, const uint64_t max_insts) {
+	if(chip8->instrumented) emulate(chip8, true, chip8->quirks, 1);
+	else if(chip8->quirks == QUIRKS_DEFAULT) emulate(chip8, false, QUIRKS_DEFAULT, max_insts);
+	else if(chip8->quirks == QUIRKS_COSMAC) emulate(chip8, false, QUIRKS_COSMAC, max_insts);
+	else if(chip8->quirks == QUIRKS_SCHIP) emulate(chip8, false, QUIRKS_SCHIP, max_insts);
+	else if(chip8->quirks == QUIRKS_XOCHIP) emulate(chip8, false, QUIRKS_XOCHIP, max_insts);
+	else emulate(chip8, false, chip8->quirks, max_insts);
+}
 
-	if(chip8->sound_timer > 0) {
-		chip8->sound_timer--;
-		SDL_PauseAudioDevice(sdl.dev, 0);	// Play sound
-	} else {
-		SDL_PauseAudioDevice(sdl.dev, 1);	// Pause sound
-	}
+// Emulate exactly 1 instruction, for stepping and replaying
+void emulate_instruction(chip8_t *chip8) {
+	emulate_instructions(chip8, 1);
 }
 
-int main(int argc, char **argv) {
-	// Default usage message for args
-	if(argc < 2) {
-		fprintf(stderr, "Usage: %s <rom_name>\n", argv[0]);
-		exit(EXIT_FAILURE);
+// Emulate 1 60hz frame worth of instructions and tick the timers without touching audio,
+//	used for speculative run-ahead frames that are never heard
+void advance_frame(chip8_t *chip8, const config_t config) {
+	// Counted by instructions run, a breakpoint hit runs none
+	const uint64_t frame_end = chip8->inst_count + config.insts_per_second / 60;
+	while(chip8->inst_count < frame_end) {
+		emulate_instructions(chip8, frame_end - chip8->inst_count);
 	}
 
-	// Init emulator config/options
-	config_t config = {0};
-	if(!set_config_from_args(&config, argc, argv)) exit(EXIT_FAILURE);
+	if(chip8->delay_timer > 0) chip8->delay_timer--;
+	if(chip8->sound_timer > 0) chip8->sound_timer--;
+}
 
-	// Init SDL
-	sdl_t sdl = {0};
-	if(!init_sdl(&sdl, &config)) exit(EXIT_FAILURE);
+// Keep a speculative copy of the machine run_ahead_frames ahead of the real one.
+//	While input is unchanged the copy stays valid and only needs 1 more frame; when
+//	input changes the copy is rolled back to the real machine and re-run with the new input
+void run_ahead(const chip8_t *chip8, chip8_t *ahead, const config_t config) {
+	static snapshot_t snapshot;
+
+	// ahead->state stays QUIT until the first sync
+	if(ahead->state == RUNNING &&
+		memcmp(ahead->keypad, chip8->keypad, sizeof chip8->keypad) == 0) {
+		advance_frame(ahead, config);
+		return;
+	}
 
-	// Init CHIP8 machine
-	chip8_t chip8 = {0};
-	const char *rom_name = argv[1];
-	if(!init_chip8(&chip8, rom_name)) exit(EXIT_FAILURE);
+	save_snapshot(chip8, &snapshot);
+	load_snapshot(ahead, &snapshot);
+	ahead->state = RUNNING;
+	for(uint32_t i = 0; i < config.run_ahead_frames; i++) {
+		advance_frame(ahead, config);
+	}
+}
+
+// Start recording a movie: header now, keypad changes and keyframes as they happen
+bool movie_start_recording(movie_t *movie, const char *path, const chip8_t *chip8, const config_t config) {
+	movie->file = fopen(path, "wb");
+	if(!movie->file) {
+		SDL_Log("Could not open movie file %s for writing\n", path);
+		return false;
+	}
+
+	const movie_header_t header = {
+		.magic = {'C', '8', 'M', 'V'},
+		.version = MOVIE_VERSION,
+		.seed = chip8->rng_state,
+		.insts_per_second = config.insts_per_second,
+		.rom_hash = chip8->rom_hash,
+		.quirks = chip8->quirks,
+	};
+	fwrite(&header, sizeof header, 1, movie->file);
+
+	movie->mode = MOVIE_RECORD;
+	movie->seed = header.seed;
+	movie->insts_per_second = header.insts_per_second;
+	movie->rom_hash = header.rom_hash;
+	movie->quirks = header.quirks;
+	memcpy(movie->keypad, chip8->keypad, sizeof movie->keypad);
+
+	return true;
+}
+
+// Load a whole movie file into memory for playback
+bool movie_load(movie_t *movie, const char *path) {
+	FILE *file = fopen(path, "rb");
+	if(!file) {
+		SDL_Log("Could not open movie file %s\n", path);
+		return false;
+	}
+
+	movie_header_t header = {0};
+	if(!fread(&header, sizeof header, 1, file) || memcmp(header.magic, "C8MV", 4) != 0 ||
+		header.version != MOVIE_VERSION) {
+		SDL_Log("Movie file %s is not a version %d CHIP8 movie\n", path, MOVIE_VERSION);
+		fclose(file);
+		return false;
+	}
+
+	*movie = (movie_t) {
+		.mode = MOVIE_PLAYBACK,
+		.seed = header.seed,
+		.insts_per_second = header.insts_per_second,
+		.rom_hash = header.rom_hash,
+		.quirks = header.quirks,
+	};
+
+	size_t events_cap = 0, keyframes_cap = 0;
+	bool no_memory = false;
+	int tag;
+	while(!no_memory && (tag = fgetc(file)) != EOF) {
+		bool ok = false;
+
+		switch(tag) {
+			case MOVIE_TAG_EVENT: {
+				movie_event_t event = {0};
+				uint8_t down = 0;
+				ok = fread(&event.inst_count, sizeof event.inst_count, 1, file) &&
+					 fread(&event.key, sizeof event.key, 1, file) &&
+					 fread(&down, sizeof down, 1, file) && event.key < 16;
+				if(!ok) break;
+				event.down = down;
+
+				if(movie->num_events == events_cap) {
+					movie_event_t *events = realloc(movie->events, (events_cap ? events_cap * 2 : 256) * sizeof *events);
+					if(!events) {
+						no_memory = true;
+						break;
+					}
+					movie->events = events;
+					events_cap = events_cap ? events_cap * 2 : 256;
+				}
+				movie->events[movie->num_events++] = event;
+				break;
+			}
+
+			case MOVIE_TAG_KEYFRAME:
+				if(movie->num_keyframes == keyframes_cap) {
+					snapshot_t *keyframes = realloc(movie->keyframes, (keyframes_cap ? keyframes_cap * 2 : 16) * sizeof *keyframes);
+					if(!keyframes) {
+						no_memory = true;
+						break;
+					}
+					movie->keyframes = keyframes;
+					keyframes_cap = keyframes_cap ? keyframes_cap * 2 : 16;
+				}
+				ok = fread(&movie->keyframes[movie->num_keyframes], sizeof *movie->keyframes, 1, file);
+				if(ok) movie->num_keyframes++;
+				break;
+
+			case MOVIE_TAG_END:
+				ok = fread(&movie->end_inst_count, sizeof movie->end_inst_count, 1, file) &&
+					 fread(&movie->end_hash, sizeof movie->end_hash, 1, file);
+				movie->has_end = ok;
+				break;
+
+			default:
+				break;
+		}
+
+		if(!ok && !no_memory) {
+			SDL_Log("Movie file %s is truncated or corrupt, playing back what was read\n", path);
+			break;
+		}
+	}
+
+	fclose(file);
+	if(no_memory) {
+		SDL_Log("Could not allocate memory for movie %s\n", path);
+		free(movie->events);
+		free(movie->keyframes);
+		*movie = (movie_t){0};
+		return false;
+	}
+
+	// Without a clean end, play until the last recorded input or keyframe
+	if(!movie->has_end) {
+		if(movie->num_events)
+			movie->end_inst_count = movie->events[movie->num_events - 1].inst_count;
+		if(movie->num_keyframes && movie->keyframes[movie->num_keyframes - 1].regs.inst_count > movie->end_inst_count)
+			movie->end_inst_count = movie->keyframes[movie->num_keyframes - 1].regs.inst_count;
+	}
+
+	return true;
+}
+
+// Write a keypad change to the movie file
+void movie_write_event(movie_t *movie, const uint64_t inst_count, const uint8_t key, const bool down) {
+	const uint8_t tag = MOVIE_TAG_EVENT;
+	const uint8_t down_byte = down;
+
+	fwrite(&tag, sizeof tag, 1, movie->file);
+	fwrite(&inst_count, sizeof inst_count, 1, movie->file);
+	fwrite(&key, sizeof key, 1, movie->file);
+	fwrite(&down_byte, sizeof down_byte, 1, movie->file);
+}
+
+// Called at the start of every emulated frame. Recording: log keypad changes and
+//	periodic keyframes. Playback: replace live input with the recorded keypad state
+void movie_update(movie_t *movie, chip8_t *chip8, const config_t config) {
+	if(movie->mode == MOVIE_RECORD) {
+		for(uint8_t key = 0; key < 16; key++) {
+			if(chip8->keypad[key] != movie->keypad[key]) {
+				movie_write_event(movie, chip8->inst_count, key, chip8->keypad[key]);
+				movie->keypad[key] = chip8->keypad[key];
+			}
+		}
+
+		if(config.keyframe_interval && movie->frame % config.keyframe_interval == 0) {
+			const uint8_t tag = MOVIE_TAG_KEYFRAME;
+			snapshot_t snapshot = {0};	// Zeroed so struct padding is written deterministically
+			save_snapshot(chip8, &snapshot);
+			fwrite(&tag, sizeof tag, 1, movie->file);
+			fwrite(&snapshot, sizeof snapshot, 1, movie->file);
+		}
+
+	} else if(movie->mode == MOVIE_PLAYBACK) {
+		while(movie->next_event < movie->num_events &&
+			  movie->events[movie->next_event].inst_count <= chip8->inst_count) {
+			const movie_event_t *event = &movie->events[movie->next_event++];
+			movie->keypad[event->key] = event->down;
+		}
+		memcpy(chip8->keypad, movie->keypad, sizeof chip8->keypad);
+	}
+
+	movie->frame++;
+}
+
+// Playback has reached the point where recording stopped
+bool movie_finished(const movie_t *movie, const chip8_t *chip8) {
+	return movie->mode == MOVIE_PLAYBACK && chip8->inst_count >= movie->end_inst_count;
+}
+
+// Compare the machine against the state hash stored when recording stopped
+bool movie_verify(const movie_t *movie, const chip8_t *chip8) {
+	const uint64_t hash = state_hash(chip8);
+
+	if(hash != movie->end_hash) {
+		SDL_Log("Movie playback diverged at instruction %llu: state hash 0x%016llX, recorded 0x%016llX\n",
+				(unsigned long long)chip8->inst_count, (unsigned long long)hash,
+				(unsigned long long)movie->end_hash);
+		return false;
+	}
+
+	SDL_Log("Movie playback matches recording after %llu instructions\n",
+			(unsigned long long)chip8->inst_count);
+	return true;
+}
+
+// Jump playback to the first frame at or after inst_count, starting from the closest
+//	earlier keyframe instead of boot
+void movie_seek(movie_t *movie, chip8_t *chip8, const config_t config, const uint64_t inst_count) {
+	// Keyframes are in order, take the last one not past the target
+	const snapshot_t *keyframe = NULL;
+	for(size_t i = 0; i < movie->num_keyframes && movie->keyframes[i].regs.inst_count <= inst_count; i++) {
+		keyframe = &movie->keyframes[i];
+	}
+
+	if(keyframe && keyframe->regs.inst_count > chip8->inst_count) {
+		const uint32_t insts_per_frame = config.insts_per_second / 60;
+
+		load_snapshot(chip8, keyframe);
+		if(chip8->profiler) profiler_sync(chip8->profiler, chip8);
+		memcpy(movie->keypad, keyframe->regs.keypad, sizeof movie->keypad);
+		movie->frame = insts_per_frame ? keyframe->regs.inst_count / insts_per_frame : 0;
+
+		// Keyframes are taken after the frame's input was applied
+		movie->next_event = 0;
+		while(movie->next_event < movie->num_events &&
+			  movie->events[movie->next_event].inst_count <= keyframe->regs.inst_count) {
+			movie->next_event++;
+		}
+	}
+
+	while(chip8->inst_count < inst_count && !movie_finished(movie, chip8)) {
+		movie_update(movie, chip8, config);
+		advance_frame(chip8, config);
+	}
+}
+
+// Finish a recording with the final state hash so playback can be verified, free playback data
+void movie_close(movie_t *movie, const chip8_t *chip8) {
+	if(movie->mode == MOVIE_RECORD) {
+		const uint8_t tag = MOVIE_TAG_END;
+		const uint64_t hash = state_hash(chip8);
+
+		fwrite(&tag, sizeof tag, 1, movie->file);
+		fwrite(&chip8->inst_count, sizeof chip8->inst_count, 1, movie->file);
+		fwrite(&hash, sizeof hash, 1, movie->file);
+		fclose(movie->file);
+	}
+
+	free(movie->events);
+	free(movie->keyframes);
+	*movie = (movie_t){0};
+}
+
+// Open host cycles, instructions, branch misses and L1d read misses as one counter group,
+//	user space only so it works with the default perf_event_paranoid setting
+bool perf_counters_init(perf_counters_t *perf) {
+	*perf = (perf_counters_t){.group = -1};
+	for(int i = 0; i < PERF_COUNTERS; i++) perf->slot[i] = -1;
+
+#ifdef __linux__
+	const struct {
+		uint32_t type;
+		uint64_t config;
+	} events[PERF_COUNTERS] = {
+		[PERF_CYCLES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+		[PERF_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+		[PERF_BRANCH_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+		[PERF_L1D_MISSES] = {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+							 (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+	};
+
+	for(int i = 0; i < PERF_COUNTERS; i++) {
+		struct perf_event_attr attr = {
+			.size = sizeof attr,
+			.type = events[i].type,
+			.config = events[i].config,
+			.read_format = PERF_FORMAT_GROUP,
+			.disabled = perf->group == -1,	// Leader starts disabled, members follow it
+			.exclude_kernel = 1,
+			.exclude_hv = 1,
+		};
+
+		const int fd = syscall(SYS_perf_event_open, &attr, 0, -1, perf->group, 0);
+		if(fd < 0) continue;	// Not every CPU or VM has every counter
+
+		if(perf->group == -1) perf->group = fd;
+		perf->slot[i] = perf->opened++;
+	}
+
+	if(perf->group != -1) {
+		ioctl(perf->group, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+		return true;
+	}
+#endif
+
+	SDL_Log("Hardware performance counters are not available here\n");
+	return false;
+}
+
+// Current counter values, counters that could not be opened read as 0
+static inline void perf_counters_read(const perf_counters_t *perf, perf_values_t *out) {
+	*out = (perf_values_t){0};
+
+#ifdef __linux__
+	uint64_t buffer[1 + PERF_COUNTERS];	// nr, then 1 value per opened counter
+	if(read(perf->group, buffer, sizeof buffer) < (ssize_t)sizeof(uint64_t)) return;
+
+	for(int i = 0; i < PERF_COUNTERS; i++) {
+		if(perf->slot[i] >= 0) out->values[i] = buffer[1 + perf->slot[i]];
+	}
+#else
+	(void)perf;
+#endif
+}
+
+// Add the counts since start to a running total
+static inline void perf_counters_add(const perf_counters_t *perf, const perf_values_t *start, perf_values_t *total) {
+	perf_values_t now;
+	perf_counters_read(perf, &now);
+
+	for(int i = 0; i < PERF_COUNTERS; i++) {
+		total->values[i] += now.values[i] - start->values[i];
+	}
+}
+
+// Print totals with IPC and per emulated CHIP8 instruction costs, then close the counters
+void perf_counters_report(perf_counters_t *perf) {
+	const struct {
+		const char *name;
+		const perf_values_t *values;
+	} rows[] = {
+		{"emulate", &perf->emulate},
+		{"update_screen", &perf->render},
+	};
+	const int w = 14;	// Every column, so the header and rows line up
+	const double insts = perf->guest_insts ? perf->guest_insts : 1;
+
+	printf("%llu frames, %llu CHIP8 instructions\n",
+		   (unsigned long long)perf->frames, (unsigned long long)perf->guest_insts);
+	printf("%-*s %*s %*s %*s %*s %*s %*s %*s %*s\n", w, "", w, "cycles", w, "instructions", w, "IPC",
+		   w, "br-misses", w, "L1d-misses", w, "cycles/inst", w, "br-miss/inst", w, "L1d-miss/inst");
+
+	for(size_t i = 0; i < sizeof rows / sizeof rows[0]; i++) {
+		const uint64_t *v = rows[i].values->values;
+		printf("%-*s %*llu %*llu %*.2f %*llu %*llu %*.2f %*.4f %*.4f\n", w, rows[i].name,
+			   w, (unsigned long long)v[PERF_CYCLES], w, (unsigned long long)v[PERF_INSTRUCTIONS],
+			   w, v[PERF_CYCLES] ? (double)v[PERF_INSTRUCTIONS] / v[PERF_CYCLES] : 0.0,
+			   w, (unsigned long long)v[PERF_BRANCH_MISSES], w, (unsigned long long)v[PERF_L1D_MISSES],
+			   w, v[PERF_CYCLES] / insts, w, v[PERF_BRANCH_MISSES] / insts, w, v[PERF_L1D_MISSES] / insts);
+	}
+
+	for(int i = 0; i < PERF_COUNTERS; i++) {
+		if(perf->slot[i] < 0) printf("(%s counter was not available and reads as 0)\n", perf_counter_names[i]);
+	}
+
+#ifdef __linux__
+	close(perf->group);	// Members are closed with the process
+#endif
+	perf->group = -1;
+}
+
+// Start profiling chip8 from where it is now, with the calls it is already in
+bool profiler_init(profiler_t *profiler, const uint32_t interval, const chip8_t *chip8) {
+	*profiler = (profiler_t) {
+		.interval = interval,
+		.countdown = interval,
+		.root = chip8->PC,
+		.stacks = calloc(PROFILER_STACKS, sizeof(profile_stack_t)),
+	};
+
+	if(!profiler->stacks) {
+		SDL_Log("Could not allocate profiler stack table\n");
+		return false;
+	}
+
+	profiler_sync(profiler, chip8);
+	return true;
+}
+
+// Write samples as folded stacks ("0x0200;sub_02A4;0x02B0 42" per line), the format
+//	flamegraph.pl, speedscope and inferno take; the root frame is the PC profiling started
+//	at, the ROM entry point unless the session started from a --seek
+bool profiler_save(profiler_t *profiler, const char *path) {
+	FILE *file = fopen(path, "w");
+	if(!file) {
+		SDL_Log("Could not open profile file %s\n", path);
+		free(profiler->stacks);
+		return false;
+	}
+
+	for(uint32_t i = 0; i < PROFILER_STACKS; i++) {
+		const profile_stack_t *stack = &profiler->stacks[i];
+		if(!stack->hash) continue;
+
+		fprintf(file, "0x%04X", profiler->root);
+		for(uint8_t depth = 0; depth < stack->depth; depth++) {
+			fprintf(file, ";sub_%03X", stack->frames[depth]);
+		}
+		fprintf(file, ";0x%04X %llu\n", stack->frames[stack->depth], (unsigned long long)stack->count);
+	}
+
+	fclose(file);
+	if(profiler->dropped)
+		SDL_Log("Profiler dropped %llu of %llu samples, too many distinct stacks\n",
+				(unsigned long long)profiler->dropped, (unsigned long long)profiler->samples);
+
+	free(profiler->stacks);
+	*profiler = (profiler_t){0};
+	return true;
+}
+
+// Allocate a trace ring buffer of at least size records
+bool tracer_init(tracer_t *tracer, const uint32_t size) {
+	uint32_t capacity = 1;
+	while(capacity < size) capacity <<= 1;
+
+	tracer->records = malloc(capacity * sizeof *tracer->records);
+	if(!tracer->records) {
+		SDL_Log("Could not allocate %u trace records\n", capacity);
+		return false;
+	}
+
+	tracer->mask = capacity - 1;
+	tracer->count = 0;
+	return true;
+}
+
+// Write the buffered records oldest first, then free the buffer
+bool tracer_save(tracer_t *tracer, const char *path) {
+	const uint64_t capacity = (uint64_t)tracer->mask + 1;
+	const uint64_t kept = tracer->count < capacity ? tracer->count : capacity;
+	const trace_header_t header = {
+		.magic = {'C', '8', 'T', 'R'},
+		.version = TRACE_VERSION,
+		.count = kept,
+		.first_inst = tracer->count - kept,
+	};
+	bool ok = false;
+
+	FILE *file = fopen(path, "wb");
+	if(file) {
+		// The ring wraps at most once: oldest records start at count, up to the end of the buffer
+		const uint64_t start = tracer->count & tracer->mask;
+		const uint64_t tail = kept < capacity ? 0 : capacity - start;
+
+		ok = fwrite(&header, sizeof header, 1, file) == 1;
+		if(tail) ok = ok && fwrite(&tracer->records[start], sizeof *tracer->records, tail, file) == tail;
+		ok = ok && fwrite(tracer->records, sizeof *tracer->records, kept - tail, file) == kept - tail;
+		ok = (fclose(file) == 0) && ok;
+	}
+
+	if(!ok) SDL_Log("Could not write trace file %s\n", path);
+
+	free(tracer->records);
+	*tracer = (tracer_t){0};
+	return ok;
+}
+
+// Print a binary trace as the same text print_debug_info() gives in a -DDEBUG build
+bool decode_trace(const char *path) {
+	FILE *file = fopen(path, "rb");
+	if(!file) {
+		SDL_Log("Could not open trace file %s\n", path);
+		return false;
+	}
+
+	trace_header_t header = {0};
+	if(!fread(&header, sizeof header, 1, file) || memcmp(header.magic, "C8TR", 4) != 0 ||
+		header.version != TRACE_VERSION) {
+		SDL_Log("%s is not a version %d CHIP8 trace\n", path, TRACE_VERSION);
+		fclose(file);
+		return false;
+	}
+
+	trace_record_t record, next;
+	bool have_next = fread(&next, sizeof next, 1, file) == 1;
+
+	for(uint64_t i = 0; i < header.count && have_next; i++) {
+		record = next;
+		have_next = fread(&next, sizeof next, 1, file) == 1;
+
+		// Rebuild just enough machine state for print_debug_info(); the return
+		//	address of 00EE is where the next record executed
+		chip8_t chip8 = {0};
+		chip8.PC = record.PC + 2;
+		chip8.I = record.I;
+		chip8.ram[chip8.PC] = record.operand >> 8;
+		chip8.ram[(uint16_t)(chip8.PC + 1)] = record.operand & 0xFF;
+		chip8.inst.opcode = record.opcode;
+		decode_instruction(&chip8.inst);
+		if(chip8.inst.opcode >> 12 == 0xB) chip8.V[0] = record.input;
+		chip8.V[chip8.inst.X] = record.VX;
+		chip8.V[chip8.inst.Y] = record.VY;
+		if(chip8.inst.opcode >> 12 == 0xE && record.VX < 16) chip8.keypad[record.VX] = record.input;
+		if((chip8.inst.opcode & 0xF0FF) == 0xF007) chip8.delay_timer = record.input;
+		chip8.stack[0] = have_next ? next.PC : 0;
+		chip8.stack_pointer = &chip8.stack[1];
+
+		printf("[%llu] ", (unsigned long long)(header.first_inst + i));
+		print_debug_info(&chip8);
+		if(record.reg != TRACE_NO_REG)
+			printf("\t-> V%X = 0x%02X\n", record.reg, record.value);
+		if(record.reg2 != TRACE_NO_REG)
+			printf("\t-> V%X = 0x%02X\n", record.reg2, record.value2);
+	}
+
+	fclose(file);
+	return true;
+}
+
+static inline uint32_t histogram_index(const uint64_t value) {
+	if(value < (1 << HISTOGRAM_SUB_BITS)) return value;
+
+	const uint32_t exponent = 63 - __builtin_clzll(value);
+	const uint32_t sub = (value >> (exponent - HISTOGRAM_SUB_BITS)) & ((1 << HISTOGRAM_SUB_BITS) - 1);
+	return ((exponent - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) + sub;
+}
+
+// Smallest value that lands in a bucket
+static inline uint64_t histogram_value(const uint32_t index) {
+	if(index < (1 << HISTOGRAM_SUB_BITS)) return index;
+
+	const uint32_t exponent = (index >> HISTOGRAM_SUB_BITS) + HISTOGRAM_SUB_BITS - 1;
+	const uint64_t sub = index & ((1 << HISTOGRAM_SUB_BITS) - 1);
+	return ((1ULL << HISTOGRAM_SUB_BITS) | sub) << (exponent - HISTOGRAM_SUB_BITS);
+}
+
+// Record a performance counter interval in microseconds
+static inline void histogram_record(histogram_t *histogram, const uint64_t ticks) {
+	const uint64_t us = ticks * 1000000 / SDL_GetPerformanceFrequency();
+
+	histogram->counts[histogram_index(us)]++;
+	histogram->total++;
+	if(us > histogram->max) histogram->max = us;
+}
+
+// Value at percentile (0-100) in microseconds, reported as the bucket's lower bound
+uint64_t histogram_percentile(const histogram_t *histogram, const double percentile) {
+	const uint64_t rank = (uint64_t)(histogram->total * percentile / 100.0);
+	uint64_t seen = 0;
+
+	for(uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += histogram->counts[i];
+		if(seen > rank) return histogram_value(i);
+	}
+
+	return histogram->max;
+}
+
+// Window title with live frame time percentiles
+void show_frame_stats(const sdl_t sdl, const frame_stats_t *stats) {
+	char title[256];
+
+	snprintf(title, sizeof title,
+			 "Chip-8 Emulator | frame p50 %.2f p99 %.2f ms | emulate p99 %.2f ms | render p99 %.2f ms | missed %llu",
+			 histogram_percentile(&stats->frame, 50) / 1000.0, histogram_percentile(&stats->frame, 99) / 1000.0,
+			 histogram_percentile(&stats->emulate, 99) / 1000.0, histogram_percentile(&stats->render, 99) / 1000.0,
+			 (unsigned long long)stats->missed);
+	SDL_SetWindowTitle(sdl.window, title);
+}
+
+// Dump p50/p95/p99/max of every frame phase
+void print_frame_stats(const frame_stats_t *stats) {
+	const struct {
+		const char *name;
+		const histogram_t *histogram;
+	} rows[] = {
+		{"emulate", &stats->emulate},
+		{"render", &stats->render},
+		{"sleep overshoot", &stats->overshoot},
+		{"frame", &stats->frame},
+	};
+
+	printf("%-16s %10s %10s %10s %10s (ms)\n", "", "p50", "p95", "p99", "max");
+	for(size_t i = 0; i < sizeof rows / sizeof rows[0]; i++) {
+		printf("%-16s %10.3f %10.3f %10.3f %10.3f\n", rows[i].name,
+			   histogram_percentile(rows[i].histogram, 50) / 1000.0,
+			   histogram_percentile(rows[i].histogram, 95) / 1000.0,
+			   histogram_percentile(rows[i].histogram, 99) / 1000.0,
+			   rows[i].histogram->max / 1000.0);
+	}
+	printf("%llu frames, %llu missed the 60hz deadline\n",
+		   (unsigned long long)stats->frames, (unsigned long long)stats->missed);
+}
+
+// Background thread writing handed off span buffers as Chrome trace events
+int frame_tracer_writer(void *data) {
+	frame_tracer_t *spans = data;
+	const double us_per_tick = 1000000.0 / SDL_GetPerformanceFrequency();
+	bool first = true;
+
+	for(;;) {
+		SDL_SemWait(spans->ready);
+
+		const span_t *buffer = spans->buffers[spans->pending];
+		for(uint32_t i = 0; i < spans->pending_used; i++) {
+			fprintf(spans->file,
+					"%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,"
+					"\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%llu}}",
+					first ? "\n" : ",\n", buffer[i].name,
+					(buffer[i].start - spans->origin) * us_per_tick,
+					(buffer[i].end - buffer[i].start) * us_per_tick,
+					(unsigned long long)buffer[i].frame);
+			first = false;
+		}
+
+		const bool stop = spans->stop;
+		SDL_SemPost(spans->done);
+		if(stop) break;
+	}
+
+	return 0;
+}
+
+bool frame_tracer_init(frame_tracer_t *spans, const char *path) {
+	spans->file = fopen(path, "w");
+	if(!spans->file) {
+		SDL_Log("Could not open frame trace file %s\n", path);
+		return false;
+	}
+
+	fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", spans->file);
+	spans->origin = SDL_GetPerformanceCounter();
+	spans->ready = SDL_CreateSemaphore(0);
+	spans->done = SDL_CreateSemaphore(1);	// The second buffer starts out free
+	if(!spans->ready || !spans->done) {
+		SDL_Log("Could not create frame trace semaphores: %s\n", SDL_GetError());
+		SDL_DestroySemaphore(spans->ready);
+		SDL_DestroySemaphore(spans->done);
+		fclose(spans->file);
+		return false;
+	}
+
+	spans->writer = SDL_CreateThread(frame_tracer_writer, "frame trace writer", spans);
+	if(!spans->writer) {
+		SDL_Log("Could not start frame trace writer thread: %s\n", SDL_GetError());
+		SDL_DestroySemaphore(spans->ready);
+		SDL_DestroySemaphore(spans->done);
+		fclose(spans->file);
+		return false;
+	}
+	return true;
+}
+
+// Give the filled buffer to the writer and carry on in the other one, only waits
+//	if the writer is still busy with the previous buffer
+void frame_tracer_flush(frame_tracer_t *spans) {
+	SDL_SemWait(spans->done);
+	spans->pending = spans->fill;
+	spans->pending_used = spans->used;
+	SDL_SemPost(spans->ready);
+
+	spans->fill ^= 1;
+	spans->used = 0;
+}
+
+// Record a span from start until now when frame tracing is on, returns now
+static inline uint64_t frame_span(frame_tracer_t *spans, const char *name, const uint64_t start) {
+	const uint64_t now = SDL_GetPerformanceCounter();
+
+	if(spans) {
+		spans->buffers[spans->fill][spans->used++] = (span_t) {
+			.name = name,
+			.start = start,
+			.end = now,
+			.frame = spans->frame,
+		};
+		if(spans->used == SPAN_BUFFER_SIZE) frame_tracer_flush(spans);
+	}
+
+	return now;
+}
+
+// Write out what is left, finish the JSON and stop the writer
+void frame_tracer_close(frame_tracer_t *spans) {
+	spans->stop = true;
+	frame_tracer_flush(spans);
+	SDL_WaitThread(spans->writer, NULL);
+
+	fputs("\n]}\n", spans->file);
+	fclose(spans->file);
+	SDL_DestroySemaphore(spans->ready);
+	SDL_DestroySemaphore(spans->done);
+}
+
+// Static ROM analysis, 1 byte of ANALYSIS_* flags per ram address
+#define ANALYSIS_INST 0x01		// First byte of an instruction reachable from 0x200
+#define ANALYSIS_CODE 0x02		// Any byte of a reachable instruction
+#define ANALYSIS_LEADER 0x04	// First instruction of a basic block
+#define ANALYSIS_CALL 0x08		// 2NNN target, a subroutine entry
+#define ANALYSIS_TABLE 0x10		// Entry of a BNNN jump table
+#define ANALYSIS_SPRITE 0x20	// Drawn by DXYN with I set by ANNN or F000 NNNN earlier in the block
+#define ANALYSIS_DATA 0x40		// Read or written by FX33, FX55, FX65 or F002 with such an I
+
+// Code and data recovered from a ROM without running it, for tools that want to look at or
+//	translate code ahead of execution. Control flow that depends on register values (BNNN, 00EE)
+//	is followed through jump table and call/return heuristics
+typedef struct analysis {
+	uint8_t flags[RAM_SIZE];
+	uint16_t worklist[RAM_SIZE];	// Leaders waiting to be walked, each is pushed once
+	uint32_t pending;
+	uint32_t quirks;
+	bool mega;				// A reachable 0011 makes 01NN NNNN a 4 byte instruction
+} analysis_t;
+
+// Where control can go after one instruction, by the same rules as emulate()
+typedef struct {
+	bool valid;				// emulate() would not fault with FAULT_BAD_OPCODE
+	bool ends_block;		// Control can go anywhere other than the next instruction
+	uint8_t length;			// 2, or 4 for F000 NNNN and MegaChip 01NN NNNN
+	uint8_t num_next;		// Static successors in next, 0 for 00EE, 00FD and BNNN
+	uint16_t next[2];
+} flow_t;
+
+// Size of the instruction a skip at addr - 2 steps over, like skip_size()
+static uint16_t analysis_skip_size(const analysis_t *analysis, const uint8_t *ram, const uint16_t addr) {
+	if(ram[addr] == 0xF0 && ram[(uint16_t)(addr + 1)] == 0x00) return 4;
+	return analysis->mega && ram[addr] == 0x01 ? 4 : 2;
+}
+
+flow_t analysis_flow(const analysis_t *analysis, const uint8_t *ram, const uint16_t addr) {
+	instruction_t inst = {.opcode = ram[addr] << 8 | ram[(uint16_t)(addr + 1)]};
+	decode_instruction(&inst);
+	const uint16_t next = addr + 2;
+	flow_t flow = {.valid = true, .length = 2, .num_next = 1, .next = {next}};
+	bool skip = false;
+
+	switch(inst.opcode >> 12) {
+		case 0x0:
+			if(inst.NNN == 0xEE || inst.NNN == 0xFD) {
+				flow.num_next = 0;
+				flow.ends_block = true;
+			} else if(analysis->mega && inst.X >= 0x1 && inst.X <= 0x9) {
+				if(inst.X == 0x1) flow.length = 4;
+			} else {
+				flow.valid = inst.NNN == 0xE0 || (inst.NNN & 0xFF0) == 0xC0 || (inst.NNN & 0xFF0) == 0xD0 ||
+							 inst.NNN >= 0xFB || inst.NNN == 0x10 || inst.NNN == 0x11 ||
+							 (analysis->mega && (inst.NNN & 0xFF0) == 0xB0);
+			}
+			break;
+
+		case 0x1:
+			flow.next[0] = inst.NNN;
+			flow.ends_block = true;
+			break;
+
+		case 0x2:
+			// Calls end a block, the return comes back to the next instruction
+			flow.ends_block = true;
+			break;
+
+		case 0x3:
+		case 0x4:
+			skip = true;
+			break;
+
+		case 0x5:
+			skip = inst.N == 0;
+			flow.valid = inst.N == 0 || inst.N == 2 || inst.N == 3;
+			break;
+
+		case 0x8:
+			flow.valid = inst.N <= 0x7 || inst.N == 0xE;
+			break;
+
+		case 0x9:
+			skip = true;
+			flow.valid = inst.N == 0;
+			break;
+
+		case 0xB:
+			flow.num_next = 0;
+			flow.ends_block = true;
+			break;
+
+		case 0xE:
+			skip = true;
+			flow.valid = inst.NN == 0x9E || inst.NN == 0xA1;
+			break;
+
+		case 0xF:
+			switch(inst.NN) {
+				case 0x00: flow.valid = inst.X == 0; flow.length = 4; break;
+				case 0x02: flow.valid = inst.X == 0; break;
+				case 0x01: case 0x07: case 0x0A: case 0x15: case 0x18: case 0x1E: case 0x29: case 0x30:
+				case 0x33: case 0x3A: case 0x55: case 0x65: case 0x75: case 0x85: break;
+				default: flow.valid = false; break;
+			}
+			break;
+
+		default:
+			break;
+	}
+
+	if(!flow.valid) {
+		flow.num_next = 0;
+		flow.ends_block = true;
+	} else if(skip) {
+		flow.num_next = 2;
+		flow.next[1] = next + analysis_skip_size(analysis, ram, next);
+		flow.ends_block = true;
+	} else if(!flow.ends_block) {
+		flow.next[0] = addr + flow.length;
+	}
+	return flow;
+}
+
+// Queue addr to be walked as the start of a basic block
+static void analysis_push(analysis_t *analysis, const uint32_t addr) {
+	if(addr > RAM_SIZE - 2 || analysis->flags[addr] & ANALYSIS_LEADER) return;
+	analysis->flags[addr] |= ANALYSIS_LEADER;
+	analysis->worklist[analysis->pending++] = addr;
+}
+
+// BNNN jumps to NNN plus a register, so NNN is taken as a table of 1NNN jumps, one per even
+//	offset a register can add. Without any the jump is taken to land on NNN itself
+static void analysis_jump_table(analysis_t *analysis, const uint8_t *ram, const uint16_t base) {
+	for(uint32_t entry = base; entry < base + 256u && entry <= RAM_SIZE - 2 && ram[entry] >> 4 == 0x1; entry += 2) {
+		analysis->flags[entry] |= ANALYSIS_TABLE;
+		analysis_push(analysis, entry);
+	}
+	analysis_push(analysis, base);
+}
+
+// Flag len bytes of data at addr
+static void analysis_mark(analysis_t *analysis, const uint8_t flag, const uint32_t addr, const uint32_t len) {
+	for(uint32_t i = 0; i < len && addr + i < RAM_SIZE; i++) analysis->flags[addr + i] |= flag;
+}
+
+// Walk the ROM in chip8's ram from 0x200 through every statically known path and flag the
+//	instructions, basic blocks and data it finds
+void analyse_rom(analysis_t *analysis, const chip8_t *chip8) {
+	const uint8_t *ram = chip8->ram;
+	memset(analysis->flags, 0, sizeof analysis->flags);
+	analysis->pending = 0;
+	analysis->quirks = chip8->quirks;
+	analysis->mega = false;
+	analysis_push(analysis, 0x200);
+
+	while(analysis->pending) {
+		uint32_t addr = analysis->worklist[--analysis->pending];
+		int32_t I = -1;		// I while it holds a known address, only followed within a block
+
+		while(addr <= RAM_SIZE - 2 && !(analysis->flags[addr] & ANALYSIS_INST)) {
+			const flow_t flow = analysis_flow(analysis, ram, addr);
+			if(!flow.valid) break;
+
+			analysis->flags[addr] |= ANALYSIS_INST;
+			analysis_mark(analysis, ANALYSIS_CODE, addr, flow.length);
+
+			instruction_t inst = {.opcode = ram[addr] << 8 | ram[addr + 1]};
+			decode_instruction(&inst);
+			const uint16_t operand = ram[(uint16_t)(addr + 2)] << 8 | ram[(uint16_t)(addr + 3)];
+			switch(inst.opcode >> 12) {
+				case 0x0:
+					if(inst.NNN == 0x11) analysis->mega = true;
+					if(analysis->mega && inst.X == 0x1) I = inst.NN ? -1 : operand;
+					break;
+				case 0x2:
+					analysis->flags[inst.NNN] |= ANALYSIS_CALL;
+					analysis_push(analysis, inst.NNN);
+					break;
+				case 0xA:
+					I = inst.NNN;
+					break;
+				case 0xB:
+					analysis_jump_table(analysis, ram, inst.NNN);
+					break;
+				case 0xD:
+					if(I >= 0) analysis_mark(analysis, ANALYSIS_SPRITE, I, inst.N ? inst.N : 32);
+					break;
+				case 0xF:
+					if(inst.NN == 0x00) {
+						I = operand;
+					} else if(inst.NN == 0x1E || inst.NN == 0x29 || inst.NN == 0x30) {
+						I = -1;
+					} else if(I >= 0 && (inst.NN == 0x33 || inst.NN == 0x55 || inst.NN == 0x65 || inst.NN == 0x02)) {
+						const uint32_t len = inst.NN == 0x33 ? 3 : inst.NN == 0x02 ? 16 : inst.X + 1u;
+						analysis_mark(analysis, ANALYSIS_DATA, I, len);
+						if((analysis->quirks & QUIRK_LOAD_STORE_I) && inst.NN != 0x33 && inst.NN != 0x02) I += len;
+					}
+					break;
+				default:
+					break;
+			}
+
+			if(flow.ends_block) {
+				for(uint32_t i = 0; i < flow.num_next; i++) analysis_push(analysis, flow.next[i]);
+				break;
+			}
+
+			// Running into code walked from elsewhere makes it start a block
+			addr += flow.length;
+			if(addr > RAM_SIZE - 2) break;
+			if(analysis->flags[addr] & ANALYSIS_INST) analysis->flags[addr] |= ANALYSIS_LEADER;
+			if(analysis->flags[addr] & ANALYSIS_LEADER) break;
+		}
+	}
+}
+
+// Print s as a JSON string
+static void json_print_string(FILE *file, const char *s) {
+	fputc('"', file);
+	for(; *s; s++) {
+		if(*s == '"' || *s == '\\') fprintf(file, "\\%c", *s);
+		else if((unsigned char)*s < 0x20) fprintf(file, "\\u%04X", *s);
+		else fputc(*s, file);
+	}
+	fputc('"', file);
+}
+
+// Print the address ranges with flag set as [[start, end), ...]
+static void analysis_print_ranges(FILE *file, const analysis_t *analysis, const uint8_t flag) {
+	const char *separator = "";
+	fprintf(file, "[");
+	for(uint32_t addr = 0; addr < RAM_SIZE; addr++) {
+		if(!(analysis->flags[addr] & flag)) continue;
+		const uint32_t start = addr;
+		while(addr < RAM_SIZE && analysis->flags[addr] & flag) addr++;
+		fprintf(file, "%s[%u, %u]", separator, start, addr);
+		separator = ", ";
+	}
+	fprintf(file, "]");
+}
+
+// Write the analysis as a JSON control flow graph: basic blocks with their successors, calls and
+//	jump tables, then code, sprite and data address ranges. Ranges and blocks end exclusive
+bool analysis_save(const analysis_t *analysis, const chip8_t *chip8, const char *path) {
+	FILE *file = fopen(path, "w");
+	if(!file) {
+		SDL_Log("Could not write control flow graph %s\n", path);
+		return false;
+	}
+
+	fprintf(file, "{\"rom\": ");
+	json_print_string(file, chip8->rom_name);
+	fprintf(file, ", \"rom_hash\": \"%016llX\", \"quirks\": %u,\n\"blocks\": [",
+			(unsigned long long)chip8->rom_hash, analysis->quirks);
+
+	// A block runs from its leader until an instruction ends it or the next leader
+	const char *separator = "\n";
+	for(uint32_t start = 0; start < RAM_SIZE; start++) {
+		if((analysis->flags[start] & (ANALYSIS_INST | ANALYSIS_LEADER)) != (ANALYSIS_INST | ANALYSIS_LEADER)) continue;
+
+		uint32_t last = start;
+		flow_t flow = analysis_flow(analysis, chip8->ram, last);
+		while(!flow.ends_block && last + flow.length <= RAM_SIZE - 2 &&
+			  (analysis->flags[last + flow.length] & (ANALYSIS_INST | ANALYSIS_LEADER)) == ANALYSIS_INST) {
+			last += flow.length;
+			flow = analysis_flow(analysis, chip8->ram, last);
+		}
+
+		// Falling through into data or the end of ram leads nowhere
+		uint8_t num_next = flow.num_next;
+		if(!flow.ends_block && (last + flow.length > RAM_SIZE - 2 || !(analysis->flags[flow.next[0]] & ANALYSIS_INST))) num_next = 0;
+
+		fprintf(file, "%s {\"start\": %u, \"end\": %u, \"next\": [", separator, start, last + flow.length);
+		for(uint32_t i = 0; i < num_next; i++) fprintf(file, "%s%u", i ? ", " : "", flow.next[i]);
+		fprintf(file, "]");
+
+		const uint16_t opcode = chip8->ram[last] << 8 | chip8->ram[last + 1];
+		if(opcode >> 12 == 0x2) fprintf(file, ", \"call\": %u", opcode & 0x0FFF);
+		if(opcode >> 12 == 0xB) fprintf(file, ", \"table\": %u", opcode & 0x0FFF);
+		if(opcode == 0x00EE) fprintf(file, ", \"return\": true");
+		fprintf(file, "}");
+		separator = ",\n";
+	}
+
+	fprintf(file, "\n],\n\"subroutines\": [");
+	separator = "";
+	for(uint32_t addr = 0; addr < RAM_SIZE; addr++) {
+		if(!(analysis->flags[addr] & ANALYSIS_CALL)) continue;
+		fprintf(file, "%s%u", separator, addr);
+		separator = ", ";
+	}
+
+	fprintf(file, "],\n\"jump_tables\": [");
+	separator = "";
+	for(uint32_t addr = 0; addr <= RAM_SIZE - 2; addr++) {
+		if((analysis->flags[addr] & ANALYSIS_INST) && chip8->ram[addr] >> 4 == 0xB) {
+			const uint16_t base = (chip8->ram[addr] & 0x0F) << 8 | chip8->ram[addr + 1];
+			fprintf(file, "%s{\"from\": %u, \"base\": %u, \"entries\": [", separator, addr, base);
+			for(uint32_t entry = base; entry < RAM_SIZE && analysis->flags[entry] & ANALYSIS_TABLE; entry += 2) {
+				fprintf(file, "%s%u", entry == base ? "" : ", ", entry);
+			}
+			fprintf(file, "]}");
+			separator = ", ";
+		}
+	}
+
+	fprintf(file, "],\n\"code\": ");
+	analysis_print_ranges(file, analysis, ANALYSIS_CODE);
+	fprintf(file, ",\n\"sprites\": ");
+	analysis_print_ranges(file, analysis, ANALYSIS_SPRITE);
+	fprintf(file, ",\n\"data\": ");
+	analysis_print_ranges(file, analysis, ANALYSIS_DATA);
+	fprintf(file, "}\n");
+
+	if(fclose(file) != 0) {
+		SDL_Log("Could not write control flow graph %s\n", path);
+		return false;
+	}
+	return true;
+}
+
+// Peephole pass over the analysed code: mark where a superinstruction starts. Every instruction
+//	of one must have been found as code, but may still be a jump or skip target of its own
+static void fuse_superinstructions(translation_t *translation, const uint8_t *ram) {
+	for(uint32_t addr = 0; addr + 6 <= RAM_SIZE; addr++) {
+		if(!(translation->flags[addr] & ANALYSIS_INST)) continue;
+
+		const uint16_t first = ram[addr] << 8 | ram[addr + 1];
+		const uint16_t second = ram[addr + 2] << 8 | ram[addr + 3];
+		const uint16_t third = ram[addr + 4] << 8 | ram[addr + 5];
+		const bool second_inst = translation->flags[addr + 2] & ANALYSIS_INST;
+		const bool third_inst = second_inst && (translation->flags[addr + 4] & ANALYSIS_INST);
+
+		if(first >> 12 == 0x7 && third_inst && (second >> 12 == 0x3 || second >> 12 == 0x4) &&
+		   ((first ^ second) & 0x0F00) == 0 && third >> 12 == 0x1)
+			translation->fused[addr] = SUPER_ADD_SKIP_JUMP;
+		else if(first >> 12 == 0xA && second_inst && (second & 0xF0FF) == 0xF01E)
+			translation->fused[addr] = SUPER_LOAD_I_ADD;
+		else if(first >> 12 == 0xA && second_inst && second >> 12 == 0xD)
+			translation->fused[addr] = SUPER_LOAD_I_DRAW;
+		else if(first >> 12 == 0x6 && third_inst && second >> 12 == 0x6 && third >> 12 == 0xD)
+			translation->fused[addr] = SUPER_LOAD_LOAD_DRAW;
+		else if((first & 0xF0FF) == 0xF007 && third_inst && (second >> 12 == 0x3 || second >> 12 == 0x4) &&
+				((first ^ second) & 0x0F00) == 0 && third == (0x1000 | addr))
+			translation->fused[addr] = SUPER_WAIT_DELAY;
+	}
+}
+
+// Analyse chip8's ROM for its current quirks into a new translation
+translation_t *translate_rom(const chip8_t *chip8) {
+	translation_t *translation = calloc(1, sizeof *translation);
+	analysis_t *analysis = malloc(sizeof *analysis);
+	if(!translation || !analysis) {
+		SDL_Log("Could not allocate a translation of %s\n", chip8->rom_name);
+		free(translation);
+		free(analysis);
+		return NULL;
+	}
+
+	analyse_rom(analysis, chip8);
+	memcpy(translation->magic, "C8TC", sizeof translation->magic);
+	translation->version = TRANSLATION_VERSION;
+	translation->rom_hash = chip8->rom_hash;
+	translation->rom_size = chip8->rom_size;
+	translation->quirks = chip8->quirks;
+	translation->mega = analysis->mega;
+	memcpy(translation->flags, analysis->flags, sizeof translation->flags);
+	free(analysis);
+	fuse_superinstructions(translation, chip8->ram);
+	return translation;
+}
+
+// Load a translation's analysis back into an analysis_t, as if analyse_rom() had just run
+void translation_analysis(const translation_t *translation, analysis_t *analysis) {
+	memcpy(analysis->flags, translation->flags, sizeof analysis->flags);
+	analysis->pending = 0;
+	analysis->quirks = translation->quirks;
+	analysis->mega = translation->mega != 0;
+}
+
+// Map the cache entry at path if it is a current translation of chip8's ROM and quirks. NULL when
+//	it is missing, of another format version, for another ROM, truncated or corrupt; it is then rebuilt
+static const translation_t *translation_load(const char *path, const chip8_t *chip8) {
+	size_t size = 0;
+	const translation_t *translation = (const translation_t *)map_file(path, &size);
+	if(!translation) return NULL;
+
+	if(size != sizeof *translation ||
+		memcmp(translation->magic, "C8TC", sizeof translation->magic) != 0 ||
+		translation->version != TRANSLATION_VERSION ||
+		translation->rom_hash != chip8->rom_hash ||
+		translation->rom_size != chip8->rom_size ||
+		translation->quirks != chip8->quirks ||
+		translation->mega > 1) {
+		SDL_Log("Translation cache entry %s is stale, rebuilding it\n", path);
+		unmap_file((const uint8_t *)translation, size);
+		return NULL;
+	}
+	return translation;
+}
+
+// Write a cache entry through a uniquely named temporary file renamed into place, so concurrent
+//	batch jobs sharing a cache only ever map whole entries
+static bool translation_save(const char *path, const translation_t *translation) {
+	char tmp[4096 + 32];
+#ifndef _WIN32
+	snprintf(tmp, sizeof tmp, "%s.XXXXXX", path);
+	const int fd = mkstemp(tmp);
+	const bool created = fd >= 0;
+	FILE *file = created ? fdopen(fd, "wb") : NULL;
+	if(created && !file) close(fd);
+#else
+	snprintf(tmp, sizeof tmp, "%s.%d.tmp", path, _getpid());
+	FILE *file = fopen(tmp, "wb");
+	const bool created = file != NULL;
+#endif
+
+	bool ok = file && fwrite(translation, sizeof *translation, 1, file) == 1;
+	if(file && fclose(file) != 0) ok = false;
+	if(ok && rename(tmp, path) != 0) ok = false;
+	if(!ok) {
+		if(created) remove(tmp);
+		SDL_Log("Could not write translation cache entry %s\n", path);
+	}
+	return ok;
+}
+
+// Give chip8 a translation of its ROM, call once its quirks are final. With a cache_dir it is
+//	mapped from <rom hash>-<quirks>.c8tc there when that is current, otherwise it is built and
+//	saved there for the next run. A cache that can't be written only costs the rebuild
+bool attach_translation(chip8_t *chip8, const char *cache_dir) {
+	char path[4096];
+	if(cache_dir) {
+		snprintf(path, sizeof path, "%s/%016llX-%02X.c8tc", cache_dir, (unsigned long long)chip8->rom_hash, chip8->quirks);
+		const translation_t *translation = translation_load(path, chip8);
+		if(translation) {
+			chip8->translation = translation;
+			chip8->translation_mapped = true;
+			return true;
+		}
+	}
+
+	translation_t *translation = translate_rom(chip8);
+	if(!translation) return false;
+	if(cache_dir) translation_save(path, translation);
+	chip8->translation = translation;
+	chip8->translation_mapped = false;
+	return true;
+}
+
+// Disassembler instruction formats, one per opcode shape. Operands are printed in the
+//	order their disasm_args_t lists them
+typedef enum {
+	DISASM_ARGS_NONE,
+	DISASM_ARGS_N,
+	DISASM_ARGS_NN,
+	DISASM_ARGS_X,
+	DISASM_ARGS_X_NN,
+	DISASM_ARGS_X_Y,
+	DISASM_ARGS_X_Y_N,
+	DISASM_ARGS_ADDR,		// NNN, as a label when the analysis found one
+	DISASM_ARGS_LONG,		// The 16 bit word after F000
+	DISASM_ARGS_MEGA_LONG,	// NN and the 16 bit word after 01NN
+	DISASM_ARGS_OPCODE,		// Not an instruction, the whole word
+} disasm_args_t;
+
+typedef struct {
+	const char *text;		// printf format, or plain text without operands
+	uint8_t args;			// disasm_args_t
+} disasm_format_t;
+
+enum {
+	DISASM_WORD, DISASM_CLS, DISASM_RET, DISASM_SCD, DISASM_SCU, DISASM_SCR, DISASM_SCL, DISASM_EXIT,
+	DISASM_LOW, DISASM_HIGH, DISASM_MEGAOFF, DISASM_MEGAON, DISASM_SCRU, DISASM_LDHI, DISASM_LDPAL,
+	DISASM_SPRW, DISASM_SPRH, DISASM_ALPHA, DISASM_DIGISND, DISASM_STOPSND, DISASM_BMODE, DISASM_CCOL,
+	DISASM_JP, DISASM_CALL, DISASM_SE, DISASM_SNE, DISASM_SE_V, DISASM_SAVE, DISASM_LOAD, DISASM_LD,
+	DISASM_ADD, DISASM_LD_V, DISASM_OR, DISASM_AND, DISASM_XOR, DISASM_ADD_V, DISASM_SUB, DISASM_SHR,
+	DISASM_SUBN, DISASM_SHL, DISASM_SNE_V, DISASM_LD_I, DISASM_JP_V0, DISASM_RND, DISASM_DRW, DISASM_SKP,
+	DISASM_SKNP, DISASM_LD_I_LONG, DISASM_PLANE, DISASM_AUDIO, DISASM_LD_V_DT, DISASM_LD_V_K,
+	DISASM_LD_DT, DISASM_LD_ST, DISASM_ADD_I, DISASM_LD_F, DISASM_LD_HF, DISASM_LD_B, DISASM_PITCH,
+	DISASM_LD_MEM, DISASM_LD_V_MEM, DISASM_LD_R, DISASM_LD_V_R,
+};
+
+static const disasm_format_t disasm_formats[] = {
+	[DISASM_WORD] = {".word 0x%04X", DISASM_ARGS_OPCODE},
+	[DISASM_CLS] = {"CLS", DISASM_ARGS_NONE},
+	[DISASM_RET] = {"RET", DISASM_ARGS_NONE},
+	[DISASM_SCD] = {"SCD %u", DISASM_ARGS_N},
+	[DISASM_SCU] = {"SCU %u", DISASM_ARGS_N},
+	[DISASM_SCR] = {"SCR", DISASM_ARGS_NONE},
+	[DISASM_SCL] = {"SCL", DISASM_ARGS_NONE},
+	[DISASM_EXIT] = {"EXIT", DISASM_ARGS_NONE},
+	[DISASM_LOW] = {"LOW", DISASM_ARGS_NONE},
+	[DISASM_HIGH] = {"HIGH", DISASM_ARGS_NONE},
+	[DISASM_MEGAOFF] = {"MEGAOFF", DISASM_ARGS_NONE},
+	[DISASM_MEGAON] = {"MEGAON", DISASM_ARGS_NONE},
+	[DISASM_SCRU] = {"SCRU %u", DISASM_ARGS_N},
+	[DISASM_LDHI] = {"LDHI I, 0x%06X", DISASM_ARGS_MEGA_LONG},
+	[DISASM_LDPAL] = {"LDPAL %u", DISASM_ARGS_NN},
+	[DISASM_SPRW] = {"SPRW %u", DISASM_ARGS_NN},
+	[DISASM_SPRH] = {"SPRH %u", DISASM_ARGS_NN},
+	[DISASM_ALPHA] = {"ALPHA 0x%02X", DISASM_ARGS_NN},
+	[DISASM_DIGISND] = {"DIGISND %u", DISASM_ARGS_N},
+	[DISASM_STOPSND] = {"STOPSND", DISASM_ARGS_NONE},
+	[DISASM_BMODE] = {"BMODE %u", DISASM_ARGS_N},
+	[DISASM_CCOL] = {"CCOL 0x%02X", DISASM_ARGS_NN},
+	[DISASM_JP] = {"JP %s", DISASM_ARGS_ADDR},
+	[DISASM_CALL] = {"CALL %s", DISASM_ARGS_ADDR},
+	[DISASM_SE] = {"SE V%X, 0x%02X", DISASM_ARGS_X_NN},
+	[DISASM_SNE] = {"SNE V%X, 0x%02X", DISASM_ARGS_X_NN},
+	[DISASM_SE_V] = {"SE V%X, V%X", DISASM_ARGS_X_Y},
+	[DISASM_SAVE] = {"SAVE V%X - V%X", DISASM_ARGS_X_Y},
+	[DISASM_LOAD] = {"LOAD V%X - V%X", DISASM_ARGS_X_Y},
+	[DISASM_LD] = {"LD V%X, 0x%02X", DISASM_ARGS_X_NN},
+	[DISASM_ADD] = {"ADD V%X, 0x%02X", DISASM_ARGS_X_NN},
+	[DISASM_LD_V] = {"LD V%X, V%X", DISASM_ARGS_X_Y},
+	[DISASM_OR] = {"OR V%X, V%X", DISASM_ARGS_X_Y},
+	[DISASM_AND] = {"AND V%X, V%X", DISASM_ARGS_X_Y},
+	[DISASM_XOR] = {"XOR V%X, V%X", DISASM_ARGS_X_Y},
+	[DISASM_ADD_V] = {"ADD V%X, V%X", DISASM_ARGS_X_Y},
+	[DISASM_SUB] = {"SUB V%X, V%X", DISASM_ARGS_X_Y},
+	[DISASM_SHR] = {"SHR V%X, V%X", DISASM_ARGS_X_Y},
+	[DISASM_SUBN] = {"SUBN V%X, V%X", DISASM_ARGS_X_Y},
+	[DISASM_SHL] = {"SHL V%X, V%X", DISASM_ARGS_X_Y},
+	[DISASM_SNE_V] = {"SNE V%X, V%X", DISASM_ARGS_X_Y},
+	[DISASM_LD_I] = {"LD I, %s", DISASM_ARGS_ADDR},
+	[DISASM_JP_V0] = {"JP V0, %s", DISASM_ARGS_ADDR},
+	[DISASM_RND] = {"RND V%X, 0x%02X", DISASM_ARGS_X_NN},
+	[DISASM_DRW] = {"DRW V%X, V%X, %u", DISASM_ARGS_X_Y_N},
+	[DISASM_SKP] = {"SKP V%X", DISASM_ARGS_X},
+	[DISASM_SKNP] = {"SKNP V%X", DISASM_ARGS_X},
+	[DISASM_LD_I_LONG] = {"LD I, long %s", DISASM_ARGS_LONG},
+	[DISASM_PLANE] = {"PLANE %u", DISASM_ARGS_X},
+	[DISASM_AUDIO] = {"AUDIO", DISASM_ARGS_NONE},
+	[DISASM_LD_V_DT] = {"LD V%X, DT", DISASM_ARGS_X},
+	[DISASM_LD_V_K] = {"LD V%X, K", DISASM_ARGS_X},
+	[DISASM_LD_DT] = {"LD DT, V%X", DISASM_ARGS_X},
+	[DISASM_LD_ST] = {"LD ST, V%X", DISASM_ARGS_X},
+	[DISASM_ADD_I] = {"ADD I, V%X", DISASM_ARGS_X},
+	[DISASM_LD_F] = {"LD F, V%X", DISASM_ARGS_X},
+	[DISASM_LD_HF] = {"LD HF, V%X", DISASM_ARGS_X},
+	[DISASM_LD_B] = {"LD B, V%X", DISASM_ARGS_X},
+	[DISASM_PITCH] = {"PITCH V%X", DISASM_ARGS_X},
+	[DISASM_LD_MEM] = {"LD [I], V%X", DISASM_ARGS_X},
+	[DISASM_LD_V_MEM] = {"LD V%X, [I]", DISASM_ARGS_X},
+	[DISASM_LD_R] = {"LD R, V%X", DISASM_ARGS_X},
+	[DISASM_LD_V_R] = {"LD V%X, R", DISASM_ARGS_X},
+};
+
+// Format of every opcode, filled once by disasm_init() so disassembling is a lookup per instruction
+static uint8_t disasm_table[65536];
+
+// Format for one opcode, the same opcodes analysis_flow() and emulate() accept. 01NN-09NN are
+//	only instructions in MegaChip mode, anywhere else they fault as 0NNN
+static uint8_t disasm_classify(const uint16_t opcode) {
+	instruction_t inst = {.opcode = opcode};
+	decode_instruction(&inst);
+
+	switch(opcode >> 12) {
+		case 0x0:
+			if(inst.NNN == 0xE0) return DISASM_CLS;
+			if(inst.NNN == 0xEE) return DISASM_RET;
+			if((inst.NNN & 0xFF0) == 0xC0) return DISASM_SCD;
+			if((inst.NNN & 0xFF0) == 0xD0) return DISASM_SCU;
+			if((inst.NNN & 0xFF0) == 0xB0) return DISASM_SCRU;
+			if(inst.NNN == 0xFB) return DISASM_SCR;
+			if(inst.NNN == 0xFC) return DISASM_SCL;
+			if(inst.NNN == 0xFD) return DISASM_EXIT;
+			if(inst.NNN == 0xFE) return DISASM_LOW;
+			if(inst.NNN == 0xFF) return DISASM_HIGH;
+			if(inst.NNN == 0x10) return DISASM_MEGAOFF;
+			if(inst.NNN == 0x11) return DISASM_MEGAON;
+			switch(inst.X) {
+				case 0x1: return DISASM_LDHI;
+				case 0x2: return DISASM_LDPAL;
+				case 0x3: return DISASM_SPRW;
+				case 0x4: return DISASM_SPRH;
+				case 0x5: return DISASM_ALPHA;
+				case 0x6: return DISASM_DIGISND;
+				case 0x7: return DISASM_STOPSND;
+				case 0x8: return inst.NN < BLEND_MODES ? DISASM_BMODE : DISASM_WORD;
+				case 0x9: return DISASM_CCOL;
+				default: return DISASM_WORD;
+			}
+		case 0x1: return DISASM_JP;
+		case 0x2: return DISASM_CALL;
+		case 0x3: return DISASM_SE;
+		case 0x4: return DISASM_SNE;
+		case 0x5: return inst.N == 0 ? DISASM_SE_V : inst.N == 2 ? DISASM_SAVE : inst.N == 3 ? DISASM_LOAD : DISASM_WORD;
+		case 0x6: return DISASM_LD;
+		case 0x7: return DISASM_ADD;
+		case 0x8: {
+			static const uint8_t alu[16] = {
+				DISASM_LD_V, DISASM_OR, DISASM_AND, DISASM_XOR, DISASM_ADD_V, DISASM_SUB, DISASM_SHR, DISASM_SUBN,
+				DISASM_WORD, DISASM_WORD, DISASM_WORD, DISASM_WORD, DISASM_WORD, DISASM_WORD, DISASM_SHL, DISASM_WORD,
+			};
+			return alu[inst.N];
+		}
+		case 0x9: return inst.N == 0 ? DISASM_SNE_V : DISASM_WORD;
+		case 0xA: return DISASM_LD_I;
+		case 0xB: return DISASM_JP_V0;
+		case 0xC: return DISASM_RND;
+		case 0xD: return DISASM_DRW;
+		case 0xE: return inst.NN == 0x9E ? DISASM_SKP : inst.NN == 0xA1 ? DISASM_SKNP : DISASM_WORD;
+		default:
+			switch(inst.NN) {
+				case 0x00: return inst.X == 0 ? DISASM_LD_I_LONG : DISASM_WORD;
+				case 0x01: return DISASM_PLANE;
+				case 0x02: return inst.X == 0 ? DISASM_AUDIO : DISASM_WORD;
+				case 0x07: return DISASM_LD_V_DT;
+				case 0x0A: return DISASM_LD_V_K;
+				case 0x15: return DISASM_LD_DT;
+				case 0x18: return DISASM_LD_ST;
+				case 0x1E: return DISASM_ADD_I;
+				case 0x29: return DISASM_LD_F;
+				case 0x30: return DISASM_LD_HF;
+				case 0x33: return DISASM_LD_B;
+				case 0x3A: return DISASM_PITCH;
+				case 0x55: return DISASM_LD_MEM;
+				case 0x65: return DISASM_LD_V_MEM;
+				case 0x75: return DISASM_LD_R;
+				case 0x85: return DISASM_LD_V_R;
+				default: return DISASM_WORD;
+			}
+	}
+}
+
+void disasm_init(void) {
+	for(uint32_t opcode = 0; opcode < 65536; opcode++) disasm_table[opcode] = disasm_classify(opcode);
+}
+
+// Per ROM disassembly state, reused across a corpus
+typedef struct {
+	analysis_t analysis;
+	uint8_t labels[RAM_SIZE];	// DISASM_LABEL_* for every address an instruction refers to
+	char buffer[1 << 16];		// Output buffer, most listings are written in one go
+	const coverage_t *coverage;	// Adds a coverage column and fetched addresses as code, NULL = off
+} disasm_t;
+
+#define DISASM_LABEL_SUB 0x1	// 2NNN target
+#define DISASM_LABEL_JUMP 0x2	// 1NNN or BNNN target, or a jump table entry
+#define DISASM_LABEL_DATA 0x4	// ANNN or F000 NNNN target
+
+// Label text for addr, or its hex value when nothing refers to it as code or data
+static const char *disasm_label(const disasm_t *disasm, const uint32_t addr, char buf[16]) {
+	const uint8_t label = addr < RAM_SIZE ? disasm->labels[addr] : 0;
+	const char *prefix = label & DISASM_LABEL_SUB ? "sub" : label & DISASM_LABEL_JUMP ? "L" : label & DISASM_LABEL_DATA ? "data" : NULL;
+	if(prefix) snprintf(buf, 16, "%s_%03X", prefix, addr);
+	else snprintf(buf, 16, "0x%03X", addr);
+	return buf;
+}
+
+static uint32_t disasm_length(const disasm_t *disasm, const uint16_t opcode) {
+	const disasm_format_t *format = &disasm_formats[disasm_table[opcode]];
+	return format->args == DISASM_ARGS_LONG || (format->args == DISASM_ARGS_MEGA_LONG && disasm->analysis.mega) ? 4 : 2;
+}
+
+// Coverage column for a line listing len bytes from addr, when listing with coverage
+static void disasm_coverage(FILE *file, const disasm_t *disasm, const uint32_t addr, const uint32_t len) {
+	if(!disasm->coverage) return;
+	uint32_t flags = 0;
+	for(uint32_t i = 0; i < len; i++) flags |= coverage_flags(disasm->coverage, addr + i);
+	fprintf(file, "%c%c%c  ", flags & 0x1 ? 'x' : '-', flags & 0x2 ? 'r' : '-', flags & 0x4 ? 'w' : '-');
+}
+
+// Print one instruction at addr through the format table, returns its length
+static uint32_t disasm_instruction(FILE *file, const disasm_t *disasm, const uint8_t *ram, const uint32_t addr) {
+	const uint16_t opcode = ram[addr] << 8 | ram[addr + 1];
+	const uint16_t operand = ram[(addr + 2) & (RAM_SIZE - 1)] << 8 | ram[(addr + 3) & (RAM_SIZE - 1)];
+	const disasm_format_t *format = &disasm_formats[disasm_table[opcode]];
+	const uint32_t length = disasm_length(disasm, opcode);
+	char label[16];
+
+	if(length == 4) fprintf(file, "0x%03X  %04X%04X  ", addr, opcode, operand);
+	else fprintf(file, "0x%03X  %04X      ", addr, opcode);
+
+	switch(format->args) {
+		case DISASM_ARGS_NONE: fputs(format->text, file); break;
+		case DISASM_ARGS_N: fprintf(file, format->text, opcode & 0xF); break;
+		case DISASM_ARGS_NN: fprintf(file, format->text, opcode & 0xFF); break;
+		case DISASM_ARGS_X: fprintf(file, format->text, (opcode >> 8) & 0xF); break;
+		case DISASM_ARGS_X_NN: fprintf(file, format->text, (opcode >> 8) & 0xF, opcode & 0xFF); break;
+		case DISASM_ARGS_X_Y: fprintf(file, format->text, (opcode >> 8) & 0xF, (opcode >> 4) & 0xF); break;
+		case DISASM_ARGS_X_Y_N:
+			fprintf(file, format->text, (opcode >> 8) & 0xF, (opcode >> 4) & 0xF, opcode & 0xF);
+			break;
+		case DISASM_ARGS_ADDR: fprintf(file, format->text, disasm_label(disasm, opcode & 0x0FFF, label)); break;
+		case DISASM_ARGS_LONG: fprintf(file, format->text, disasm_label(disasm, operand, label)); break;
+		case DISASM_ARGS_MEGA_LONG: fprintf(file, format->text, (opcode & 0xFF) << 16 | operand); break;
+		default: fprintf(file, format->text, opcode); break;
+	}
+	fputc('\n', file);
+	return length;
+}
+
+// Write an annotated listing of the ROM in chip8's ram. Code found by analyse_rom() is
+//	disassembled with labels for every jump, call and I target, sprite data is drawn as
+//	bitmaps and anything else is left as bytes
+bool disassemble(disasm_t *disasm, const chip8_t *chip8, FILE *file) {
+	const uint8_t *ram = chip8->ram;
+	const uint8_t *flags = disasm->analysis.flags;
+	const uint32_t rom_start = 0x200;
+	const uint32_t rom_end = chip8->rom_size < RAM_SIZE - rom_start ? rom_start + chip8->rom_size : RAM_SIZE;
+	if(chip8->translation) translation_analysis(chip8->translation, &disasm->analysis);
+	else analyse_rom(&disasm->analysis, chip8);
+
+	// Code static analysis missed, e.g. reached through a computed jump, is known once it has run
+	if(disasm->coverage) {
+		for(uint32_t addr = rom_start; addr < rom_end; addr++) {
+			if(coverage_test(disasm->coverage, COVER_START, addr)) disasm->analysis.flags[addr] |= ANALYSIS_INST;
+		}
+	}
+
+	// Labels for everything instructions in the ROM refer to
+	memset(disasm->labels, 0, sizeof disasm->labels);
+	for(uint32_t addr = rom_start; addr < rom_end && addr <= RAM_SIZE - 2; addr++) {
+		if(flags[addr] & ANALYSIS_TABLE) disasm->labels[addr] |= DISASM_LABEL_JUMP;
+		if(!(flags[addr] & ANALYSIS_INST)) continue;
+
+		const uint16_t opcode = ram[addr] << 8 | ram[addr + 1];
+		switch(disasm_table[opcode]) {
+			case DISASM_CALL: disasm->labels[opcode & 0x0FFF] |= DISASM_LABEL_SUB; break;
+			case DISASM_JP: case DISASM_JP_V0: disasm->labels[opcode & 0x0FFF] |= DISASM_LABEL_JUMP; break;
+			case DISASM_LD_I: disasm->labels[opcode & 0x0FFF] |= DISASM_LABEL_DATA; break;
+			case DISASM_LD_I_LONG:
+				disasm->labels[ram[(addr + 2) & (RAM_SIZE - 1)] << 8 | ram[(addr + 3) & (RAM_SIZE - 1)]] |= DISASM_LABEL_DATA;
+				break;
+			default: break;
+		}
+	}
+
+	fprintf(file, "; %s rom_hash 0x%016llX rom_size %u quirks 0x%02X\n",
+			chip8->rom_name, (unsigned long long)chip8->rom_hash, chip8->rom_size, chip8->quirks);
+
+	char label[16];
+	for(uint32_t addr = rom_start; addr < rom_end; ) {
+		if(disasm->labels[addr] || (flags[addr] & ANALYSIS_CALL)) {
+			fprintf(file, "%s:%s\n", disasm_label(disasm, addr, label),
+					flags[addr] & ANALYSIS_TABLE ? "  ; jump table entry" : "");
+		}
+
+		if(flags[addr] & ANALYSIS_INST && addr + 1 < rom_end) {
+			disasm_coverage(file, disasm, addr, disasm_length(disasm, ram[addr] << 8 | ram[addr + 1]));
+			addr += disasm_instruction(file, disasm, ram, addr);
+		} else if(flags[addr] & ANALYSIS_SPRITE) {
+			char bits[9] = {0};
+			for(uint32_t bit = 0; bit < 8; bit++) bits[bit] = ram[addr] & (0x80 >> bit) ? '#' : '.';
+			disasm_coverage(file, disasm, addr, 1);
+			fprintf(file, "0x%03X  %02X        .byte 0x%02X  ; %s\n", addr, ram[addr], ram[addr], bits);
+			addr++;
+		} else {
+			// Unclassified bytes up to 8 a line, until something else starts or coverage changes
+			const uint32_t start = addr;
+			uint32_t end = start + 1;
+			while(end < rom_end && end - start < 8 && !disasm->labels[end] &&
+				  !(flags[end] & (ANALYSIS_INST | ANALYSIS_SPRITE | ANALYSIS_CALL)) &&
+				  (flags[end] & ANALYSIS_DATA) == (flags[start] & ANALYSIS_DATA) &&
+				  (!disasm->coverage || coverage_flags(disasm->coverage, end) == coverage_flags(disasm->coverage, start))) {
+				end++;
+			}
+			disasm_coverage(file, disasm, start, end - start);
+			fprintf(file, "0x%03X            .byte ", start);
+			for(; addr < end; addr++) fprintf(file, "%s0x%02X", addr == start ? "" : ", ", ram[addr]);
+			fprintf(file, "%s\n", flags[start] & ANALYSIS_DATA ? "  ; data" : "");
+		}
+	}
+
+	return !ferror(file);
+}
+
+// Disassemble the running ROM to path, or with a corpus and no ROM every corpus ROM into the
+//	directory path as <name>.asm
+bool disassemble_to(const rom_corpus_t *corpus, const chip8_t *chip8, const config_t config) {
+	disasm_t *disasm = malloc(sizeof *disasm);
+	if(!disasm) {
+		SDL_Log("Could not allocate the disassembler\n");
+		return false;
+	}
+	disasm_init();
+	disasm->coverage = NULL;
+
+	const uint64_t start = SDL_GetPerformanceCounter();
+	const uint32_t num_roms = chip8 ? 1 : corpus->num_roms;
+	uint32_t failed = 0;
+	for(uint32_t i = 0; i < num_roms; i++) {
+		chip8_t rom_chip8 = {0};
+		const chip8_t *rom = chip8;
+		char path[4096];
+		snprintf(path, sizeof path, "%s", config.disasm_path);
+
+		if(!chip8) {
+			const rom_image_t *image = &corpus->roms[i];
+			if(!init_chip8_image(&rom_chip8, image->data, image->size, image->name)) {
+				failed++;
+				continue;
+			}
+			rom_chip8.quirks = config.quirks == QUIRKS_AUTO ? image->quirks : config.quirks;
+			if(config.cache_dir && !attach_translation(&rom_chip8, config.cache_dir)) {
+				free_chip8(&rom_chip8);
+				failed++;
+				continue;
+			}
+			snprintf(path, sizeof path, "%s/%s.asm", config.disasm_path, image->name);
+			rom = &rom_chip8;
+		}
+
+		FILE *file = fopen(path, "w");
+		if(file) setvbuf(file, disasm->buffer, _IOFBF, sizeof disasm->buffer);
+		bool ok = file && disassemble(disasm, rom, file);
+		if(file) ok = fclose(file) == 0 && ok;
+		if(!ok) {
+			SDL_Log("Could not write disassembly %s\n", path);
+			failed++;
+		}
+		free_chip8(&rom_chip8);
+	}
+
+	free(disasm);
+	const double seconds = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+	if(!chip8) SDL_Log("Disassembled %u ROMs in %.2fms\n", num_roms - failed, seconds * 1000);
+	return failed == 0;
+}
+
+// Write coverage as text, one "address flags" line per touched byte (x = part of an executed
+//	instruction, r = read as data, w = written), and optionally the ROM's disassembly with a
+//	coverage column
+bool coverage_save(const chip8_t *chip8, const coverage_t *coverage, const char *path, const char *listing_path) {
+	// Only the part of the ROM in ram is tracked, each byte counts once however it was reached
+	const uint32_t rom_start = 0x200;
+	const uint32_t rom_end = chip8->rom_size < RAM_SIZE - rom_start ? rom_start + chip8->rom_size : RAM_SIZE;
+	uint32_t executed = 0, read = 0, written = 0;
+	for(uint32_t addr = rom_start; addr < rom_end; addr++) {
+		executed += coverage_test(coverage, COVER_EXEC, addr);
+		read += coverage_test(coverage, COVER_READ, addr);
+		written += coverage_test(coverage, COVER_WRITE, addr);
+	}
+	bool ok = true;
+
+	if(path) {
+		FILE *file = fopen(path, "w");
+		ok = file != NULL;
+		if(file) {
+			fprintf(file, "# %s rom_hash 0x%016llX rom_size %u\n",
+					chip8->rom_name, (unsigned long long)chip8->rom_hash, chip8->rom_size);
+			for(uint32_t addr = 0; addr < RAM_SIZE; addr++) {
+				const uint32_t flags = coverage_flags(coverage, addr);
+				if(!flags) continue;
+				fprintf(file, "0x%03X %s%s%s\n", addr, flags & 0x1 ? "x" : "", flags & 0x2 ? "r" : "", flags & 0x4 ? "w" : "");
+			}
+			ok = fclose(file) == 0;
+		}
+		if(!ok) SDL_Log("Could not write coverage file %s\n", path);
+	}
+
+	if(listing_path) {
+		disasm_t *disasm = malloc(sizeof *disasm);
+		FILE *file = disasm ? fopen(listing_path, "w") : NULL;
+		bool listed = file != NULL;
+		if(file) {
+			const uint32_t rom_bytes = rom_end - rom_start;
+			fprintf(file, "; %s: %u of %u ROM bytes executed (%.1f%%), %u read as data, %u written\n",
+					chip8->rom_name, executed, rom_bytes, rom_bytes ? 100.0 * executed / rom_bytes : 0.0, read, written);
+			fprintf(file, "; x = executed, r = read as data, w = written, - = never touched\n");
+
+			// Every fetched address is disassembled as an instruction, found by analysis or not
+			setvbuf(file, disasm->buffer, _IOFBF, sizeof disasm->buffer);
+			disasm_init();
+			disasm->coverage = coverage;
+			listed = disassemble(disasm, chip8, file);
+			listed = fclose(file) == 0 && listed;
+		}
+		free(disasm);
+		if(!listed) SDL_Log("Could not write coverage listing %s\n", listing_path);
+		ok = ok && listed;
+	}
+
+	return ok;
+}
+
+#define HISTORY_INTERVAL_FRAMES 60	// Frames between reverse debugging checkpoints
+#define HISTORY_FULL_EVERY 64		// Checkpoints between full snapshots, the rest are deltas
+
+// Reverse debugging checkpoint, a full snapshot or a delta on the previous checkpoint
+typedef struct {
+	uint64_t inst_count;
+	int32_t full;			// Index into fulls, -1 for a delta
+	size_t offset;			// Delta start in deltas, deltas_len when taken for a full snapshot
+} checkpoint_t;
+
+// Keypad as the machine saw it from inst_count on, input only changes at frame starts
+typedef struct {
+	uint64_t inst_count;
+	bool keypad[16];
+} history_input_t;
+
+// Everything needed to put the machine back to any earlier instruction: periodic
+//	checkpoints and every input change, replayed forward deterministically
+typedef struct history {
+	config_t config;
+	uint64_t interval;		// Instructions between checkpoints
+	uint64_t frame_origin;	// Where recording started, frames start every insts_per_frame from it
+	checkpoint_t *checkpoints;
+	uint32_t num_checkpoints, checkpoints_cap;
+	uint32_t last_full;		// Checkpoint index of the newest full snapshot
+	snapshot_t *fulls;
+	uint32_t num_fulls, fulls_cap;
+	uint8_t *deltas;
+	size_t deltas_len, deltas_cap;
+	history_input_t *inputs;
+	uint32_t num_inputs, inputs_cap;
+	debugger_t scan;		// Watchpoints only, for searching backwards
+	const debugger_t *breaks;	// Breakpoints to search for, NULL = not searching
+	uint64_t found;			// Last hit seen while searching, UINT64_MAX = none
+	uint8_t found_hit;
+	uint16_t found_addr;
+} history_t;
+
+// Save the current state as a checkpoint, a checkpoint at the same instruction is replaced
+//	e.g. after a debugger changed ram or registers. False when out of memory
+bool history_checkpoint(history_t *history, chip8_t *chip8) {
+	bool full = history->num_checkpoints == 0 ||
+				history->num_checkpoints - history->last_full >= HISTORY_FULL_EVERY;
+
+	if(history->num_checkpoints &&
+		history->checkpoints[history->num_checkpoints - 1].inst_count == chip8->inst_count) {
+		const checkpoint_t *last = &history->checkpoints[--history->num_checkpoints];
+		if(last->full >= 0) history->num_fulls = last->full;
+		history->deltas_len = last->offset;
+		full = true;	// Dirty bits since the checkpoint before it are gone
+	}
+
+	if(history->num_checkpoints == history->checkpoints_cap) {
+		const uint32_t cap = history->checkpoints_cap ? history->checkpoints_cap * 2 : 256;
+		checkpoint_t *checkpoints = realloc(history->checkpoints, cap * sizeof *checkpoints);
+		if(!checkpoints) {
+			SDL_Log("Out of memory for reverse debugging checkpoints\n");
+			return false;
+		}
+		history->checkpoints = checkpoints;
+		history->checkpoints_cap = cap;
+	}
+	checkpoint_t *checkpoint = &history->checkpoints[history->num_checkpoints];
+	*checkpoint = (checkpoint_t){.inst_count = chip8->inst_count, .full = -1, .offset = history->deltas_len};
+
+	if(full) {
+		if(history->num_fulls == history->fulls_cap) {
+			const uint32_t cap = history->fulls_cap ? history->fulls_cap * 2 : 16;
+			snapshot_t *fulls = realloc(history->fulls, cap * sizeof *fulls);
+			if(!fulls) {
+				SDL_Log("Out of memory for reverse debugging snapshots\n");
+				return false;
+			}
+			history->fulls = fulls;
+			history->fulls_cap = cap;
+		}
+		save_snapshot(chip8, &history->fulls[history->num_fulls]);
+		clear_dirty(chip8);
+		checkpoint->full = history->num_fulls++;
+		history->last_full = history->num_checkpoints;
+	} else {
+		if(history->deltas_cap - history->deltas_len < SNAPSHOT_DELTA_MAX) {
+			const size_t cap = history->deltas_cap ? history->deltas_cap * 2 : 64 * SNAPSHOT_DELTA_MAX;
+			uint8_t *deltas = realloc(history->deltas, cap);
+			if(!deltas) {
+				SDL_Log("Out of memory for reverse debugging snapshots\n");
+				return false;
+			}
+			history->deltas = deltas;
+			history->deltas_cap = cap;
+		}
+		history->deltas_len += save_snapshot_delta(chip8, history->deltas + history->deltas_len);
+	}
+
+	history->num_checkpoints++;
+	return true;
+}
+
+void history_free(history_t *history) {
+	free(history->checkpoints);
+	free(history->fulls);
+	free(history->deltas);
+	free(history->inputs);
+}
+
+bool history_init(history_t *history, chip8_t *chip8, const config_t config) {
+	*history = (history_t){
+		.config = config,
+		.interval = (uint64_t)HISTORY_INTERVAL_FRAMES * (config.insts_per_second / 60),
+		.frame_origin = chip8->inst_count,
+		.scan.quiet = true,
+	};
+
+	if(history->interval == 0) {
+		SDL_Log("Reverse debugging needs at least 60 instructions per second\n");
+		return false;
+	}
+
+	if(!history_checkpoint(history, chip8)) {
+		history_free(history);
+		return false;
+	}
+	return true;
+}
+
+// Called at every frame start once input is applied: keeps input changes and checkpoints.
+//	False when out of memory
+bool history_record(history_t *history, chip8_t *chip8) {
+	history_input_t *last = history->num_inputs ? &history->inputs[history->num_inputs - 1] : NULL;
+	if(!last || memcmp(last->keypad, chip8->keypad, sizeof last->keypad) != 0) {
+		if(!last || last->inst_count != chip8->inst_count) {
+			if(history->num_inputs == history->inputs_cap) {
+				const uint32_t cap = history->inputs_cap ? history->inputs_cap * 2 : 256;
+				history_input_t *inputs = realloc(history->inputs, cap * sizeof *inputs);
+				if(!inputs) {
+					SDL_Log("Out of memory for reverse debugging input\n");
+					return false;
+				}
+				history->inputs = inputs;
+				history->inputs_cap = cap;
+			}
+			last = &history->inputs[history->num_inputs++];
+		}
+		last->inst_count = chip8->inst_count;
+		memcpy(last->keypad, chip8->keypad, sizeof last->keypad);
+	}
+
+	if(chip8->inst_count - history->checkpoints[history->num_checkpoints - 1].inst_count >= history->interval) {
+		return history_checkpoint(history, chip8);
+	}
+	return true;
+}
+
+// Load checkpoint index from its full snapshot plus the deltas after it
+void history_restore(const history_t *history, chip8_t *chip8, const uint32_t index) {
+	uint32_t base = index;
+	while(history->checkpoints[base].full < 0) base--;
+
+	load_snapshot(chip8, &history->fulls[history->checkpoints[base].full]);
+	for(uint32_t i = base + 1; i <= index; i++) {
+		load_snapshot_delta(chip8, history->deltas + history->checkpoints[i].offset);
+	}
+	clear_dirty(chip8);		// The next checkpoint is a delta on this one
+}
+
+// Index of the last checkpoint at or before inst_count
+uint32_t history_find(const history_t *history, const uint64_t inst_count) {
+	uint32_t low = 0, high = history->num_checkpoints;
+	while(high - low > 1) {
+		const uint32_t mid = (low + high) / 2;
+		if(history->checkpoints[mid].inst_count <= inst_count) low = mid;
+		else high = mid;
+	}
+	return low;
+}
+
+// Emulate up to target instructions with the recorded input, timers ticking at frame
+//	ends as in the main loop. Hooks are detached, while searching breakpoints and
+//	watchpoint hits are noted in found instead of pausing
+void history_replay(history_t *history, chip8_t *chip8, const uint64_t target) {
+	const uint32_t insts_per_frame = history->config.insts_per_second / 60;
+	uint8_t *edge_map = chip8->edge_map;
+	struct tracer *tracer = chip8->tracer;
+	struct profiler *profiler = chip8->profiler;
+	struct debugger *debugger = chip8->debugger;
+	coverage_t *coverage = chip8->coverage;
+	const emulator_state_t state = chip8->state;
+
+	chip8->edge_map = NULL;
+	chip8->tracer = NULL;
+	chip8->profiler = NULL;
+	chip8->coverage = NULL;
+	chip8->debugger = history->breaks ? &history->scan : NULL;
+	update_instrumentation(chip8);
+	chip8->state = RUNNING;
+
+	// Keypad from the last input change at or before the start
+	uint32_t next_input = 0;
+	while(next_input < history->num_inputs && history->inputs[next_input].inst_count <= chip8->inst_count) next_input++;
+	if(next_input) memcpy(chip8->keypad, history->inputs[next_input - 1].keypad, sizeof chip8->keypad);
+
+	while(chip8->inst_count < target) {
+		if(next_input < history->num_inputs && history->inputs[next_input].inst_count <= chip8->inst_count) {
+			memcpy(chip8->keypad, history->inputs[next_input++].keypad, sizeof chip8->keypad);
+		}
+
+		if(history->breaks && history->breaks->flags[chip8->PC & (RAM_SIZE - 1)] & DEBUG_BREAK) {
+			history->found = chip8->inst_count;
+			history->found_hit = DEBUG_BREAK;
+			history->found_addr = chip8->PC;
+		}
+
+		emulate_instruction(chip8);
+
+		// A watch hit pauses after the access, stop before the instruction that made it
+		if(chip8->state == PAUSED) {
+			history->found = chip8->inst_count - 1;
+			history->found_hit = history->scan.hit;
+			history->found_addr = history->scan.hit_addr;
+			chip8->state = RUNNING;
+		}
+
+		if((chip8->inst_count - history->frame_origin) % insts_per_frame == 0) {
+			if(chip8->delay_timer > 0) chip8->delay_timer--;
+			if(chip8->sound_timer > 0) chip8->sound_timer--;
+		}
+	}
+
+	chip8->edge_map = edge_map;
+	chip8->tracer = tracer;
+	chip8->profiler = profiler;
+	chip8->debugger = debugger;
+	chip8->coverage = coverage;
+	update_instrumentation(chip8);
+	chip8->state = state;
+
+	// The calls being made may differ from the ones before the restore
+	if(profiler) profiler_sync(profiler, chip8);
+}
+
+// Put the machine back to where it was after target instructions. History after
+//	target is dropped, running on from there records new history
+void history_seek(history_t *history, chip8_t *chip8, const uint64_t target) {
+	const uint32_t index = history_find(history, target);
+	history_restore(history, chip8, index);
+	history_replay(history, chip8, target);
+
+	if(index + 1 < history->num_checkpoints) history->deltas_len = history->checkpoints[index + 1].offset;
+	history->num_checkpoints = index + 1;
+
+	uint32_t base = index;
+	while(history->checkpoints[base].full < 0) base--;
+	history->last_full = base;
+	history->num_fulls = history->checkpoints[base].full + 1;
+
+	while(history->num_inputs && history->inputs[history->num_inputs - 1].inst_count > target) history->num_inputs--;
+}
+
+// Step back 1 instruction, false at the start of history
+bool history_step_back(history_t *history, chip8_t *chip8) {
+	if(chip8->inst_count <= history->checkpoints[0].inst_count) return false;
+	history_seek(history, chip8, chip8->inst_count - 1);
+	return true;
+}
+
+// Run backwards to the last breakpoint or watched access before now, one checkpoint
+//	interval at a time. Stops at the start of history and returns false if there is none
+bool history_reverse_continue(history_t *history, chip8_t *chip8, debugger_t *debugger) {
+	const uint64_t now = chip8->inst_count;
+
+	for(uint32_t i = 0; i < RAM_SIZE; i++) history->scan.flags[i] = debugger->flags[i] & ~DEBUG_BREAK;
+	history->breaks = debugger;
+
+	for(int64_t i = history_find(history, now); i >= 0; i--) {
+		const uint64_t start = history->checkpoints[i].inst_count;
+		const uint64_t end = (uint32_t)i + 1 < history->num_checkpoints &&
+							 history->checkpoints[i + 1].inst_count < now ? history->checkpoints[i + 1].inst_count : now;
+		if(start >= now) continue;
+
+		history->found = UINT64_MAX;
+		history_restore(history, chip8, i);
+		history_replay(history, chip8, end);
+
+		if(history->found != UINT64_MAX) {
+			history->breaks = NULL;
+			history_seek(history, chip8, history->found);
+			debugger->hit = history->found_hit;
+			debugger->hit_addr = history->found_addr;
+			return true;
+		}
+	}
+
+	history->breaks = NULL;
+	history_seek(history, chip8, history->checkpoints[0].inst_count);
+	debugger->hit = 0;
+	return false;
+}
+
+#ifndef _WIN32
+// Listen on a TCP port on localhost, or on a Unix socket for anything that is not a number.
+//	Returns the non-blocking listening socket or -1, unix_path is set for a Unix socket
+int listen_socket(const char *address, const char *what, const char **unix_path) {
+	char *end;
+	const unsigned long port = strtoul(address, &end, 10);
+	const bool tcp = end != address && *end == '\0';
+	struct sockaddr_in tcp_addr = {0};
+	struct sockaddr_un unix_addr = {.sun_family = AF_UNIX};
+
+	if(tcp) {
+		if(port == 0 || port > 65535) {
+			SDL_Log("Invalid %s port %s\n", what, address);
+			return -1;
+		}
+		tcp_addr = (struct sockaddr_in){
+			.sin_family = AF_INET,
+			.sin_port = htons(port),
+			.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+		};
+
+	} else {
+		if(strlen(address) >= sizeof unix_addr.sun_path) {
+			SDL_Log("%s socket path %s is too long\n", what, address);
+			return -1;
+		}
+		strcpy(unix_addr.sun_path, address);
+
+		// Remove a socket left behind by an earlier run, never any other kind of file
+		struct stat st;
+		if(stat(address, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(address);
+	}
+
+	const int fd = socket(tcp ? AF_INET : AF_UNIX, SOCK_STREAM, 0);
+	const int reuse = 1;
+	if(fd >= 0 && tcp) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse);
+
+	if(fd < 0 ||
+		(tcp ? bind(fd, (const struct sockaddr *)&tcp_addr, sizeof tcp_addr)
+			 : bind(fd, (const struct sockaddr *)&unix_addr, sizeof unix_addr)) < 0 ||
+		listen(fd, 4) < 0 || fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+		SDL_Log("Could not listen for %s on %s: %s\n", what, address, strerror(errno));
+		if(fd >= 0) close(fd);
+		return -1;
+	}
+
+	// A peer hanging up part way through a write must not kill the emulator
+	signal(SIGPIPE, SIG_IGN);
+
+	if(!tcp) *unix_path = address;
+	return fd;
+}
+#endif
+
+#define GDB_PACKET_SIZE 4096
+#define GDB_NUM_REGS 21		// V0-VF, I, PC, SP, DT, ST
+
+// GDB remote serial protocol server, polled from the main loop. The machine only runs
+//	the instrumented interpreter while a client is connected
+typedef struct {
+	int listen_fd;
+	int client_fd;				// -1 while no GDB is connected
+	const char *unix_path;		// Socket file to remove on close, NULL for TCP
+	debugger_t *debugger;		// Shared with --break/--watch when those are given
+	bool owns_debugger;
+	history_t *history;			// Reverse execution, NULL = off
+	char in[GDB_PACKET_SIZE];	// Received bytes not handled yet
+	size_t in_len;
+	bool no_ack;				// QStartNoAckMode, TCP already checks the data
+	bool running;				// GDB is waiting for a stop reply
+	bool interrupted;			// Stopped by Ctrl-C rather than a hit
+	bool history_begin;			// Reversed into the start of history
+	char target_xml[2048];		// Register layout for qXfer:features:read
+} gdb_t;
+
+// Turn reverse execution off after history ran out of memory, GDB gets errors for it from then on
+void gdb_drop_history(gdb_t *gdb) {
+	SDL_Log("Reverse debugging turned off\n");
+	history_free(gdb->history);
+	gdb->history = NULL;
+	gdb->history_begin = false;
+}
+
+#ifndef _WIN32
+// Write all of data to the client, a failed write is noticed by the next read
+void gdb_write(const gdb_t *gdb, const char *data, const size_t len) {
+	if(write(gdb->client_fd, data, len) != (ssize_t)len) SDL_Log("GDB write failed: %s\n", strerror(errno));
+}
+
+// Send $data#checksum
+void gdb_send(const gdb_t *gdb, const char *data) {
+	char frame[GDB_PACKET_SIZE + 4];
+	uint8_t checksum = 0;
+	for(const char *c = data; *c; c++) checksum += *c;
+
+	const int len = snprintf(frame, sizeof frame, "$%s#%02x", data, checksum);
+	gdb_write(gdb, frame, len);
+}
+
+// Register sizes in bytes, wider registers are sent big endian like CHIP8 ram.
+//	I is 32 bit to hold the 24 bit MegaChip addresses
+static inline uint32_t gdb_register_size(const uint32_t reg) {
+	return reg == 16 ? 4 : reg == 17 ? 2 : 1;
+}
+
+uint32_t gdb_get_register(const chip8_t *chip8, const uint32_t reg) {
+	if(reg < 16) return chip8->V[reg];
+
+	switch(reg) {
+		case 16: return chip8->I;
+		case 17: return chip8->PC;
+		case 18: return chip8->stack_pointer - chip8->stack;
+		case 19: return chip8->delay_timer;
+		default: return chip8->sound_timer;
+	}
+}
+
+void gdb_set_register(chip8_t *chip8, const uint32_t reg, const uint32_t value) {
+	const uint32_t max_depth = sizeof chip8->stack / sizeof chip8->stack[0];
+
+	if(reg < 16) {
+		chip8->V[reg] = value;
+		return;
+	}
+
+	switch(reg) {
+		case 16: chip8->I = value & address_mask(chip8); break;
+		case 17: chip8->PC = value & (RAM_SIZE - 1); break;
+		case 18: chip8->stack_pointer = chip8->stack + (value < max_depth ? value : max_depth); break;
+		case 19: chip8->delay_timer = value; break;
+		default: chip8->sound_timer = value; break;
+	}
+}
+
+// Append reg as hex to out, returns the hex digits written
+int gdb_format_register(const chip8_t *chip8, const uint32_t reg, char *out) {
+	return sprintf(out, "%0*x", (int)gdb_register_size(reg) * 2, (unsigned)gdb_get_register(chip8, reg));
+}
+
+// Parse a register value of the right size from hex, returns the digits used or 0
+uint32_t gdb_parse_register(chip8_t *chip8, const uint32_t reg, const char *hex) {
+	const uint32_t digits = gdb_register_size(reg) * 2;
+	char value[9] = {0};
+
+	if(strlen(hex) < digits) return 0;
+	memcpy(value, hex, digits);
+	gdb_set_register(chip8, reg, (uint32_t)strtoul(value, NULL, 16));
+	return digits;
+}
+
+// Tell GDB why the machine stopped
+void gdb_stop_reply(gdb_t *gdb) {
+	char reply[32];
+
+	if(gdb->interrupted) {
+		strcpy(reply, "S02");
+	} else if(gdb->history_begin) {
+		strcpy(reply, "T05replaylog:begin;");
+	} else if(gdb->debugger->hit == DEBUG_BREAK) {
+		strcpy(reply, "T05swbreak:;");
+	} else if(gdb->debugger->hit == DEBUG_WATCH_WRITE) {
+		snprintf(reply, sizeof reply, "T05watch:%x;", gdb->debugger->hit_addr);
+	} else if(gdb->debugger->hit == DEBUG_WATCH_READ) {
+		snprintf(reply, sizeof reply, "T05rwatch:%x;", gdb->debugger->hit_addr);
+	} else {
+		strcpy(reply, "S05");
+	}
+
+	gdb_send(gdb, reply);
+}
+
+// Z/z packets: type,addr,kind. Breakpoints ignore kind, watchpoints use it as the length
+bool gdb_set_point(gdb_t *gdb, const char *packet, const bool insert) {
+	char *end;
+	const unsigned long type = strtoul(packet + 1, &end, 16);
+	if(*end != ',') return false;
+	const unsigned long addr = strtoul(end + 1, &end, 16);
+	if(*end != ',') return false;
+	unsigned long len = strtoul(end + 1, &end, 16);
+
+	uint8_t flags;
+	switch(type) {
+		case 0:
+		case 1: flags = DEBUG_BREAK; len = 1; break;
+		case 2: flags = DEBUG_WATCH_WRITE; break;
+		case 3: flags = DEBUG_WATCH_READ; break;
+		case 4: flags = DEBUG_WATCH_READ | DEBUG_WATCH_WRITE; break;
+		default: return false;
+	}
+
+	for(unsigned long i = 0; i < len && addr + i < RAM_SIZE; i++) {
+		if(insert) gdb->debugger->flags[addr + i] |= flags;
+		else gdb->debugger->flags[addr + i] &= ~flags;
+	}
+
+	return true;
+}
+
+// Start the machine again, GDB gets a stop reply when it pauses
+void gdb_resume(gdb_t *gdb, chip8_t *chip8, const bool step) {
+	gdb->debugger->resume = true;
+	gdb->debugger->step = step;
+	gdb->debugger->hit = 0;
+	gdb->interrupted = false;
+	gdb->history_begin = false;
+	gdb->running = true;
+	chip8->state = RUNNING;
+}
+
+void gdb_disconnect(gdb_t *gdb, chip8_t *chip8) {
+	close(gdb->client_fd);
+	gdb->client_fd = -1;
+	gdb->in_len = 0;
+	gdb->no_ack = false;
+	gdb->running = false;
+
+	// Back to the plain interpreter unless --break/--watch still need the debugger
+	gdb->debugger->quiet = false;
+	gdb->debugger->step = false;
+	chip8->debugger = gdb->owns_debugger ? NULL : gdb->debugger;
+	update_instrumentation(chip8);
+	if(chip8->state == PAUSED) chip8->state = RUNNING;
+
+	SDL_Log("GDB disconnected\n");
+}
+
+// Handle 1 packet, reply to it unless it resumes the machine
+void gdb_handle_packet(gdb_t *gdb, chip8_t *chip8, char *packet) {
+	char reply[GDB_PACKET_SIZE] = "";
+	char *end;
+
+	switch(packet[0]) {
+		case '?':
+			gdb_stop_reply(gdb);
+			return;
+
+		case 'g': {
+			int len = 0;
+			for(uint32_t reg = 0; reg < GDB_NUM_REGS; reg++) len += gdb_format_register(chip8, reg, reply + len);
+			break;
+		}
+
+		case 'G': {
+			const char *hex = packet + 1;
+			for(uint32_t reg = 0; reg < GDB_NUM_REGS; reg++) {
+				const uint32_t used = gdb_parse_register(chip8, reg, hex);
+				if(!used) break;
+				hex += used;
+			}
+			if(gdb->history && !history_checkpoint(gdb->history, chip8)) gdb_drop_history(gdb);
+			strcpy(reply, "OK");
+			break;
+		}
+
+		case 'p': {
+			const unsigned long reg = strtoul(packet + 1, NULL, 16);
+			if(reg < GDB_NUM_REGS) gdb_format_register(chip8, reg, reply);
+			else strcpy(reply, "E01");
+			break;
+		}
+
+		case 'P': {
+			const unsigned long reg = strtoul(packet + 1, &end, 16);
+			if(*end == '=' && reg < GDB_NUM_REGS && gdb_parse_register(chip8, reg, end + 1)) {
+				if(gdb->history && !history_checkpoint(gdb->history, chip8)) gdb_drop_history(gdb);
+				strcpy(reply, "OK");
+			} else {
+				strcpy(reply, "E01");
+			}
+			break;
+		}
+
+		case 'm': {
+			// maddr,len: read ram as hex
+			const unsigned long addr = strtoul(packet + 1, &end, 16);
+			const unsigned long len = *end == ',' ? strtoul(end + 1, NULL, 16) : 0;
+			if(addr >= RAM_SIZE || len > RAM_SIZE - addr || len * 2 >= sizeof reply) {
+				strcpy(reply, "E01");
+				break;
+			}
+			for(unsigned long i = 0; i < len; i++) sprintf(reply + i * 2, "%02x", chip8->ram[addr + i]);
+			break;
+		}
+
+		case 'M': {
+			// Maddr,len:hex: write ram
+			const unsigned long addr = strtoul(packet + 1, &end, 16);
+			const unsigned long len = *end == ',' ? strtoul(end + 1, &end, 16) : 0;
+			if(*end != ':' || addr >= RAM_SIZE || len > RAM_SIZE - addr || strlen(end + 1) < len * 2) {
+				strcpy(reply, "E01");
+				break;
+			}
+			for(unsigned long i = 0; i < len; i++) {
+				const char byte[3] = {end[1 + i * 2], end[2 + i * 2], '\0'};
+				chip8->ram[addr + i] = (uint8_t)strtoul(byte, NULL, 16);
+			}
+			mark_ram_dirty(chip8, addr, len);
+			if(gdb->history && !history_checkpoint(gdb->history, chip8)) gdb_drop_history(gdb);
+			strcpy(reply, "OK");
+			break;
+		}
+
+		case 'c':
+		case 's':
+			// Optional address to resume at
+			if(packet[1]) chip8->PC = strtoul(packet + 1, NULL, 16) & (RAM_SIZE - 1);
+			gdb_resume(gdb, chip8, packet[0] == 's');
+			return;
+
+		case 'b':
+			// bs/bc: reverse step and continue, replayed from checkpoints
+			if(!gdb->history || (packet[1] != 's' && packet[1] != 'c')) {
+				strcpy(reply, "E01");
+				break;
+			}
+			gdb->debugger->hit = 0;
+			gdb->interrupted = false;
+			if(packet[1] == 's') gdb->history_begin = !history_step_back(gdb->history, chip8);
+			else gdb->history_begin = !history_reverse_continue(gdb->history, chip8, gdb->debugger);
+			gdb->debugger->resume = false;
+			gdb_stop_reply(gdb);
+			return;
+
+		case 'Z':
+		case 'z':
+			if(gdb_set_point(gdb, packet, packet[0] == 'Z')) strcpy(reply, "OK");
+			break;	// Unsupported types get an empty reply
+
+		case 'k':
+			chip8->state = QUIT;
+			return;
+
+		case 'D':
+			gdb_send(gdb, "OK");
+			gdb_disconnect(gdb, chip8);
+			return;
+
+		case 'H':
+			strcpy(reply, "OK");	// Only 1 thread
+			break;
+
+		case 'q':
+			if(strncmp(packet, "qSupported", 10) == 0) {
+				snprintf(reply, sizeof reply, "PacketSize=%x;qXfer:features:read+;QStartNoAckMode+;swbreak+%s",
+						 GDB_PACKET_SIZE - 4, gdb->history ? ";ReverseStep+;ReverseContinue+" : "");
+			} else if(strcmp(packet, "qAttached") == 0) {
+				strcpy(reply, "1");
+			} else if(strncmp(packet, "qXfer:features:read:target.xml:", 31) == 0) {
+				// Send the register layout in chunks, 'l' marks the last one
+				const unsigned long offset = strtoul(packet + 31, &end, 16);
+				const unsigned long len = *end == ',' ? strtoul(end + 1, NULL, 16) : 0;
+				const size_t xml_len = strlen(gdb->target_xml);
+				const size_t start = offset < xml_len ? offset : xml_len;
+				size_t chunk = xml_len - start;
+				if(chunk > len) chunk = len;
+				if(chunk > sizeof reply - 2) chunk = sizeof reply - 2;
+
+				reply[0] = start + chunk < xml_len ? 'm' : 'l';
+				memcpy(reply + 1, gdb->target_xml + start, chunk);
+				reply[1 + chunk] = '\0';
+			}
+			break;
+
+		case 'Q':
+			if(strcmp(packet, "QStartNoAckMode") == 0) {
+				gdb_send(gdb, "OK");
+				gdb->no_ack = true;
+				return;
+			}
+			break;
+
+		default:
+			break;	// Empty reply, not supported
+	}
+
+	gdb_send(gdb, reply);
+}
+
+bool gdb_init(gdb_t *gdb, const char *address, debugger_t *debugger) {
+	*gdb = (gdb_t){.listen_fd = -1, .client_fd = -1, .debugger = debugger};
+
+	gdb->listen_fd = listen_socket(address, "GDB", &gdb->unix_path);
+	if(gdb->listen_fd < 0) return false;
+
+	// Breakpoints need a debugger even when none was given on the command line
+	if(!gdb->debugger) {
+		gdb->debugger = calloc(1, sizeof *gdb->debugger);
+		if(!gdb->debugger) {
+			SDL_Log("Could not allocate debugger\n");
+			close(gdb->listen_fd);
+			if(gdb->unix_path) unlink(gdb->unix_path);
+			return false;
+		}
+		gdb->owns_debugger = true;
+	}
+
+	// Register layout, numbered in the order of the 'g' packet
+	int len = snprintf(gdb->target_xml, sizeof gdb->target_xml,
+					   "<?xml version=\"1.0\"?><!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+					   "<target><feature name=\"org.chip8.core\">");
+	for(uint8_t i = 0; i < 16; i++) {
+		len += snprintf(gdb->target_xml + len, sizeof gdb->target_xml - len,
+						"<reg name=\"v%x\" bitsize=\"8\" type=\"uint8\"/>", i);
+	}
+	snprintf(gdb->target_xml + len, sizeof gdb->target_xml - len,
+			 "<reg name=\"i\" bitsize=\"32\" type=\"uint32\"/>"
+			 "<reg name=\"pc\" bitsize=\"16\" type=\"code_ptr\"/>"
+			 "<reg name=\"sp\" bitsize=\"8\" type=\"uint8\"/>"
+			 "<reg name=\"dt\" bitsize=\"8\" type=\"uint8\"/>"
+			 "<reg name=\"st\" bitsize=\"8\" type=\"uint8\"/>"
+			 "</feature></target>");
+
+	SDL_Log("Listening for GDB on %s\n", address);
+	return true;
+}
+
+// Accept a client, report stops and handle whatever packets have arrived. Sleeps briefly
+//	while paused so the paused main loop doesn't spin
+void gdb_poll(gdb_t *gdb, chip8_t *chip8) {
+	if(gdb->client_fd < 0) {
+		gdb->client_fd = accept(gdb->listen_fd, NULL, NULL);
+		if(gdb->client_fd < 0) return;
+		fcntl(gdb->client_fd, F_SETFL, O_NONBLOCK);
+
+		// Stop the machine and switch to the instrumented interpreter for the session
+		gdb->debugger->quiet = true;
+		gdb->debugger->hit = 0;
+		chip8->debugger = gdb->debugger;
+		update_instrumentation(chip8);
+		chip8->state = PAUSED;
+		SDL_Log("GDB connected\n");
+	}
+
+	// Report a pause GDB is waiting for, from a hit, a single step or the space bar
+	if(gdb->running && chip8->state != RUNNING) {
+		gdb->running = false;
+		gdb_stop_reply(gdb);
+	}
+
+	struct pollfd pfd = {.fd = gdb->client_fd, .events = POLLIN};
+	if(poll(&pfd, 1, chip8->state == PAUSED ? 10 : 0) <= 0) return;
+
+	const ssize_t got = read(gdb->client_fd, gdb->in + gdb->in_len, sizeof gdb->in - gdb->in_len - 1);
+	if(got <= 0) {
+		gdb_disconnect(gdb, chip8);
+		return;
+	}
+	gdb->in_len += got;
+
+	// Handle every complete $packet#xx, checksums are not checked as TCP already does
+	size_t pos = 0;
+	while(pos < gdb->in_len) {
+		if(gdb->in[pos] == 0x03) {
+			// Ctrl-C
+			if(chip8->state == RUNNING) {
+				chip8->state = PAUSED;
+				gdb->interrupted = true;
+			}
+			pos++;
+			continue;
+		}
+
+		if(gdb->in[pos] != '$') {
+			pos++;	// Acks
+			continue;
+		}
+
+		char *hash = memchr(gdb->in + pos, '#', gdb->in_len - pos);
+		if(!hash || hash + 2 >= gdb->in + gdb->in_len) break;	// Rest of the packet not here yet
+
+		*hash = '\0';
+		if(!gdb->no_ack) gdb_write(gdb, "+", 1);
+		gdb_handle_packet(gdb, chip8, gdb->in + pos + 1);
+		if(gdb->client_fd < 0) return;	// Detached
+		pos = hash + 3 - gdb->in;
+	}
+
+	// Keep a partial packet, drop one too big to ever complete
+	memmove(gdb->in, gdb->in + pos, gdb->in_len - pos);
+	gdb->in_len -= pos;
+	if(gdb->in_len == sizeof gdb->in - 1) gdb->in_len = 0;
+}
+
+void gdb_close(gdb_t *gdb) {
+	if(gdb->client_fd >= 0) close(gdb->client_fd);
+	close(gdb->listen_fd);
+	if(gdb->unix_path) unlink(gdb->unix_path);
+	if(gdb->owns_debugger) free(gdb->debugger);
+}
+#else
+bool gdb_init(gdb_t *gdb, const char *address, debugger_t *debugger) {
+	(void)gdb; (void)address; (void)debugger;
+	SDL_Log("GDB remote debugging needs POSIX sockets\n");
+	return false;
+}
+
+void gdb_poll(gdb_t *gdb, chip8_t *chip8) { (void)gdb; (void)chip8; }
+void gdb_close(gdb_t *gdb) { (void)gdb; }
+#endif
+
+#define METRICS_RENDER_BUCKETS 8
+
+// Upper bounds of the render time histogram buckets in seconds
+static const double metrics_render_bounds[METRICS_RENDER_BUCKETS] = {
+	0.00025, 0.0005, 0.001, 0.002, 0.004, 0.008, 0.016, 0.033,
+};
+
+// Counters the main loop publishes for the metrics thread
+typedef struct {
+	uint64_t instructions;
+	uint64_t frames;
+	uint64_t missed;
+	uint64_t render_buckets[METRICS_RENDER_BUCKETS];	// Renders at or under each bound
+	uint64_t render_count;
+	double render_seconds;	// Sum of all render times
+	emulator_state_t state;
+} metrics_values_t;
+
+// Prometheus text format endpoint served from its own thread. The main loop never waits
+//	on it: values are written under a sequence count and the server retries torn reads.
+//	Each value is stored and loaded as a relaxed atomic, so a torn read is retried, not a race
+#define METRICS_STORE(field, value) do { \
+		const __typeof__(field) metrics_value_ = (value); \
+		__atomic_store(&(field), &metrics_value_, __ATOMIC_RELAXED); \
+	} while(0)
+#define METRICS_LOAD(to, field) __atomic_load(&(field), &(to), __ATOMIC_RELAXED)
+
+typedef struct {
+	SDL_atomic_t sequence;		// Odd while the main loop is writing values
+	metrics_values_t values;	// Only written by the main loop
+	audio_stats_t *audio_stats;
+	SDL_atomic_t stop;
+	SDL_Thread *server;
+	int listen_fd;
+	const char *unix_path;		// Socket file to remove on close, NULL for TCP
+} metrics_t;
+
+static inline void metrics_write_begin(metrics_t *metrics) {
+	SDL_AtomicAdd(&metrics->sequence, 1);
+}
+
+static inline void metrics_write_end(metrics_t *metrics) {
+	SDL_MemoryBarrierRelease();
+	SDL_AtomicAdd(&metrics->sequence, 1);
+}
+
+// Publish the main loop's counters and state, called every pass of the main loop
+void metrics_publish(metrics_t *metrics, const chip8_t *chip8, const frame_stats_t *stats) {
+	metrics_write_begin(metrics);
+	METRICS_STORE(metrics->values.instructions, chip8->inst_count);
+	METRICS_STORE(metrics->values.frames, stats->frames);
+	METRICS_STORE(metrics->values.missed, stats->missed);
+	METRICS_STORE(metrics->values.state, chip8->state);
+	metrics_write_end(metrics);
+}
+
+void metrics_record_render(metrics_t *metrics, const uint64_t ticks) {
+	const double seconds = (double)ticks / SDL_GetPerformanceFrequency();
+
+	metrics_write_begin(metrics);
+	for(uint32_t i = 0; i < METRICS_RENDER_BUCKETS; i++) {
+		uint64_t *bucket = &metrics->values.render_buckets[i];
+		if(seconds <= metrics_render_bounds[i]) METRICS_STORE(*bucket, *bucket + 1);
+	}
+	METRICS_STORE(metrics->values.render_count, metrics->values.render_count + 1);
+	METRICS_STORE(metrics->values.render_seconds, metrics->values.render_seconds + seconds);
+	metrics_write_end(metrics);
+}
+
+// Copy out a consistent set of values, retrying while the main loop is part way through a write
+void metrics_read(metrics_t *metrics, metrics_values_t *values) {
+	int before, after;
+	do {
+		before = SDL_AtomicGet(&metrics->sequence);
+		METRICS_LOAD(values->instructions, metrics->values.instructions);
+		METRICS_LOAD(values->frames, metrics->values.frames);
+		METRICS_LOAD(values->missed, metrics->values.missed);
+		for(uint32_t i = 0; i < METRICS_RENDER_BUCKETS; i++) {
+			METRICS_LOAD(values->render_buckets[i], metrics->values.render_buckets[i]);
+		}
+		METRICS_LOAD(values->render_count, metrics->values.render_count);
+		METRICS_LOAD(values->render_seconds, metrics->values.render_seconds);
+		METRICS_LOAD(values->state, metrics->values.state);
+		SDL_MemoryBarrierAcquire();
+		after = SDL_AtomicGet(&metrics->sequence);
+	} while(before != after || (before & 1));
+}
+
+// Prometheus text exposition format, returns the length written
+int metrics_format(metrics_t *metrics, char *out, const size_t size) {
+	metrics_values_t values;
+	metrics_read(metrics, &values);
+	const int underruns = metrics->audio_stats ? SDL_AtomicGet(&metrics->audio_stats->underruns) : 0;
+
+	int len = snprintf(out, size,
+		"# HELP chip8_instructions_total CHIP8 instructions emulated.\n"
+		"# TYPE chip8_instructions_total counter\n"
+		"chip8_instructions_total %llu\n"
+		"# HELP chip8_frames_total 60hz frames run.\n"
+		"# TYPE chip8_frames_total counter\n"
+		"chip8_frames_total %llu\n"
+		"# HELP chip8_missed_deadlines_total Frames longer than the 60hz period.\n"
+		"# TYPE chip8_missed_deadlines_total counter\n"
+		"chip8_missed_deadlines_total %llu\n"
+		"# HELP chip8_audio_underruns_total Audio callbacks late enough for the device to run dry.\n"
+		"# TYPE chip8_audio_underruns_total counter\n"
+		"chip8_audio_underruns_total %d\n"
+		"# HELP chip8_render_seconds Time spent drawing a frame.\n"
+		"# TYPE chip8_render_seconds histogram\n",
+		(unsigned long long)values.instructions, (unsigned long long)values.frames,
+		(unsigned long long)values.missed, underruns);
+
+	for(uint32_t i = 0; i < METRICS_RENDER_BUCKETS; i++) {
+		len += snprintf(out + len, size - len, "chip8_render_seconds_bucket{le=\"%g\"} %llu\n",
+						metrics_render_bounds[i], (unsigned long long)values.render_buckets[i]);
+	}
+
+	len += snprintf(out + len, size - len,
+		"chip8_render_seconds_bucket{le=\"+Inf\"} %llu\n"
+		"chip8_render_seconds_sum %.6f\n"
+		"chip8_render_seconds_count %llu\n"
+		"# HELP chip8_state Current emulator state, 1 for the state it is in.\n"
+		"# TYPE chip8_state gauge\n"
+		"chip8_state{state=\"running\"} %d\n"
+		"chip8_state{state=\"paused\"} %d\n"
+		"chip8_state{state=\"quit\"} %d\n",
+		(unsigned long long)values.render_count, values.render_seconds, (unsigned long long)values.render_count,
+		values.state == RUNNING, values.state == PAUSED, values.state == QUIT);
+
+	return len;
+}
+
+#ifndef _WIN32
+// Metrics thread, answers every connection with the current metrics as HTTP
+int metrics_server(void *data) {
+	metrics_t *metrics = data;
+	char body[4096];
+	char response[sizeof body + 256];
+
+	while(!SDL_AtomicGet(&metrics->stop)) {
+		struct pollfd pfd = {.fd = metrics->listen_fd, .events = POLLIN};
+		if(poll(&pfd, 1, 100) <= 0) continue;
+
+		const int client = accept(metrics->listen_fd, NULL, NULL);
+		if(client < 0) continue;
+
+		// There is only 1 page, the request just has to arrive
+		char request[1024];
+		struct pollfd request_pfd = {.fd = client, .events = POLLIN};
+		if(poll(&request_pfd, 1, 1000) > 0 && read(client, request, sizeof request) > 0) {
+			const int body_len = metrics_format(metrics, body, sizeof body);
+			const int len = snprintf(response, sizeof response,
+									 "HTTP/1.0 200 OK\r\n"
+									 "Content-Type: text/plain; version=0.0.4\r\n"
+									 "Content-Length: %d\r\n"
+									 "Connection: close\r\n\r\n%s", body_len, body);
+			if(write(client, response, len) != len) SDL_Log("Metrics write failed: %s\n", strerror(errno));
+		}
+		close(client);
+	}
+
+	return 0;
+}
+
+bool metrics_init(metrics_t *metrics, const char *address, audio_stats_t *audio_stats) {
+	*metrics = (metrics_t){.audio_stats = audio_stats};
+
+	metrics->listen_fd = listen_socket(address, "metrics", &metrics->unix_path);
+	if(metrics->listen_fd < 0) return false;
+
+	metrics->server = SDL_CreateThread(metrics_server, "metrics", metrics);
+	if(!metrics->server) {
+		SDL_Log("Could not start metrics thread: %s\n", SDL_GetError());
+		close(metrics->listen_fd);
+		return false;
+	}
+
+	SDL_Log("Serving metrics on %s\n", address);
+	return true;
+}
+
+void metrics_close(metrics_t *metrics) {
+	SDL_AtomicSet(&metrics->stop, 1);
+	SDL_WaitThread(metrics->server, NULL);
+	close(metrics->listen_fd);
+	if(metrics->unix_path) unlink(metrics->unix_path);
+}
+#else
+bool metrics_init(metrics_t *metrics, const char *address, audio_stats_t *audio_stats) {
+	(void)metrics; (void)address; (void)audio_stats;
+	SDL_Log("The metrics endpoint needs POSIX sockets\n");
+	return false;
+}
+
+void metrics_close(metrics_t *metrics) { (void)metrics; }
+#endif
+
+// Shared state of a fuzzing campaign, workers only touch it under lock
+typedef struct {
+	const config_t *config;
+	const chip8_t *parent;			// Start state every case runs from
+	SDL_mutex *lock;
+	uint8_t virgin[EDGE_MAP_SIZE];	// Hit count buckets seen so far per edge
+	uint16_t **corpus;				// Keypad bitmask per frame for each kept input
+	uint32_t corpus_size;
+	uint32_t corpus_cap;
+	uint32_t edges;					// Edges with at least 1 hit
+	uint32_t crashes;				// Unique (fault, PC) pairs found
+	uint32_t crash_keys[256];		// fault << 16 | PC of each unique crash
+	SDL_atomic_t execs;				// Cases run since the stats were last printed
+	SDL_atomic_t live;				// Workers still running, they can quit early when out of memory
+	SDL_atomic_t stop;
+} fuzzer_t;
+
+static const char *const fault_names[] = {
+	[FAULT_NONE] = "none",
+	[FAULT_STACK_OVERFLOW] = "stack-overflow",
+	[FAULT_STACK_UNDERFLOW] = "stack-underflow",
+	[FAULT_BAD_ADDRESS] = "bad-address",
+	[FAULT_BAD_KEY] = "bad-key",
+	[FAULT_BAD_OPCODE] = "bad-opcode",
+	[FAULT_NO_MEMORY] = "no-memory",
+};
+
+// Collapse a hit count into one bit per AFL style bucket: 1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128+
+static inline uint8_t edge_bucket(const uint8_t hits) {
+	if(hits <= 3) return hits == 3 ? 0x04 : hits;
+	if(hits <= 7) return 0x08;
+	if(hits <= 15) return 0x10;
+	if(hits <= 31) return 0x20;
+	if(hits <= 127) return 0x40;
+	return 0x80;
+}
+
+// Write a fuzz input as a movie that starts from the fuzzing parent state, so it
+//	can be replayed and verified with --play
+void fuzz_write_movie(const char *path, const fuzzer_t *fuzzer, const uint16_t *input,
+					  const uint32_t frames, const chip8_t *end) {
+	const uint32_t insts_per_frame = fuzzer->config->insts_per_second / 60;
+	movie_t movie = {0};
+
+	if(!movie_start_recording(&movie, path, fuzzer->parent, *fuzzer->config)) return;
+
+	const uint8_t tag = MOVIE_TAG_KEYFRAME;
+	snapshot_t snapshot = {0};
+	save_snapshot(fuzzer->parent, &snapshot);
+
+	// Keyframes hold the input of their own frame, like when recording
+	for(uint8_t key = 0; key < 16; key++) {
+		snapshot.regs.keypad[key] = (input[0] >> key) & 1;
+	}
+	fwrite(&tag, sizeof tag, 1, movie.file);
+	fwrite(&snapshot, sizeof snapshot, 1, movie.file);
+
+	// Frame 0's input is logged as events too, playback from boot never loads the keyframe
+	uint16_t keys = 0;
+	for(uint8_t key = 0; key < 16; key++) {
+		keys |= (uint16_t)movie.keypad[key] << key;
+	}
+	for(uint32_t frame = 0; frame < frames; frame++) {
+		const uint64_t inst_count = snapshot.regs.inst_count + (uint64_t)frame * insts_per_frame;
+		for(uint8_t key = 0; key < 16; key++) {
+			if(((input[frame] ^ keys) >> key) & 1)
+				movie_write_event(&movie, inst_count, key, (input[frame] >> key) & 1);
+		}
+		keys = input[frame];
+	}
+
+	movie_close(&movie, end);
+}
+
+// Run one input from the parent state, returns the number of frames emulated
+uint32_t fuzz_run_case(const chip8_pool_t *pool, chip8_t *clone, const uint16_t *input,
+					   const uint32_t frames, const config_t config) {
+	pool_reset(pool, clone);
+	clone->fault = FAULT_NONE;
+
+	for(uint32_t frame = 0; frame < frames; frame++) {
+		for(uint8_t key = 0; key < 16; key++) {
+			clone->keypad[key] = (input[frame] >> key) & 1;
+		}
+
+		advance_frame(clone, config);
+		if(clone->fault != FAULT_NONE) return frame + 1;
+	}
+
+	return frames;
+}
+
+// Apply 1-4 stacked random mutations to a keypad input sequence
+void fuzz_mutate(uint16_t *input, const uint32_t frames, uint32_t *rng, fuzzer_t *fuzzer) {
+	const uint32_t mutations = 1 + xorshift32(rng) % 4;
+
+	for(uint32_t m = 0; m < mutations; m++) {
+		const uint32_t start = xorshift32(rng) % frames;
+		const uint32_t len = 1 + xorshift32(rng) % (frames - start < 60 ? frames - start : 60);
+		const uint16_t key_bit = 1 << (xorshift32(rng) % 16);
+
+		switch(xorshift32(rng) % 5) {
+			case 0:
+				// Press or release one key for a span of frames
+				for(uint32_t f = start; f < start + len; f++) input[f] ^= key_bit;
+				break;
+
+			case 1: {
+				// Hold one random key combination for a span
+				const uint16_t keys = xorshift32(rng) & xorshift32(rng);
+				for(uint32_t f = start; f < start + len; f++) input[f] = keys;
+				break;
+			}
+
+			case 2:
+				// Release everything for a span
+				memset(&input[start], 0, len * sizeof *input);
+				break;
+
+			case 3:
+				// Flip a single key for a single frame
+				input[start] ^= key_bit;
+				break;
+
+			case 4: {
+				// Splice the tail of another kept input over ours
+				SDL_LockMutex(fuzzer->lock);
+				const uint16_t *other = fuzzer->corpus[xorshift32(rng) % fuzzer->corpus_size];
+				memcpy(&input[start], &other[start], (frames - start) * sizeof *input);
+				SDL_UnlockMutex(fuzzer->lock);
+				break;
+			}
+		}
+	}
+}
+
+// Keep an input that reached new edge buckets, called under lock. False if it could not be kept
+bool fuzz_add_to_corpus(fuzzer_t *fuzzer, const uint16_t *input, const uint32_t frames) {
+	if(fuzzer->corpus_size == fuzzer->corpus_cap) {
+		const uint32_t cap = fuzzer->corpus_cap ? fuzzer->corpus_cap * 2 : 64;
+		uint16_t **corpus = realloc(fuzzer->corpus, cap * sizeof *corpus);
+		if(!corpus) {
+			SDL_Log("Could not grow the fuzzing corpus to %u inputs\n", cap);
+			return false;
+		}
+		fuzzer->corpus = corpus;
+		fuzzer->corpus_cap = cap;
+	}
+
+	uint16_t *copy = malloc(frames * sizeof *copy);
+	if(!copy) {
+		SDL_Log("Could not allocate a fuzzing input of %u frames\n", frames);
+		return false;
+	}
+	memcpy(copy, input, frames * sizeof *copy);
+	fuzzer->corpus[fuzzer->corpus_size++] = copy;
+	return true;
+}
+
+// Fuzzing worker thread: clone the parent, mutate corpus inputs and keep the ones
+//	that find new edges or raise new faults
+int fuzz_worker(void *data) {
+	fuzzer_t *fuzzer = data;
+	const config_t config = *fuzzer->config;
+	const uint32_t frames = config.fuzz_frames;
+
+	chip8_pool_t pool = {0};
+	if(!pool_init(&pool, fuzzer->parent, 1)) {
+		SDL_AtomicAdd(&fuzzer->live, -1);
+		return 1;
+	}
+	chip8_t *clone = &pool.clones[0];
+
+	uint8_t *trace = malloc(EDGE_MAP_SIZE);
+	uint16_t *input = malloc(frames * sizeof *input);
+	if(!trace || !input) {
+		SDL_Log("Could not allocate a fuzzing worker\n");
+		free(trace);
+		free(input);
+		pool_free(&pool);
+		SDL_AtomicAdd(&fuzzer->live, -1);
+		return 1;
+	}
+	uint32_t rng = (uint32_t)SDL_GetPerformanceCounter() | 1;
+	clone->edge_map = trace;
+	update_instrumentation(clone);
+
+	while(!SDL_AtomicGet(&fuzzer->stop)) {
+		SDL_LockMutex(fuzzer->lock);
+		memcpy(input, fuzzer->corpus[xorshift32(&rng) % fuzzer->corpus_size], frames * sizeof *input);
+		SDL_UnlockMutex(fuzzer->lock);
+
+		fuzz_mutate(input, frames, &rng, fuzzer);
+
+		memset(trace, 0, EDGE_MAP_SIZE);
+		const uint32_t ran = fuzz_run_case(&pool, clone, input, frames, config);
+		SDL_AtomicAdd(&fuzzer->execs, 1);
+
+		// Racy pre-check against the shared map, confirmed under lock
+		bool interesting = false;
+		for(uint32_t i = 0; i < EDGE_MAP_SIZE && !interesting; i++) {
+			interesting = trace[i] && (edge_bucket(trace[i]) & ~fuzzer->virgin[i]);
+		}
+
+		// Movies are written after unlocking, from this worker's own input and clone
+		char path[4096];
+		bool write_movie = false;
+
+		if(interesting) {
+			SDL_LockMutex(fuzzer->lock);
+			bool new_buckets = false;
+			for(uint32_t i = 0; i < EDGE_MAP_SIZE; i++) {
+				if(!trace[i]) continue;
+				const uint8_t bucket = edge_bucket(trace[i]);
+				if(!(bucket & ~fuzzer->virgin[i])) continue;
+				if(!fuzzer->virgin[i]) fuzzer->edges++;
+				fuzzer->virgin[i] |= bucket;
+				new_buckets = true;
+			}
+
+			if(new_buckets && fuzz_add_to_corpus(fuzzer, input, frames) && config.fuzz_dir) {
+				snprintf(path, sizeof path, "%s/queue-%06u.c8mv", config.fuzz_dir, fuzzer->corpus_size - 1);
+				write_movie = true;
+			}
+			SDL_UnlockMutex(fuzzer->lock);
+
+			if(write_movie) fuzz_write_movie(path, fuzzer, input, ran, clone);
+		}
+
+		if(clone->fault != FAULT_NONE) {
+			const uint32_t key = (uint32_t)clone->fault << 16 | clone->fault_PC;
+			write_movie = false;
+
+			SDL_LockMutex(fuzzer->lock);
+			bool seen = false;
+			for(uint32_t i = 0; i < fuzzer->crashes && !seen; i++) {
+				seen = fuzzer->crash_keys[i] == key;
+			}
+
+			if(!seen && fuzzer->crashes < sizeof fuzzer->crash_keys / sizeof fuzzer->crash_keys[0]) {
+				fuzzer->crash_keys[fuzzer->crashes++] = key;
+				printf("[fuzz] %s at PC 0x%04X after %u frames\n",
+					   fault_names[clone->fault], clone->fault_PC, ran);
+
+				if(config.fuzz_dir) {
+					snprintf(path, sizeof path, "%s/crash-%s-0x%04X.c8mv", config.fuzz_dir,
+							 fault_names[clone->fault], clone->fault_PC);
+					write_movie = true;
+				}
+			}
+			SDL_UnlockMutex(fuzzer->lock);
+
+			if(write_movie) fuzz_write_movie(path, fuzzer, input, ran, clone);
+		}
+	}
+
+	free(input);
+	free(trace);
+	pool_free(&pool);
+	SDL_AtomicAdd(&fuzzer->live, -1);
+	return 0;
+}
+
+// Coverage guided keypad input fuzzing from the parent state on config.fuzz_jobs threads,
+//	returns true if no faults were found and the workers kept running
+bool run_fuzzer(const chip8_t *parent, const config_t config) {
+	static fuzzer_t fuzzer;	// Large, keep it off the stack
+	fuzzer = (fuzzer_t) {
+		.config = &config,
+		.parent = parent,
+		.lock = SDL_CreateMutex(),
+	};
+	if(!fuzzer.lock) {
+		SDL_Log("Could not create the fuzzer lock: %s\n", SDL_GetError());
+		return false;
+	}
+
+	if(config.fuzz_dir && mkdir(config.fuzz_dir, 0755) != 0 && errno != EEXIST) {
+		SDL_Log("Could not create fuzzing output directory %s\n", config.fuzz_dir);
+		SDL_DestroyMutex(fuzzer.lock);
+		return false;
+	}
+
+	// Seed the corpus with no input at all
+	uint16_t *empty = calloc(config.fuzz_frames, sizeof *empty);
+	const bool seeded = empty && fuzz_add_to_corpus(&fuzzer, empty, config.fuzz_frames);
+	free(empty);
+
+	const uint32_t jobs = config.fuzz_jobs ? config.fuzz_jobs : (uint32_t)SDL_GetCPUCount();
+	SDL_Thread **workers = calloc(jobs, sizeof *workers);
+	if(!seeded || !workers) {
+		SDL_Log("Could not allocate the fuzzer\n");
+		free(workers);
+		if(seeded) free(fuzzer.corpus[0]);
+		free(fuzzer.corpus);
+		SDL_DestroyMutex(fuzzer.lock);
+		return false;
+	}
+	// Only the threads that started are waited on, a failed one is logged and left out
+	uint32_t started = 0;
+	for(uint32_t i = 0; i < jobs; i++) {
+		SDL_AtomicAdd(&fuzzer.live, 1);
+		workers[started] = SDL_CreateThread(fuzz_worker, "fuzz", &fuzzer);
+		if(workers[started]) {
+			started++;
+		} else {
+			SDL_AtomicAdd(&fuzzer.live, -1);
+			SDL_Log("Could not start fuzzing worker %u: %s\n", i, SDL_GetError());
+		}
+	}
+
+	printf("[fuzz] %u jobs, %u frames per case\n", started, config.fuzz_frames);
+
+	uint64_t execs = 0;
+	bool workers_lost = started == 0;
+	for(uint32_t seconds = 1; !workers_lost && (!config.fuzz_seconds || seconds <= config.fuzz_seconds); seconds++) {
+		SDL_Delay(1000);
+		const uint32_t recent = (uint32_t)SDL_AtomicSet(&fuzzer.execs, 0);
+		execs += recent;
+
+		SDL_LockMutex(fuzzer.lock);
+		printf("[fuzz] %us execs %llu (%u/s) corpus %u edges %u crashes %u\n",
+			   seconds, (unsigned long long)execs, recent, fuzzer.corpus_size, fuzzer.edges, fuzzer.crashes);
+		SDL_UnlockMutex(fuzzer.lock);
+		fflush(stdout);
+
+		workers_lost = SDL_AtomicGet(&fuzzer.live) == 0;
+	}
+	if(workers_lost) SDL_Log("No fuzzing workers left running\n");
+
+	SDL_AtomicSet(&fuzzer.stop, 1);
+	for(uint32_t i = 0; i < started; i++) {
+		SDL_WaitThread(workers[i], NULL);
+	}
+	free(workers);
+
+	for(uint32_t i = 0; i < fuzzer.corpus_size; i++) {
+		free(fuzzer.corpus[i]);
+	}
+	free(fuzzer.corpus);
+	SDL_DestroyMutex(fuzzer.lock);
+
+	return !workers_lost && fuzzer.crashes == 0;
+}
+
+// Run every ROM in the corpus for batch_frames frames without a window and print its final
+//	state hash. Machines are initialised straight from the mapped images, so after the
+//	corpus is mapped the run is pure emulation
+bool run_batch(const rom_corpus_t *corpus, const config_t config) {
+	const uint64_t start = SDL_GetPerformanceCounter();
+	uint32_t failed = 0;
+
+	for(uint32_t i = 0; i < corpus->num_roms; i++) {
+		const rom_image_t *rom = &corpus->roms[i];
+		chip8_t chip8 = {0};
+		if(!init_chip8_image(&chip8, rom->data, rom->size, rom->name)) {
+			failed++;
+			continue;
+		}
+		chip8.rng_state = 1;	// Fixed seed, batch runs are compared against each other
+		chip8.quirks = config.quirks == QUIRKS_AUTO ? rom->quirks : config.quirks;
+		if(!attach_translation(&chip8, config.cache_dir)) {
+			free_chip8(&chip8);
+			failed++;
+			continue;
+		}
+
+		for(uint32_t frame = 0; frame < config.batch_frames; frame++) advance_frame(&chip8, config);
+
+		printf("%016llX %s", (unsigned long long)state_hash(&chip8), rom->name);
+		if(chip8.fault != FAULT_NONE) printf(" %s at 0x%03X", fault_names[chip8.fault], chip8.fault_PC);
+		printf("\n");
+		free_chip8(&chip8);
+	}
+
+	const double seconds = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+	SDL_Log("Ran %u ROMs for %u frames each in %.2fs\n", corpus->num_roms - failed, config.batch_frames, seconds);
+	return failed == 0;
+}
+
+// Update CHIP8 delay and sound timers every 60hz
+void update_timers(const sdl_t sdl, const config_t config, chip8_t *chip8) {
+	if(chip8->delay_timer > 0)
+		chip8->delay_timer--;
+
+	// Hand a changed XO-CHIP pattern or pitch over to the audio callback
+	audio_pattern_t *pattern = config.audio_pattern;
+	if(pattern && (pattern->enabled != chip8->pattern_audio || pattern->pitch != chip8->pitch ||
+				   memcmp(pattern->bits, chip8->audio_pattern, sizeof pattern->bits) != 0)) {
+		// 4000 * 2^((pitch - 64) / 48) bits per second, by octaves then 48ths of an octave
+		double rate = 4000.0;
+		int32_t steps = chip8->pitch - 64;
+		for(; steps < 0; steps += 48) rate /= 2;
+		for(; steps >= 48; steps -= 48) rate *= 2;
+		for(; steps > 0; steps--) rate *= 1.0145453349375237;	// 2^(1/48)
+
+		SDL_LockAudioDevice(sdl.dev);
+		pattern->enabled = chip8->pattern_audio;
+		pattern->pitch = chip8->pitch;
+		memcpy(pattern->bits, chip8->audio_pattern, sizeof pattern->bits);
+		pattern->step = (uint32_t)(rate * 65536 / config.audio_sample_rate);
+		SDL_UnlockAudioDevice(sdl.dev);
+	}
+
+	if(chip8->sound_timer > 0) {
+		chip8->sound_timer--;
+		// The gap since the device was paused is not an underrun
+		audio_stats_t *stats = config.audio_stats;
+		if(stats && SDL_GetAudioDeviceStatus(sdl.dev) != SDL_AUDIO_PLAYING) SDL_AtomicSet(&stats->last_callback, 0);
+		SDL_PauseAudioDevice(sdl.dev, 0);	// Play sound
+	} else {
+		SDL_PauseAudioDevice(sdl.dev, 1);	// Pause sound
+	}
+}
+
+// Default usage message for args
+void print_usage(const char *program) {
+	fprintf(stderr,
+		"Usage: %s <rom_name> [options]\n"
+		"  --ips n                    instructions per second, default 700\n"
+		"  --palette c0,c1,c2,c3      RRGGBBAA colors for background, plane 0, plane 1, both planes\n"
+		"  --run-ahead frames         show frames emulated ahead of input\n"
+		"  --record movie             record input to a movie file\n"
+		"  --play movie               play input back from a movie file\n"
+		"  --seek inst_count          start playback at an instruction count\n"
+		"  --headless                 play back without a window, as fast as possible\n"
+		"  --keyframe-interval frames frames between movie keyframes\n"
+		"  --fuzz                     coverage guided input fuzzing\n"
+		"  --fuzz-jobs n              fuzzing threads, default 1 per CPU\n"
+		"  --fuzz-frames n            frames of input per fuzz case\n"
+		"  --fuzz-time seconds        stop fuzzing after this long\n"
+		"  --fuzz-dir dir             save kept inputs and crashes as movies\n"
+		"  --trace file               write a binary instruction trace on exit\n"
+		"  --trace-size records       instructions kept in the trace ring buffer\n"
+		"  --trace-frames file        write frame phase timings as Chrome trace JSON\n"
+		"  --stats                    print frame time percentiles on exit, F1 shows them live\n"
+		"  --profile file             write sampled guest call stacks as folded stacks\n"
+		"  --profile-interval n       instructions between profiler samples\n"
+		"  --coverage file            write executed, read and written addresses on exit\n"
+		"  --coverage-listing file    write the ROM annotated with coverage on exit\n"
+		"  --perf                     report host cycles, IPC and cache/branch misses on exit (Linux)\n"
+		"  --break addr               pause before the instruction at addr, space resumes\n"
+		"  --watch addr[:len]         pause after an instruction reads or writes data there\n"
+		"  --watch-read addr[:len]    pause after an instruction reads data there\n"
+		"  --watch-write addr[:len]   pause after an instruction writes there\n"
+		"  --gdb port|path            serve GDB remote protocol on a localhost port or Unix socket\n"
+		"  --metrics port|path        serve Prometheus metrics on a localhost port or Unix socket\n"
+		"  --corpus dir|file          map every .ch8 in dir, or a packed corpus, once and take the ROM\n"
+		"                             from it by name or hex hash\n"
+		"  --quirks profile|flags     force default, cosmac, schip, xochip or QUIRK_* flags instead of\n"
+		"                             picking them by ROM hash\n"
+		"  --cache dir                keep ROM translations in dir and map them on the next run\n"
+		"Usage: %s <rom_name> --cfg file  write the ROM's static control flow graph as JSON\n"
+		"Usage: %s <rom_name> --disassemble file  write an annotated disassembly of the ROM\n"
+		"Usage: %s --decode-trace file  print a binary trace as text\n"
+		"Usage: %s --corpus dir --batch frames  run every corpus ROM and print state hashes\n"
+		"Usage: %s --corpus dir --pack-corpus file  write the corpus as one packed, mappable file\n"
+		"Usage: %s --corpus dir --disassemble dir  disassemble every corpus ROM to dir/<name>.asm\n",
+		program, program, program, program, program, program, program);
+}
+
+int main(int argc, char **argv) {
+	// Default usage message for args
+	if(argc < 2) {
+		print_usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	// Init emulator config/options
+	config_t config = {0};
+	if(!set_config_from_args(&config, argc, argv)) {
+		print_usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	// Offline tools that don't run a ROM
+	if(config.decode_file) exit(decode_trace(config.decode_file) ? EXIT_SUCCESS : EXIT_FAILURE);
+
+	// ROM corpus, mapped once for every machine started from it
+	rom_corpus_t corpus = {0};
+	if(config.corpus_path && !corpus_load(&corpus, config.corpus_path)) exit(EXIT_FAILURE);
+	if(config.disasm_path && !config.rom_name) {
+		const bool ok = disassemble_to(&corpus, NULL, config);
+		corpus_free(&corpus);
+		exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+	if(config.batch_frames || config.pack_corpus) {
+		const bool ok = config.pack_corpus ? corpus_write(&corpus, config.pack_corpus) : run_batch(&corpus, config);
+		corpus_free(&corpus);
+		exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	// Init CHIP8 machine
+	chip8_t chip8 = {0};
+	const char *rom_name = config.rom_name;
+	if(config.corpus_path) {
+		const rom_image_t *rom = corpus_find(&corpus, rom_name);
+		if(!rom) {
+			SDL_Log("Rom %s is not in corpus %s\n", rom_name, config.corpus_path);
+			exit(EXIT_FAILURE);
+		}
+		if(!init_chip8_image(&chip8, rom->data, rom->size, rom->name)) exit(EXIT_FAILURE);
+		chip8.quirks = rom->quirks;
+	} else if(!init_chip8(&chip8, rom_name)) {
+		exit(EXIT_FAILURE);
+	}
+	if(config.quirks != QUIRKS_AUTO) chip8.quirks = config.quirks;
+	if(!attach_translation(&chip8, config.cache_dir)) exit(EXIT_FAILURE);
+
+	// Static analysis of the loaded ROM instead of running it
+	if(config.cfg_file) {
+		analysis_t *analysis = malloc(sizeof *analysis);
+		if(!analysis) {
+			SDL_Log("Could not allocate ROM analysis\n");
+			exit(EXIT_FAILURE);
+		}
+		translation_analysis(chip8.translation, analysis);
+		const bool ok = analysis_save(analysis, &chip8, config.cfg_file);
+		free(analysis);
+		exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+	if(config.disasm_path) exit(disassemble_to(NULL, &chip8, config) ? EXIT_SUCCESS : EXIT_FAILURE);
+
+	// Init SDL, the audio callback reads config through a pointer so attach its pattern first
+	audio_pattern_t audio_pattern = {0};
+	if(!config.headless) config.audio_pattern = &audio_pattern;
+	sdl_t sdl = {0};
+	if(!config.headless && !init_sdl(&sdl, &config)) exit(EXIT_FAILURE);
+
+	// Instruction tracing, only the real machine is traced, never clones or run-ahead
+	tracer_t tracer = {0};
+	if(config.trace_file) {
+		if(!tracer_init(&tracer, config.trace_size)) exit(EXIT_FAILURE);
+		chip8.tracer = &tracer;
+		update_instrumentation(&chip8);
+	}
 
 	// Init screen clear to background color
-	clear_screen(sdl, config);
+	if(!config.headless) clear_screen(sdl, config);
+
+	// Seed random number generator, xorshift state must be non zero
+	chip8.rng_state = (uint32_t)time(NULL) | 1;
+
+	// Record input, or replay it with the recorded seed and clock rate
+	movie_t movie = {0};
+	if(config.play_file) {
+		if(!movie_load(&movie, config.play_file)) exit(EXIT_FAILURE);
+
+		if(movie.rom_hash != chip8.rom_hash) {
+			SDL_Log("Movie %s was recorded with a different ROM than %s\n", config.play_file, rom_name);
+			exit(EXIT_FAILURE);
+		}
+
+		chip8.rng_state = movie.seed;
+		config.insts_per_second = movie.insts_per_second;
+
+		// The recorded quirks are part of the input like the clock rate, other ones would diverge
+		if(movie.quirks != chip8.quirks) {
+			if(config.quirks != QUIRKS_AUTO) {
+				SDL_Log("Movie %s was recorded with quirks 0x%02X, not the 0x%02X given by --quirks\n",
+						config.play_file, movie.quirks, config.quirks);
+				exit(EXIT_FAILURE);
+			}
+			chip8.quirks = movie.quirks;
+			detach_translation(&chip8);
+			if(!attach_translation(&chip8, config.cache_dir)) exit(EXIT_FAILURE);
+		}
+
+		// Movies that start mid-game, e.g. fuzzer crashes, start from their first keyframe
+		uint64_t seek_inst = config.seek_inst;
+		if(movie.num_keyframes && movie.keyframes[0].regs.inst_count > seek_inst)
+			seek_inst = movie.keyframes[0].regs.inst_count;
+		if(seek_inst) movie_seek(&movie, &chip8, config, seek_inst);
+
+	} else if(config.record_file) {
+		if(!movie_start_recording(&movie, config.record_file, &chip8, config)) exit(EXIT_FAILURE);
+	}
+
+	// Guest profiler, attached after any seek so only the session itself is sampled
+	profiler_t profiler = {0};
+	if(config.profile_file) {
+		if(!profiler_init(&profiler, config.profile_interval, &chip8)) exit(EXIT_FAILURE);
+		chip8.profiler = &profiler;
+	}
 
-	// Seed random number generator
-	srand(time(NULL));
+	// Guest code coverage, also attached after any seek so only the session itself is counted
+	coverage_t coverage = {0};
+	if(config.coverage_file || config.listing_file) chip8.coverage = &coverage;
+
+	// Breakpoints and watchpoints, also attached after any seek
+	chip8.debugger = config.debugger;
+	update_instrumentation(&chip8);
+
+	// GDB remote debugging, the machine is only instrumented while GDB is connected
+	gdb_t gdb_server;
+	gdb_t *gdb = NULL;
+	if(config.gdb_address) {
+		if(!gdb_init(&gdb_server, config.gdb_address, config.debugger)) exit(EXIT_FAILURE);
+		gdb = &gdb_server;
+	}
+
+	// Prometheus metrics endpoint, served from its own thread
+	audio_stats_t audio_stats = {0};
+	metrics_t metrics_server;
+	metrics_t *metrics = NULL;
+	if(config.metrics_address) {
+		SDL_AtomicSetPtr(&config.audio_stats, &audio_stats);
+		if(!metrics_init(&metrics_server, config.metrics_address, &audio_stats)) exit(EXIT_FAILURE);
+		metrics = &metrics_server;
+	}
+
+	// Reverse execution for GDB, not with movies as their input can't be rewound
+	history_t history;
+	if(gdb && movie.mode == MOVIE_OFF) {
+		if(!history_init(&history, &chip8, config)) exit(EXIT_FAILURE);
+		gdb->history = &history;
+	}
+
+	// Host hardware counters
+	perf_counters_t perf_counters;
+	perf_counters_t *perf = NULL;
+	if(config.perf_counters && perf_counters_init(&perf_counters)) perf = &perf_counters;
+	perf_values_t perf_start;
+
+	// Fuzz from boot, or from wherever --play/--seek left the machine
+	if(config.fuzz) {
+		const bool clean = run_fuzzer(&chip8, config);
+		movie_close(&movie, &chip8);
+		exit(clean ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	// Headless playback, run the whole movie as fast as possible and check the result
+	if(config.headless) {
+		while(!movie_finished(&movie, &chip8)) {
+			movie_update(&movie, &chip8, config);
+
+			if(perf) perf_counters_read(perf, &perf_start);
+			advance_frame(&chip8, config);
+			if(perf) {
+				perf_counters_add(perf, &perf_start, &perf->emulate);
+				perf->guest_insts += config.insts_per_second / 60;
+				perf->frames++;
+			}
+		}
+		if(perf) perf_counters_report(perf);
+
+		const bool matched = !movie.has_end || movie_verify(&movie, &chip8);
+		movie_close(&movie, &chip8);
+		if(config.trace_file) tracer_save(&tracer, config.trace_file);
+		if(chip8.coverage) coverage_save(&chip8, &coverage, config.coverage_file, config.listing_file);
+		if(config.profile_file) profiler_save(&profiler, config.profile_file);
+		free_chip8(&chip8);
+		corpus_free(&corpus);
+		exit(matched ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	// Speculative machine for run-ahead, synced from chip8 on first use. Snapshots don't hold the
+	//	quirks so it takes the real machine's, and shares its translation (see free_chip8(&ahead))
+	chip8_t ahead = {.quirks = chip8.quirks, .translation = chip8.translation};
+
+	// Frame phase timings, large so kept off the stack
+	static frame_tracer_t frame_tracer;
+	frame_tracer_t *spans = NULL;
+	if(config.frame_trace_file) {
+		if(!frame_tracer_init(&frame_tracer, config.frame_trace_file)) exit(EXIT_FAILURE);
+		spans = &frame_tracer;
+	}
+
+	// Frame time telemetry
+	static frame_stats_t stats;
+	const uint64_t ticks_per_ms = SDL_GetPerformanceFrequency() / 1000;
+	uint64_t last_start = 0;
+	bool stats_in_title = false;
+
+	// A breakpoint or watchpoint can pause part way through a frame, the rest of the frame
+	//	is run on resume with the keypad it started with so movies stay deterministic
+	const uint32_t insts_per_frame = config.insts_per_second / 60;
+	const uint64_t frame_origin = chip8.inst_count;	// Frames start every insts_per_frame from here
+	uint64_t frame_start = frame_origin;
+	bool frame_keypad[16];
+	bool mid_frame = false;
 
 	// Main emulator loop
 	while(chip8.state != QUIT){
+		// Get time before handling input, start of the frame
+		const uint64_t start_input = SDL_GetPerformanceCounter();
+
 		//handle user input
-		handle_input(&chip8);
-		if(chip8.state == PAUSED) continue;
+		handle_input(&chip8, &config);
+		if(gdb) {
+			const uint64_t inst_count = chip8.inst_count;
+			gdb_poll(gdb, &chip8);
+
+			// Reverse execution moved the machine, pick up the frame it is now in
+			if(chip8.inst_count != inst_count) {
+				frame_start = chip8.inst_count - (chip8.inst_count - frame_origin) % insts_per_frame;
+				mid_frame = chip8.inst_count != frame_start;
+				memcpy(frame_keypad, chip8.keypad, sizeof frame_keypad);
+				ahead.state = QUIT;
+			}
+		}
+		if(metrics) metrics_publish(metrics, &chip8, &stats);
+		if(chip8.state == PAUSED) {
+			// A pause isn't a slow frame, the frame clock starts over on resume
+			last_start = 0;
+			continue;
+		}
+
+		bool live_keypad[16];
+		if(mid_frame) {
+			memcpy(live_keypad, chip8.keypad, sizeof live_keypad);
+			memcpy(chip8.keypad, frame_keypad, sizeof frame_keypad);
+		} else {
+			// Record input, or override it with played back input until the movie ends
+			if(movie_finished(&movie, &chip8)) {
+				if(movie.has_end) movie_verify(&movie, &chip8);
+				movie_close(&movie, &chip8);
+			} else if(movie.mode != MOVIE_OFF) {
+				movie_update(&movie, &chip8, config);
+			}
+
+			frame_start = chip8.inst_count;
+			memcpy(frame_keypad, chip8.keypad, sizeof frame_keypad);
+			if(gdb && gdb->history && !history_record(gdb->history, &chip8)) gdb_drop_history(gdb);
+		}
 
 		// Get time before running instructions
-		const uint64_t start_frame = SDL_GetPerformanceCounter();
+		const uint64_t start_frame = frame_span(spans, "handle_input", start_input);
 
 		// emulate chip8 instructions for this "frame" (60hz)
-		for(uint32_t i = 0; i < config.insts_per_second / 60; i++) {
-			emulate_instruction(&chip8, config);
+		const uint64_t batch_start = chip8.inst_count;
+		if(perf) perf_counters_read(perf, &perf_start);
+		while(chip8.inst_count - frame_start < insts_per_frame && chip8.state == RUNNING) {
+			emulate_instructions(&chip8, insts_per_frame - (chip8.inst_count - frame_start));
+		}
+		if(perf) {
+			perf_counters_add(perf, &perf_start, &perf->emulate);
+			perf->guest_insts += chip8.inst_count - batch_start;
+			perf->frames++;
 		}
 
+		if(mid_frame) memcpy(chip8.keypad, live_keypad, sizeof live_keypad);
+		mid_frame = chip8.inst_count - frame_start < insts_per_frame;
+
 		// Get time elapsed after instructions
-		const uint64_t end_frame = SDL_GetPerformanceCounter();
+		const uint64_t end_frame = frame_span(spans, "emulate", start_frame);
 
 		const double time_elapsed = (double)((end_frame - start_frame) * 1000) / SDL_GetPerformanceFrequency();
 		// Delay for approx 60hz
-		SDL_Delay(16.67f > time_elapsed ? 16.67f - time_elapsed : 0);
+		const uint32_t delay = 16.67f > time_elapsed ? 16.67f - time_elapsed : 0;
+		SDL_Delay(delay);
+		const uint64_t end_delay = frame_span(spans, "SDL_Delay", end_frame);
 
-		// Update window with changes
-		update_screen(sdl, config, chip8);
 		// Update delat and sound timers every 60hz
-		update_timers(sdl, &chip8);
+		if(!mid_frame) update_timers(sdl, config, &chip8);
+		uint64_t start_screen = frame_span(spans, "update_timers", end_delay);
+
+		// Update window with changes, showing the speculative frame when running ahead.
+		//	MegaChip state isn't snapshotted, so those frames are always shown as they are
+		const bool show_ahead = config.run_ahead_frames && !chip8.mega;
+		if(show_ahead) {
+			run_ahead(&chip8, &ahead, config);
+			start_screen = frame_span(spans, "run_ahead", start_screen);
+		}
+		if(perf) perf_counters_read(perf, &perf_start);
+		update_screen(sdl, config, show_ahead ? &ahead : &chip8);
+		if(perf) perf_counters_add(perf, &perf_start, &perf->render);
+		const uint64_t end_screen = frame_span(spans, "update_screen", start_screen);
+
+		frame_span(spans, "frame", start_input);
+		if(spans) spans->frame++;
+
+		// Frame time is measured start to start, so the first frame only starts the clock
+		histogram_record(&stats.emulate, end_frame - start_frame);
+		histogram_record(&stats.render, end_screen - start_screen);
+		if(metrics) metrics_record_render(metrics, end_screen - start_screen);
+		const uint64_t slept = end_delay - end_frame;
+		histogram_record(&stats.overshoot, slept > delay * ticks_per_ms ? slept - delay * ticks_per_ms : 0);
+		if(last_start) {
+			histogram_record(&stats.frame, start_input - last_start);
+			if(start_input - last_start > 17.67 * ticks_per_ms) stats.missed++;
+		}
+		last_start = start_input;
+
+		// Refresh the stats in the window title once a second, put the title back when toggled off
+		stats.frames++;
+		if(config.show_stats && stats.frames % 60 == 0) {
+			show_frame_stats(sdl, &stats);
+			stats_in_title = true;
+		} else if(!config.show_stats && stats_in_title) {
+			SDL_SetWindowTitle(sdl.window, "Chip-8 Emulator");
+			stats_in_title = false;
+		}
 	}
 
 	// Final cleanup
+	if(config.print_stats) print_frame_stats(&stats);
+	if(perf) perf_counters_report(perf);
+	if(spans) frame_tracer_close(spans);
+	movie_close(&movie, &chip8);
+	if(config.trace_file) tracer_save(&tracer, config.trace_file);
+	if(chip8.coverage) coverage_save(&chip8, &coverage, config.coverage_file, config.listing_file);
+	if(config.profile_file) profiler_save(&profiler, config.profile_file);
+	if(gdb && gdb->history) history_free(gdb->history);
+	if(gdb) gdb_close(gdb);
+	if(metrics) metrics_close(metrics);
+	free(config.debugger);
+	ahead.translation = NULL;
+	free_chip8(&ahead);
+	free_chip8(&chip8);
+	corpus_free(&corpus);	// After chip8, whose ROM name points into it
 	final_cleanup(sdl);
 
 	exit(EXIT_SUCCESS);